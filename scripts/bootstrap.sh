@@ -41,8 +41,8 @@ POSTGRES_VERSION=${POSTGRES_VERSION:-9.5}
 
 ## User-customizable variables
 FDWVERSION=${FDWVERSION:-v1.4.1}
-YAJLCLONEURL=${YAJLCLONEURL:-https://github.com/quasar-analytics/yajl}
-YAJLVERSION=${YAJLVERSION:-646b8b82ce5441db3d11b98a1049e1fcb50fe776}
+YAJLCLONEURL=${YAJLCLONEURL:-https://github.com/lloyd/yajl}
+YAJLVERSION=${YAJLVERSION:-2.1.0}
 FDWCLONEURL=${FDWCLONEURL:-https://github.com/quasar-analytics/quasar-fdw}
 QUASARJARURL=${QUASARJARURL:-https://github.com/quasar-analytics/quasar/releases/download/v13.1.8-quasar-web/quasar-web-assembly-13.1.8.jar}
 
@@ -386,7 +386,7 @@ function help()
     echo " -q|--with-quasar         Download matching Quasar version"
     echo "Env Vars:"
     echo " FDWVERSION:  Quasar FDW Git Reference (Default: master)"
-    echo " YAJLVERSION: Yajl Git Reference (Default: yajl_reset)"
+    echo " YAJLVERSION: Yajl Git Reference (Default: 2.1.0)"
     exit 1
 }
 
@@ -0,0 +1,526 @@
+/*-------------------------------------------------------------------------
+ *
+ * Quasar Foreign Data Wrapper for PostgreSQL
+ *
+ * Copyright (c) 2015 SlamData Inc
+ *
+ * This software is released under the Apache 2 license
+ *
+ * Author: Jon Eisen <jon@joneisen.works>
+ *
+ * IDENTIFICATION
+ *            quasar_fdw/src/quasar_admit.c
+ *
+ * Admission control of requests to Quasar across backends
+ *
+ * A server with the max_inflight option lets at most that many requests
+ * from all backends of the cluster run against it at once. Others wait
+ * their turn in a FIFO queue, sleeping on their latch under the
+ * QuasarAdmission wait event. Queries have a lane of their own which is
+ * always served before the lane of planning-time requests (estimates
+ * and compiles), so planning can't crowd out execution.
+ *
+ * The state lives in shared memory, which needs quasar_fdw in
+ * shared_preload_libraries; otherwise requests are never held back.
+ * So they aren't when the shared tables are full either, or once a
+ * request has waited its first byte timeout in line: limiting is best
+ * effort, it never fails a query by itself.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "quasar_fdw.h"
+
+#include "lib/ilist.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#if (PG_VERSION_NUM >= 170000)
+#include "utils/wait_event.h"
+#endif
+
+/* Servers which can be limited at once */
+#define ADMIT_SLOTS 64
+/* Longest server option told apart */
+#define ADMIT_KEY_LEN 256
+
+#if (PG_VERSION_NUM >= 90600)
+
+/* A backend waiting for its turn */
+typedef struct QuasarAdmitWaiter
+{
+    dlist_node node;            /* in its slot's queue, or the free list */
+    Latch *latch;
+    bool granted;               /* set by whoever let it in */
+} QuasarAdmitWaiter;
+
+/* Limit and queues of one server */
+typedef struct QuasarAdmitSlot
+{
+    char server[ADMIT_KEY_LEN]; /* empty for an unused slot */
+    int limit;                  /* max_inflight last asked for */
+    int inflight;
+    dlist_head queue[QUASAR_LANES];
+} QuasarAdmitSlot;
+
+typedef struct QuasarAdmitShared
+{
+    LWLock *lock;
+    dlist_head free_waiters;
+    QuasarAdmitSlot slots[ADMIT_SLOTS];
+    QuasarAdmitWaiter waiters[FLEXIBLE_ARRAY_MEMBER];
+} QuasarAdmitShared;
+
+static QuasarAdmitShared *admit = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if (PG_VERSION_NUM >= 150000)
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+/* An admission this backend holds, and the subtransaction of its scan */
+typedef struct QuasarAdmitHeld
+{
+    int slot;
+    SubTransactionId subid;
+} QuasarAdmitHeld;
+
+/* What this backend holds, so nothing outlives a failed transaction */
+static List *held = NIL;                /* QuasarAdmitHeld, once per request */
+static QuasarAdmitWaiter *waiting = NULL;
+static int waiting_slot = -1;
+
+static void admit_shmem_request(void);
+static void admit_shmem_startup(void);
+static Size admit_shmem_size(void);
+static int admit_max_waiters(void);
+static int admit_find_slot(const char *server);
+static void admit_grant(QuasarAdmitSlot *slot);
+static void admit_stop_waiting(void);
+static QuasarAdmitHeld *admit_find_held(int slotno);
+static void admit_release_held(QuasarAdmitHeld *entry);
+#if (PG_VERSION_NUM >= 100000)
+static uint32 admit_wait_event(void);
+#endif
+
+#endif
+
+/*
+ * Ask for the shared memory, called from _PG_init.
+ * Does nothing unless we are being preloaded.
+ */
+extern void
+QuasarAdmitInit(void)
+{
+#if (PG_VERSION_NUM >= 90600)
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+
+#if (PG_VERSION_NUM >= 150000)
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = admit_shmem_request;
+#else
+    admit_shmem_request();
+#endif
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = admit_shmem_startup;
+#endif
+}
+
+/*
+ * Wait until a request to server may be sent, with at most limit
+ * requests in flight to it. Returns the slot to give back to
+ * QuasarAdmitRelease, QUASAR_ADMIT_UNLIMITED if the request wasn't
+ * counted, or QUASAR_ADMIT_TIMEOUT if it waited timeout_ms in vain.
+ * A timeout_ms of 0 waits for as long as it takes.
+ * subid is the subtransaction of the scan, see QuasarAdmitReleaseSub.
+ */
+extern int
+QuasarAdmit(const char *server, int limit, int lane, long timeout_ms,
+            SubTransactionId subid)
+{
+#if (PG_VERSION_NUM >= 90600)
+    static bool warned = false;
+    QuasarAdmitSlot *slot;
+    QuasarAdmitHeld *entry;
+    MemoryContext oldcontext;
+    TimestampTz deadline;
+    int i, ahead;
+
+    if (limit <= 0)
+        return QUASAR_ADMIT_UNLIMITED;
+
+    if (admit == NULL)
+    {
+        if (!warned)
+            elog(WARNING, "quasar_fdw: max_inflight needs quasar_fdw in shared_preload_libraries");
+        warned = true;
+        return QUASAR_ADMIT_UNLIMITED;
+    }
+
+    LWLockAcquire(admit->lock, LW_EXCLUSIVE);
+
+    i = admit_find_slot(server);
+    if (i < 0)
+    {
+        LWLockRelease(admit->lock);
+        elog(DEBUG1, "quasar_fdw: no admission slot left for %s", server);
+        return QUASAR_ADMIT_UNLIMITED;
+    }
+    slot = &admit->slots[i];
+    slot->limit = limit;
+
+    /* FIFO: nobody may pass those queued in our lane or a better one */
+    for (ahead = 0; ahead <= lane; ++ahead)
+    {
+        if (!dlist_is_empty(&slot->queue[ahead]))
+            break;
+    }
+
+    if (ahead > lane && slot->inflight < slot->limit)
+        ++slot->inflight;
+    else if (admit_find_held(i) != NULL)
+    {
+        /* Another scan of ours is in already, and may be paused until
+         * the executor gets back to it: waiting behind it would hang */
+        ++slot->inflight;
+    }
+    else if (dlist_is_empty(&admit->free_waiters))
+    {
+        /* Can't queue, let it through rather than fail the query */
+        ++slot->inflight;
+        elog(DEBUG1, "quasar_fdw: admission queue full for %s", server);
+    }
+    else
+    {
+        waiting = dlist_container(QuasarAdmitWaiter, node,
+                                  dlist_pop_head_node(&admit->free_waiters));
+        waiting->latch = MyLatch;
+        waiting->granted = false;
+        waiting_slot = i;
+        dlist_push_tail(&slot->queue[lane], &waiting->node);
+    }
+
+    LWLockRelease(admit->lock);
+
+    if (waiting != NULL)
+    {
+        elog(DEBUG1, "quasar_fdw: waiting for a turn to query %s", server);
+        deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), timeout_ms);
+
+        for (;;)
+        {
+            bool granted;
+            long secs, wait_ms;
+            int usecs, rc;
+
+            LWLockAcquire(admit->lock, LW_EXCLUSIVE);
+            granted = waiting->granted;
+            LWLockRelease(admit->lock);
+
+            if (granted || (timeout_ms > 0 && GetCurrentTimestamp() >= deadline))
+                break;
+
+            wait_ms = TRANSFER_WAIT_MS;
+            if (timeout_ms > 0)
+            {
+                TimestampDifference(GetCurrentTimestamp(), deadline, &secs, &usecs);
+                wait_ms = secs * 1000 + (usecs + 999) / 1000;
+            }
+#if (PG_VERSION_NUM >= 100000)
+            rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                           wait_ms, admit_wait_event());
+#else
+            rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                           wait_ms);
+#endif
+            if (rc & WL_POSTMASTER_DEATH)
+                ereport(FATAL,
+                        (errcode(ERRCODE_ADMIN_SHUTDOWN),
+                         errmsg("terminating connection due to unexpected postmaster exit")));
+            ResetLatch(MyLatch);
+            CHECK_FOR_INTERRUPTS();
+        }
+
+        LWLockAcquire(admit->lock, LW_EXCLUSIVE);
+        if (!waiting->granted)
+        {
+            dlist_delete(&waiting->node);
+            dlist_push_head(&admit->free_waiters, &waiting->node);
+            waiting = NULL;
+            waiting_slot = -1;
+            LWLockRelease(admit->lock);
+            return QUASAR_ADMIT_TIMEOUT;
+        }
+        dlist_push_head(&admit->free_waiters, &waiting->node);
+        waiting = NULL;
+        waiting_slot = -1;
+        LWLockRelease(admit->lock);
+    }
+
+    oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+    entry = palloc(sizeof(QuasarAdmitHeld));
+    entry->slot = i;
+    entry->subid = subid;
+    held = lcons(entry, held);
+    MemoryContextSwitchTo(oldcontext);
+
+    return i;
+#else
+    return QUASAR_ADMIT_UNLIMITED;
+#endif
+}
+
+/* A request admitted by QuasarAdmit is over, let the next one in */
+extern void
+QuasarAdmitRelease(int slotno)
+{
+#if (PG_VERSION_NUM >= 90600)
+    QuasarAdmitHeld *entry;
+
+    if (slotno < 0 || admit == NULL)
+        return;
+
+    entry = admit_find_held(slotno);
+    if (entry != NULL)
+    {
+        held = list_delete_ptr(held, entry);
+        admit_release_held(entry);
+    }
+#endif
+}
+
+/*
+ * Give back everything this backend holds, and leave any queue.
+ * Called at transaction end, after an error has skipped the releases.
+ */
+extern void
+QuasarAdmitReleaseAll(void)
+{
+#if (PG_VERSION_NUM >= 90600)
+    if (admit == NULL)
+        return;
+
+    admit_stop_waiting();
+
+    while (held != NIL)
+    {
+        QuasarAdmitHeld *entry = (QuasarAdmitHeld *) linitial(held);
+
+        elog(DEBUG1, "quasar_fdw: releasing leaked admission");
+        held = list_delete_first(held);
+        admit_release_held(entry);
+    }
+#endif
+}
+
+/*
+ * Give back what the scans of an aborted subtransaction hold, and leave
+ * the queue if the error interrupted us waiting for a turn (which can
+ * only have been for a scan of that subtransaction)
+ */
+extern void
+QuasarAdmitReleaseSub(SubTransactionId subid)
+{
+#if (PG_VERSION_NUM >= 90600)
+    ListCell *lc;
+
+    if (admit == NULL)
+        return;
+
+    admit_stop_waiting();
+
+    quasar_foreach(lc, held)
+    {
+        QuasarAdmitHeld *entry = (QuasarAdmitHeld *) lfirst(lc);
+
+        if (entry->subid >= subid)
+        {
+            elog(DEBUG1, "quasar_fdw: releasing admission of aborted subtransaction");
+            held = quasar_foreach_delete_current(held, lc);
+            admit_release_held(entry);
+        }
+    }
+#endif
+}
+
+#if (PG_VERSION_NUM >= 90600)
+
+static void
+admit_shmem_request(void)
+{
+#if (PG_VERSION_NUM >= 150000)
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+#endif
+    RequestAddinShmemSpace(admit_shmem_size());
+    RequestNamedLWLockTranche("quasar_fdw", 1);
+}
+
+static void
+admit_shmem_startup(void)
+{
+    bool found;
+    int i, j;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    admit = ShmemInitStruct("quasar_fdw admission", admit_shmem_size(), &found);
+    if (!found)
+    {
+        admit->lock = &(GetNamedLWLockTranche("quasar_fdw"))->lock;
+        dlist_init(&admit->free_waiters);
+        for (i = 0; i < ADMIT_SLOTS; ++i)
+        {
+            admit->slots[i].server[0] = '\0';
+            admit->slots[i].limit = 0;
+            admit->slots[i].inflight = 0;
+            for (j = 0; j < QUASAR_LANES; ++j)
+                dlist_init(&admit->slots[i].queue[j]);
+        }
+        for (i = 0; i < admit_max_waiters(); ++i)
+            dlist_push_tail(&admit->free_waiters, &admit->waiters[i].node);
+    }
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+static Size
+admit_shmem_size(void)
+{
+    return add_size(offsetof(QuasarAdmitShared, waiters),
+                    mul_size(admit_max_waiters(), sizeof(QuasarAdmitWaiter)));
+}
+
+/* One per backend which might run a query; MaxBackends isn't known yet */
+static int
+admit_max_waiters(void)
+{
+    return MaxConnections + max_worker_processes + 1;
+}
+
+/* The slot of a server, taking a free one if it has none. Lock held. */
+static int
+admit_find_slot(const char *server)
+{
+    int i, unused = -1;
+
+    for (i = 0; i < ADMIT_SLOTS; ++i)
+    {
+        QuasarAdmitSlot *slot = &admit->slots[i];
+
+        if (slot->server[0] == '\0')
+        {
+            if (unused < 0)
+                unused = i;
+        }
+        else if (strncmp(slot->server, server, ADMIT_KEY_LEN - 1) == 0)
+            return i;
+    }
+
+    if (unused >= 0)
+        strlcpy(admit->slots[unused].server, server, ADMIT_KEY_LEN);
+    return unused;
+}
+
+/* Let in as many waiters as the limit allows, best lane first. Lock held. */
+static void
+admit_grant(QuasarAdmitSlot *slot)
+{
+    int lane;
+
+    for (lane = 0; lane < QUASAR_LANES; ++lane)
+    {
+        while (slot->inflight < slot->limit && !dlist_is_empty(&slot->queue[lane]))
+        {
+            QuasarAdmitWaiter *w = dlist_container(QuasarAdmitWaiter, node,
+                                                   dlist_pop_head_node(&slot->queue[lane]));
+
+            /* Its backend puts it back on the free list */
+            w->granted = true;
+            ++slot->inflight;
+            SetLatch(w->latch);
+        }
+    }
+}
+
+/*
+ * The latest admission held for a slot. Latest, since nested scans
+ * tend to be done before the ones around them.
+ */
+static QuasarAdmitHeld *
+admit_find_held(int slotno)
+{
+    ListCell *lc;
+
+    foreach(lc, held)
+    {
+        QuasarAdmitHeld *entry = (QuasarAdmitHeld *) lfirst(lc);
+
+        if (entry->slot == slotno)
+            return entry;
+    }
+    return NULL;
+}
+
+/* Give back an admission taken off the held list, let the next one in */
+static void
+admit_release_held(QuasarAdmitHeld *entry)
+{
+    QuasarAdmitSlot *slot = &admit->slots[entry->slot];
+
+    pfree(entry);
+
+    LWLockAcquire(admit->lock, LW_EXCLUSIVE);
+    --slot->inflight;
+    admit_grant(slot);
+    LWLockRelease(admit->lock);
+}
+
+/* Leave the queue an error interrupted us in, or give back what it got us */
+static void
+admit_stop_waiting(void)
+{
+    if (waiting == NULL)
+        return;
+
+    LWLockAcquire(admit->lock, LW_EXCLUSIVE);
+    if (waiting->granted)
+    {
+        --admit->slots[waiting_slot].inflight;
+        admit_grant(&admit->slots[waiting_slot]);
+    }
+    else
+        dlist_delete(&waiting->node);
+    dlist_push_head(&admit->free_waiters, &waiting->node);
+    LWLockRelease(admit->lock);
+
+    waiting = NULL;
+    waiting_slot = -1;
+}
+
+#if (PG_VERSION_NUM >= 100000)
+/* Custom wait events appeared in 17, before that we're just Extension */
+static uint32
+admit_wait_event(void)
+{
+#if (PG_VERSION_NUM >= 170000)
+    static uint32 wait_event = 0;
+
+    if (wait_event == 0)
+        wait_event = WaitEventExtensionNew("QuasarAdmission");
+    return wait_event;
+#else
+    return PG_WAIT_EXTENSION;
+#endif
+}
+#endif
+
+#endif
@@ -0,0 +1,397 @@
+/*-------------------------------------------------------------------------
+ *
+ * Quasar Foreign Data Wrapper for PostgreSQL
+ *
+ * Copyright (c) 2015 SlamData Inc
+ *
+ * This software is released under the Apache 2 license
+ *
+ * Author: Jon Eisen <jon@joneisen.works>
+ *
+ * IDENTIFICATION
+ *            quasar_fdw/src/quasar_cleanup.c
+ *
+ * Asynchronous removal of temporary POST result files
+ *
+ * Queries which go through QuasarExecuteQueryPost leave an fdw_* file
+ * behind on Quasar. Instead of DELETEing it on the spot, scans queue the
+ * path here. At transaction end all queued paths are DELETEd together on
+ * a multi handle of our own, without waiting for the responses; those
+ * are collected whenever a scan waits for Quasar, at the next transaction
+ * end or when the backend exits. Since the cleaner is only driven then,
+ * a request is timed only while it is: an idle session doesn't time out
+ * the DELETEs it left on the wire. Failures are only logged, since the
+ * sweeper will get another chance.
+ *
+ * The sweeper lists every directory we put temporary files in, once per
+ * backend, and removes fdw_* files older than TEMP_FILE_MAX_AGE_S, which
+ * is what is left over when a backend crashes before cleaning up.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "quasar_fdw.h"
+
+#include <time.h>
+
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+/* Requests on the cleaner multi handle */
+typedef enum
+{
+    CLEANUP_DELETE,             /* DELETE a temporary file */
+    CLEANUP_SWEEP               /* list a directory for stale files */
+} QuasarCleanupKind;
+
+typedef struct QuasarCleanupRequest
+{
+    QuasarCleanupKind kind;
+    QuasarPool *pool;
+    char *path;                 /* file to delete or directory to sweep */
+    char *url;
+    CURL *curl;
+    StringInfoData listing;     /* response body of a sweep */
+    TimestampTz last_driven;
+    long driven_ms;             /* time it has been driven for */
+} QuasarCleanupRequest;
+
+static CURLM *cleaner = NULL;
+static List *pending = NIL;     /* queued, not sent yet */
+static List *inflight = NIL;    /* added to cleaner */
+static List *swept = NIL;       /* "server path" of directories swept */
+static bool exit_hook_registered = false;
+
+static void cleanup_queue(QuasarCleanupKind kind, QuasarPool *pool,
+                          const char *path);
+static void cleanup_start(QuasarCleanupRequest *req);
+static void cleanup_drive(void);
+static void cleanup_collect(void);
+static void cleanup_finish(QuasarCleanupRequest *req, CURLcode result);
+static void cleanup_sweep_listing(QuasarCleanupRequest *req);
+static void cleanup_exit_hook(int code, Datum arg);
+static size_t cleanup_body_handler(void *buffer, size_t size, size_t nmemb, void *userp);
+
+/*
+ * Name for a new temporary file.
+ * Carries its creation time so the sweeper can tell how old it is.
+ */
+extern char *
+QuasarTempFileName(void)
+{
+    StringInfoData name;
+
+    initStringInfo(&name);
+    appendStringInfo(&name, "fdw_%ld_%d_%d", (long) time(NULL), MyProcPid, rand());
+    return name.data;
+}
+
+/*
+ * Remember that post_path must be deleted.
+ * The first file queued in a directory also gets that directory swept.
+ */
+extern void
+QuasarCleanupQueue(QuasarPool *pool, const char *post_path)
+{
+    char *dir;
+    char *key;
+    ListCell *lc;
+    bool found = false;
+    MemoryContext oldcontext;
+
+    elog(DEBUG1, "quasar_fdw: queueing DELETE of %s%s", pool->server, post_path);
+    cleanup_queue(CLEANUP_DELETE, pool, post_path);
+
+    dir = pnstrdup(post_path, strrchr(post_path, '/') - post_path + 1);
+    key = psprintf("%s %s", pool->server, dir);
+
+    foreach(lc, swept)
+    {
+        if (strcmp((char *) lfirst(lc), key) == 0)
+        {
+            found = true;
+            break;
+        }
+    }
+
+    if (!found)
+    {
+        oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+        swept = lappend(swept, pstrdup(key));
+        MemoryContextSwitchTo(oldcontext);
+
+        cleanup_queue(CLEANUP_SWEEP, pool, dir);
+    }
+
+    pfree(dir);
+    pfree(key);
+}
+
+/*
+ * Send everything queued so far, and collect whatever has finished.
+ * Called at transaction end; never blocks on Quasar and never errors
+ * out because of it.
+ */
+extern void
+QuasarCleanupFlush(void)
+{
+    ListCell *lc;
+
+    if (pending == NIL && inflight == NIL)
+        return;
+
+    if (cleaner == NULL)
+        cleaner = curl_multi_init();
+
+    cleanup_collect();
+
+    foreach(lc, pending)
+        cleanup_start((QuasarCleanupRequest *) lfirst(lc));
+    list_free(pending);
+    pending = NIL;
+
+    /* Get the requests onto the wire, the responses can wait */
+    cleanup_drive();
+}
+
+/*
+ * Let the requests sent so far go on, without waiting.
+ * Called while scans wait for Quasar.
+ */
+extern void
+QuasarCleanupPoll(void)
+{
+    if (inflight != NIL)
+        cleanup_drive();
+}
+
+static void
+cleanup_queue(QuasarCleanupKind kind, QuasarPool *pool, const char *path)
+{
+    QuasarCleanupRequest *req;
+    MemoryContext oldcontext;
+
+    oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+    req = palloc0(sizeof(QuasarCleanupRequest));
+    req->kind = kind;
+    req->pool = pool;
+    req->path = pstrdup(path);
+    req->url = psprintf("%s/%s/fs%s", pool->server,
+                        kind == CLEANUP_DELETE ? "data" : "metadata", path);
+    pending = lappend(pending, req);
+
+    MemoryContextSwitchTo(oldcontext);
+
+    if (!exit_hook_registered)
+    {
+        on_proc_exit(cleanup_exit_hook, (Datum) 0);
+        exit_hook_registered = true;
+    }
+}
+
+/* Add a request to the cleaner multi handle */
+static void
+cleanup_start(QuasarCleanupRequest *req)
+{
+    CURL *curl;
+    MemoryContext oldcontext;
+
+    curl = curl_easy_init();
+    if (curl == NULL)
+    {
+        elog(DEBUG1, "quasar_fdw: could not create curl handle for %s", req->url);
+        return;
+    }
+
+    /* Share the pool's DNS and connection cache, but not its handles:
+     * these outlive the transaction whose handles the pool reclaims */
+    curl_easy_setopt(curl, CURLOPT_SHARE, req->pool->share);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    QuasarPoolSetTransport(req->pool, curl);
+    curl_easy_setopt(curl, CURLOPT_URL, req->url);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, (char *) req);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, cleanup_body_handler);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, req);
+
+    if (req->kind == CLEANUP_DELETE)
+        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
+    else
+    {
+        oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+        initStringInfo(&req->listing);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    elog(DEBUG1, "quasar_fdw: curling %s %s",
+         req->kind == CLEANUP_DELETE ? "DELETE" : "GET", req->url);
+
+    req->curl = curl;
+    req->last_driven = GetCurrentTimestamp();
+    req->driven_ms = 0;
+    if (curl_multi_add_handle(cleaner, curl) != CURLM_OK)
+    {
+        curl_easy_cleanup(curl);
+        return;
+    }
+
+    oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+    inflight = lappend(inflight, req);
+    MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Let curl work on the requests without waiting, then handle those it's
+ * done with and give up on those which have been driven for
+ * CLEANUP_TIMEOUT_MS. Of the time since a request was last driven, only
+ * up to CLEANUP_DRIVE_GAP_MS counts: beyond that, nobody was driving it.
+ */
+static void
+cleanup_drive(void)
+{
+    TimestampTz now = GetCurrentTimestamp();
+    ListCell *lc;
+    List *requests;
+    int running;
+
+    foreach(lc, inflight)
+    {
+        QuasarCleanupRequest *req = (QuasarCleanupRequest *) lfirst(lc);
+        long secs;
+        int usecs;
+
+        TimestampDifference(req->last_driven, now, &secs, &usecs);
+        req->driven_ms += Min(secs * 1000 + usecs / 1000, CLEANUP_DRIVE_GAP_MS);
+        req->last_driven = now;
+    }
+
+    curl_multi_perform(cleaner, &running);
+    cleanup_collect();
+
+    /* cleanup_finish takes requests off inflight */
+    requests = list_copy(inflight);
+    foreach(lc, requests)
+    {
+        QuasarCleanupRequest *req = (QuasarCleanupRequest *) lfirst(lc);
+
+        if (req->driven_ms >= CLEANUP_TIMEOUT_MS)
+            cleanup_finish(req, CURLE_OPERATION_TIMEDOUT);
+    }
+    list_free(requests);
+}
+
+/* Handle every request the cleaner multi handle has finished */
+static void
+cleanup_collect(void)
+{
+    CURLMsg *msg;
+    int left;
+
+    while ((msg = curl_multi_info_read(cleaner, &left)) != NULL)
+    {
+        char *priv = NULL;
+
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+        cleanup_finish((QuasarCleanupRequest *) priv, msg->data.result);
+    }
+}
+
+static void
+cleanup_finish(QuasarCleanupRequest *req, CURLcode result)
+{
+    long status = 0;
+
+    curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &status);
+
+    if (result != CURLE_OK)
+        elog(DEBUG1, "quasar_fdw: cleanup %s failed %s",
+             req->url, curl_easy_strerror(result));
+    else if (req->kind == CLEANUP_DELETE && status != 200 && status != 204)
+        elog(DEBUG1, "quasar_fdw: got bad response from quasar: %ld (DELETE %s)",
+             status, req->url);
+    else if (req->kind == CLEANUP_SWEEP && status == 200)
+        cleanup_sweep_listing(req);
+    else
+        elog(DEBUG1, "quasar_fdw: cleanup %s status code: %ld", req->url, status);
+
+    curl_multi_remove_handle(cleaner, req->curl);
+    curl_easy_cleanup(req->curl);
+
+    inflight = list_delete_ptr(inflight, req);
+    if (req->kind == CLEANUP_SWEEP)
+        pfree(req->listing.data);
+    pfree(req->path);
+    pfree(req->url);
+    pfree(req);
+}
+
+/*
+ * Queue a DELETE for every stale temporary file in a directory listing.
+ * Quasar's metadata looks like {"children": [{"name": "...", ...}, ...]}
+ * and our names never need escaping, so a plain search will do.
+ * Files named by older versions (no timestamp) are left alone.
+ */
+static void
+cleanup_sweep_listing(QuasarCleanupRequest *req)
+{
+    char *c = req->listing.data;
+    long now = (long) time(NULL);
+
+    while ((c = strstr(c, "\"fdw_")) != NULL)
+    {
+        char *end;
+        long created;
+        int pid, rnd;
+
+        ++c;
+        end = strchr(c, '"');
+        if (end == NULL)
+            break;
+
+        if (sscanf(c, "fdw_%ld_%d_%d", &created, &pid, &rnd) == 3 &&
+            now - created >= TEMP_FILE_MAX_AGE_S)
+        {
+            char *name = pnstrdup(c, end - c);
+            char *path = psprintf("%s%s", req->path, name);
+
+            elog(DEBUG1, "quasar_fdw: sweeping stale temporary file %s", path);
+            cleanup_queue(CLEANUP_DELETE, req->pool, path);
+            pfree(path);
+            pfree(name);
+        }
+        c = end + 1;
+    }
+}
+
+/* Give outstanding cleanup a little while to finish before we exit */
+static void
+cleanup_exit_hook(int code, Datum arg)
+{
+    TimestampTz start = GetCurrentTimestamp();
+    int nfds;
+
+    QuasarCleanupFlush();
+
+    while (inflight != NIL &&
+           !TimestampDifferenceExceeds(start, GetCurrentTimestamp(),
+                                       CLEANUP_EXIT_WAIT_MS))
+    {
+        curl_multi_wait(cleaner, NULL, 0, 100, &nfds);
+        QuasarCleanupFlush();
+    }
+}
+
+static size_t
+cleanup_body_handler(void *buffer, size_t size, size_t nmemb, void *userp)
+{
+    QuasarCleanupRequest *req = (QuasarCleanupRequest *) userp;
+
+    if (req->kind == CLEANUP_SWEEP)
+        appendBinaryStringInfo(&req->listing, buffer, size * nmemb);
+    return size * nmemb;
+}
@@ -17,20 +17,24 @@
 #include "quasar_fdw.h"
 #include "curl/curl.h"
 
+#include <ctype.h>
+#include <poll.h>
+
+#include "access/xact.h"
 #include "commands/defrem.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/latch.h"
+#include "utils/lsyscache.h"
 #include "utils/memutils.h"
 
-#define INITIAL_TUPLE_ALLOC_SIZE 100;
-
-/* See https://github.com/quasar-analytics/quasar-fdw/issues/7 */
-#define GET_QUERY_SIZE_LIMIT 1500
+#define INITIAL_TUPLE_ALLOC_SIZE 100
 
 char * execute_info_curl(QuasarConn *conn, char *url);
 static size_t header_handler(void *buffer, size_t size, size_t nmemb, void *buf);
 static size_t query_body_handler(void *buffer, size_t size, size_t nmemb, void *userp);
 static size_t info_body_handler(void *buffer, size_t size, size_t nmemb, void *userp);
 static size_t throwaway_body_handler(void *buffer, size_t size, size_t nmemb, void *userp);
-static size_t count_line_endings(const char *buffer, size_t size);
 void appendStringInfoQuery(CURL *curl,
                            StringInfo buf,
                            char *name,
@@ -39,9 +43,112 @@ void appendStringInfoQuery(CURL *curl,
 
 void QuasarExecuteQueryGet(QuasarConn *conn, char *query,
                            const char **param_values, size_t numParams);
+static void post_query(QuasarConn *conn, char *query,
+                       const char **param_values, size_t numParams,
+                       char **path);
+static void fetch_data(QuasarConn *conn, const char *path);
 void QuasarExecuteQueryPost(QuasarConn *conn, char *query,
                             const char **param_values, size_t numParams);
+void QuasarExecuteQueryPostStream(QuasarConn *conn, char *query,
+                                  const char **param_values, size_t numParams);
+static void fallback_query_post(QuasarConn *conn);
 void QuasarDeletePostData(QuasarConn *conn);
+static void quasar_xact_callback(XactEvent event, void *arg);
+static void quasar_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                                    SubTransactionId parentSubid, void *arg);
+static bool check_transfer(QuasarConn *conn);
+static bool wants_destination(quasar_query_curl_context *ctx);
+static long transfer_time_left(QuasarConn *conn, TimestampTz waiting_since);
+static CURLcode perform_blocking(QuasarConn *conn, CURL *curl);
+static int blocking_progress_handler(void *clientp,
+                                     curl_off_t dltotal, curl_off_t dlnow,
+                                     curl_off_t ultotal, curl_off_t ulnow);
+static void next_batch(QuasarConn *conn);
+static void start_transfer(QuasarConn *conn);
+static char *supported_compression(char *compression);
+static uint64 transfer_received(QuasarConn *conn);
+static void pipeline_continue(QuasarConn *conn);
+static void pipeline_take_records(QuasarConn *conn);
+static void proxy_continue(QuasarConn *conn);
+static void windows_continue(QuasarConn *conn);
+static void continue_transfer(QuasarConn *conn);
+#if (PG_VERSION_NUM >= 140000)
+static curl_socket_t transfer_socket(QuasarConn *conn, int *what);
+#endif
+static bool parallel_claim(QuasarConn *conn);
+static void execute_query(QuasarConn *conn, char *query,
+                          const char **param_values, size_t numParams);
+static void resume_start(QuasarConn *conn, char *query,
+                         const char **param_values, size_t numParams);
+static void resume_remember(QuasarConn *conn, Datum *values, bool *nulls);
+static bool resume_transfer(QuasarConn *conn);
+static void parse_chunk(quasar_query_curl_context *ctx, const char *buffer, size_t segsize);
+static void batch_append(quasar_query_curl_context *ctx, const char *buffer, size_t segsize);
+static void batch_add_record(quasar_query_curl_context *ctx, int end);
+static void batch_clear(quasar_query_curl_context *ctx);
+static void batch_row(quasar_query_curl_context *ctx, int n,
+                      Datum *values, bool *nulls);
+static bool batch_full(quasar_query_curl_context *ctx);
+static CURLM *scheduler_get(void);
+static void scheduler_add(QuasarConn *conn);
+static void scheduler_perform(QuasarConn *conn, curl_socket_t fd, int flags);
+static void scheduler_wait(QuasarConn *conn, long timeout_ms);
+static int scheduler_socket_cb(CURL *easy, curl_socket_t fd, int what,
+                               void *userp, void *socketp);
+static int scheduler_timer_cb(CURLM *multi, long timeout_ms, void *userp);
+static void scheduler_remove(QuasarConn *conn);
+static void scheduler_remove_all(void);
+static void scheduler_remove_sub(SubTransactionId subid);
+static void scheduled_add(CURL *curl, SubTransactionId subid);
+static void scheduled_remove(CURL *curl);
+static List *parse_servers(char *value);
+static void hedge_arm(QuasarConn *conn, char *url,
+                      QuasarCurlCallback header_fn, void *header_ctx,
+                      QuasarCurlCallback body_fn, void *body_ctx);
+static bool hedge_launch(QuasarConn *conn);
+static long hedge_time_left(QuasarConn *conn);
+static bool hedge_leg_done(QuasarConn *conn, CURL *curl, CURLcode result);
+static void hedge_settle(QuasarConn *conn);
+static void hedge_disarm(QuasarConn *conn);
+static CURLcode perform_armed(QuasarConn *conn, char *url,
+                              quasar_info_curl_context *ctx);
+static int parse_status_line(const char *buffer, size_t size);
+static void admit(QuasarConn *conn, int lane);
+static void admit_release(QuasarConn *conn);
+static size_t leg_header_handler(void *buffer, size_t size, size_t nmemb, void *userp);
+static size_t leg_body_handler(void *buffer, size_t size, size_t nmemb, void *userp);
+
+/*
+ * One multi handle drives the transfers of every active scan in this
+ * backend. Whichever scan the executor is waiting on pumps all of them,
+ * so the other scans' sockets keep being drained into their own batches.
+ */
+static CURLM *scheduler = NULL;
+static List *scheduled = NIL;   /* QuasarScheduled, one per handle in scheduler */
+
+/*
+ * A handle in the scheduler, and the subtransaction its scan was started
+ * in: when that one aborts, the scan's memory goes with it.
+ */
+typedef struct QuasarScheduled
+{
+    CURL *curl;
+    SubTransactionId subid;
+} QuasarScheduled;
+
+/*
+ * The scheduler runs in curl's socket mode, so that we do the waiting
+ * ourselves, on the sockets curl asks for plus our latch.
+ */
+typedef struct QuasarSocket
+{
+    curl_socket_t fd;
+    int what;                   /* CURL_POLL_* */
+    CURL *easy;                 /* transfer it was last reported for */
+} QuasarSocket;
+
+static List *sockets = NIL;             /* QuasarSockets curl wants watched */
+static long scheduler_timeout = -1;     /* ms until curl wants to run, or -1 */
 
 extern void
 QuasarGlobalConnectionInit()
@@ -51,11 +158,83 @@ QuasarGlobalConnectionInit()
 #else
     curl_global_init(CURL_GLOBAL_NOTHING);
 #endif
+
+    RegisterXactCallback(quasar_xact_callback, NULL);
+    RegisterSubXactCallback(quasar_subxact_callback, NULL);
+}
+
+/*
+ * At transaction end every scan has been ended, so any pooled handle
+ * still checked out was left behind by an error. This is also when
+ * queued temporary file deletions are sent.
+ */
+static void
+quasar_xact_callback(XactEvent event, void *arg)
+{
+    switch (event)
+    {
+    case XACT_EVENT_COMMIT:
+        QuasarPipelineStopAll();
+        QuasarProxyStopAll();
+        scheduler_remove_all();
+        QuasarPoolReleaseAll();
+        QuasarAdmitReleaseAll();
+        QuasarCleanupFlush();
+        break;
+    case XACT_EVENT_ABORT:
+        /* Their write callbacks point into memory that is gone now */
+        QuasarPipelineStopAll();
+        QuasarProxyStopAll();
+        scheduler_remove_all();
+        QuasarPoolReleaseAll();
+        QuasarAdmitReleaseAll();
+
+        /* An error thrown from inside a curl callback may have left
+         * the multi handle in a bad state, start over with a new one */
+        if (scheduler != NULL)
+        {
+            curl_multi_cleanup(scheduler);
+            scheduler = NULL;
+        }
+        list_free_deep(sockets);
+        sockets = NIL;
+        scheduler_timeout = -1;
+
+        /* Aborted scans still queued their POST results for deletion */
+        QuasarCleanupFlush();
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * When a subtransaction aborts (say, in a plpgsql EXCEPTION block), the
+ * scans started in it are gone without having been ended, but the rest
+ * of the transaction goes on pumping the shared multi handle. So their
+ * transfers, pipelines, proxied requests and admissions go now; their
+ * pooled handles, which nothing drives any more, are closed at
+ * transaction end.
+ * Subtransaction ids only grow, so everything started in mySubid or in
+ * a subtransaction of it has an id at least as big.
+ */
+static void
+quasar_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                        SubTransactionId parentSubid, void *arg)
+{
+    if (event != SUBXACT_EVENT_ABORT_SUB)
+        return;
+
+    QuasarPipelineStopSub(mySubid);
+    scheduler_remove_sub(mySubid);
+    QuasarProxyStopSub(mySubid);
+    QuasarAdmitReleaseSub(mySubid);
 }
 
 /*
  * Create a connection to a server/table
- * Connections are valid for a single query/explain
+ * Connections are valid for a single query/explain, but the curl
+ * handle underneath is borrowed from the server's pool.
  */
 extern QuasarConn *
 QuasarGetConnection(ForeignServer *server, ForeignTable *table)
@@ -63,22 +242,92 @@ QuasarGetConnection(ForeignServer *server, ForeignTable *table)
     ListCell *lc;
     QuasarConn *conn = palloc0(sizeof(QuasarConn));
 
-    conn->server = DEFAULT_SERVER;
+    conn->servers = list_make1(DEFAULT_SERVER);
+    conn->server_option = DEFAULT_SERVER;
+    conn->max_inflight = DEFAULT_MAX_INFLIGHT;
+    conn->admit_slot = QUASAR_ADMIT_UNLIMITED;
+    conn->subid = GetCurrentSubTransactionId();
+    conn->socket_path = NULL;
+    conn->tls.ca_file = NULL;
+    conn->tls.cert = NULL;
+    conn->tls.key = NULL;
+    conn->tls.verify = true;
+    conn->max_connections = DEFAULT_MAX_CONNECTIONS;
     conn->path = DEFAULT_PATH;
     conn->timeout_ms = DEFAULT_TIMEOUT_MS;
+    conn->connect_timeout_ms = -1;
+    conn->first_byte_timeout_ms = -1;
+    conn->idle_timeout_ms = -1;
+    conn->fetch_size = DEFAULT_FETCH_SIZE;
+    conn->fetch_bytes = DEFAULT_FETCH_BYTES;
+    conn->use_pipeline = DEFAULT_PIPELINE;
+    conn->use_proxy = DEFAULT_PROXY;
+    conn->compression = DEFAULT_COMPRESSION;
+    conn->received_bytes = 0;
+    conn->hedge_ms = DEFAULT_HEDGE_MS;
 
     foreach(lc, server->options)
     {
         DefElem    *def = (DefElem *) lfirst(lc);
 
         if (strcmp(def->defname, "server") == 0)
-            conn->server = defGetString(def);
+        {
+            conn->server_option = defGetString(def);
+            conn->servers = parse_servers(conn->server_option);
+        }
         else if (strcmp(def->defname, "path") == 0)
             conn->path = defGetString(def);
         else if (strcmp(def->defname, "timeout_ms") == 0)
             conn->timeout_ms = strtod(defGetString(def), NULL);
+        else if (strcmp(def->defname, "connect_timeout_ms") == 0)
+            conn->connect_timeout_ms = strtol(defGetString(def), NULL, 10);
+        else if (strcmp(def->defname, "first_byte_timeout_ms") == 0)
+            conn->first_byte_timeout_ms = strtol(defGetString(def), NULL, 10);
+        else if (strcmp(def->defname, "idle_timeout_ms") == 0)
+            conn->idle_timeout_ms = strtol(defGetString(def), NULL, 10);
+        else if (strcmp(def->defname, "max_connections") == 0)
+            conn->max_connections = strtol(defGetString(def), NULL, 10);
+        else if (strcmp(def->defname, "fetch_size") == 0)
+            conn->fetch_size = strtol(defGetString(def), NULL, 10);
+        else if (strcmp(def->defname, "fetch_bytes") == 0)
+            conn->fetch_bytes = strtol(defGetString(def), NULL, 10);
+        else if (strcmp(def->defname, "pipeline") == 0)
+            conn->use_pipeline = defGetBoolean(def);
+        else if (strcmp(def->defname, "proxy") == 0)
+            conn->use_proxy = defGetBoolean(def);
+        else if (strcmp(def->defname, "compression") == 0)
+            conn->compression = defGetString(def);
+        else if (strcmp(def->defname, "socket_path") == 0)
+            conn->socket_path = defGetString(def);
+        else if (strcmp(def->defname, "ssl_ca_file") == 0)
+            conn->tls.ca_file = defGetString(def);
+        else if (strcmp(def->defname, "ssl_cert") == 0)
+            conn->tls.cert = defGetString(def);
+        else if (strcmp(def->defname, "ssl_key") == 0)
+            conn->tls.key = defGetString(def);
+        else if (strcmp(def->defname, "ssl_verify") == 0)
+            conn->tls.verify = defGetBoolean(def);
+        else if (strcmp(def->defname, "hedge_ms") == 0)
+            conn->hedge_ms = strtol(defGetString(def), NULL, 10);
+        else if (strcmp(def->defname, "max_inflight") == 0)
+            conn->max_inflight = strtol(defGetString(def), NULL, 10);
     }
 
+    conn->compression = supported_compression(conn->compression);
+
+    /*
+     * An unset connect timeout falls back to timeout_ms. The first byte
+     * and idle timeouts are off (0) unless set: timeout_ms never really
+     * limited how long a query could take, and queries routinely take
+     * longer than its 1s default.
+     */
+    if (conn->connect_timeout_ms < 0)
+        conn->connect_timeout_ms = conn->timeout_ms;
+    if (conn->first_byte_timeout_ms < 0)
+        conn->first_byte_timeout_ms = 0;
+    if (conn->idle_timeout_ms < 0)
+        conn->idle_timeout_ms = 0;
+
     foreach (lc, table->options)
     {
         DefElem *def = (DefElem *) lfirst(lc);
@@ -106,29 +355,131 @@ QuasarGetConnection(ForeignServer *server, ForeignTable *table)
                 conn->path = tpath_builder.data;
             }
         }
+        else if (strcmp(def->defname, "fetch_size") == 0)
+            conn->fetch_size = strtol(defGetString(def), NULL, 10);
+        else if (strcmp(def->defname, "fetch_bytes") == 0)
+            conn->fetch_bytes = strtol(defGetString(def), NULL, 10);
+        else if (strcmp(def->defname, "pipeline") == 0)
+            conn->use_pipeline = defGetBoolean(def);
+        else if (strcmp(def->defname, "proxy") == 0)
+            conn->use_proxy = defGetBoolean(def);
     }
 
+    conn->pool = QuasarPoolChoose(conn->servers, conn->socket_path, &conn->tls,
+                                  conn->max_connections, NULL);
+    conn->server = conn->pool->server;
     conn->curlm = NULL;
-    conn->curl = curl_easy_init();
+    conn->curl = QuasarPoolAcquire(conn->pool);
 
     conn->post_path = NULL;
     conn->ongoing_transfers = 0;
     conn->exec_transfer = 0;
+    conn->streaming_post = false;
+    conn->pipeline = NULL;
+    conn->proxy = NULL;
+    conn->nlegs = 0;
+    conn->winner = -1;
+    conn->hedged = false;
+    conn->window_offset = 0;
+    conn->window_limit = -1;
+    conn->windows = NIL;
+    conn->window_path = NULL;
+    conn->owns_window_path = false;
+    conn->reading = conn;
+    conn->shared = NULL;
+    conn->parallel_query = NULL;
+    conn->resume_query = NULL;
+    conn->resume_params = NULL;
+    conn->resume_value = NULL;
+    conn->resume_retries = 0;
+    conn->query = NULL;
+    conn->param_values = NULL;
+    conn->numParams = 0;
 
     conn->qctx = NULL;
 
     return conn;
 }
 
+/*
+ * Split the server option into its endpoints.
+ * Several may be given, separated by commas.
+ */
+static List *
+parse_servers(char *value)
+{
+    List *servers = NIL;
+    char *copy = pstrdup(value);
+    char *tok;
+
+    for (tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ","))
+    {
+        char *end;
+
+        while (isspace((unsigned char) *tok))
+            ++tok;
+        end = tok + strlen(tok);
+        while (end > tok && isspace((unsigned char) end[-1]))
+            *--end = '\0';
+
+        if (*tok != '\0')
+            servers = lappend(servers, tok);
+    }
+
+    if (servers == NIL)
+        servers = list_make1(value);
+    return servers;
+}
+
+/*
+ * The compression option, if the libcurl we run with can decode it.
+ * Otherwise gzip, which every libcurl with zlib can. That's said once
+ * per backend, not on every scan.
+ */
+static char *
+supported_compression(char *compression)
+{
+    static bool warned = false;
+    curl_version_info_data *info = curl_version_info(CURLVERSION_NOW);
+    bool supported = true;
+
+    if (strcmp(compression, "br") == 0)
+#ifdef CURL_VERSION_BROTLI
+        supported = (info->features & CURL_VERSION_BROTLI) != 0;
+#else
+        supported = false;
+#endif
+    else if (strcmp(compression, "zstd") == 0)
+#ifdef CURL_VERSION_ZSTD
+        supported = (info->features & CURL_VERSION_ZSTD) != 0;
+#else
+        supported = false;
+#endif
+
+    if (!supported)
+    {
+        if (!warned)
+            elog(WARNING, "quasar_fdw: libcurl %s cannot decode %s, using gzip",
+                 info->version, compression);
+        warned = true;
+        return "gzip";
+    }
+    return compression;
+}
+
 extern void
 QuasarPrepQuery(QuasarConn *conn, EState *estate, Relation rel)
 {
-    conn->curlm = curl_multi_init();
+    conn->curlm = scheduler_get();
+    conn->querymem = estate->es_query_cxt;
 
     conn->qctx = palloc0(sizeof(quasar_query_curl_context));
     conn->qctx->is_query = true;
     quasar_parse_alloc(&conn->qctx->parse, rel);
     conn->qctx->batch_count = 0;
+    conn->qctx->fetch_size = conn->fetch_size;
+    conn->qctx->fetch_bytes = conn->fetch_bytes;
+    conn->qctx->paused = false;
     conn->qctx->batchmem = AllocSetContextCreate(estate->es_query_cxt,
                                                 "postgres_fdw tuple data",
                                                 ALLOCSET_DEFAULT_MINSIZE,
@@ -139,17 +490,34 @@ QuasarPrepQuery(QuasarConn *conn, EState *estate, Relation rel)
 extern void
 QuasarCleanupConnection(QuasarConn *conn)
 {
+    ListCell *lc;
+
+    foreach(lc, conn->windows)
+    {
+        QuasarConn *window = (QuasarConn *) lfirst(lc);
+        if (window != conn)
+            QuasarCleanupConnection(window);
+    }
+    list_free(conn->windows);
+    conn->windows = NIL;
+
     if (conn->post_path != NULL)
     {
         QuasarDeletePostData(conn);
     }
+    if (conn->owns_window_path && conn->window_path != NULL)
+        QuasarCleanupQueue(conn->pool, conn->window_path);
 
-    if (conn->curlm != NULL) {
-        curl_multi_remove_handle(conn->curlm, conn->curl);
-        curl_multi_cleanup(conn->curlm);
-    }
+    /* The multi handle is shared, just take our transfer out of it */
+    hedge_disarm(conn);
+    scheduler_remove(conn);
+    if (conn->pipeline != NULL)
+        QuasarPipelineStop(conn->pipeline);
+    if (conn->proxy != NULL)
+        QuasarProxyStop(conn->proxy);
+    admit_release(conn);
 
-    curl_easy_cleanup(conn->curl);
+    QuasarPoolRelease(conn->pool, conn->curl);
 
     if (conn->qctx != NULL) {
         quasar_parse_free(&conn->qctx->parse);
@@ -163,54 +531,348 @@ QuasarCleanupConnection(QuasarConn *conn)
 extern void
 QuasarResetConnection(QuasarConn *conn)
 {
+    ListCell *lc;
+
+    foreach(lc, conn->windows)
+    {
+        QuasarConn *window = (QuasarConn *) lfirst(lc);
+        if (window != conn)
+            QuasarResetConnection(window);
+    }
+    conn->reading = conn;
+
     if (conn->post_path != NULL)
     {
         QuasarDeletePostData(conn);
     }
 
-    if (conn->curlm != NULL) {
-        curl_multi_remove_handle(conn->curlm, conn->curl);
+    hedge_disarm(conn);
+    scheduler_remove(conn);
+    if (conn->pipeline != NULL)
+    {
+        QuasarPipelineStop(conn->pipeline);
+        conn->pipeline = NULL;
+    }
+    conn->received_bytes += transfer_received(conn);
+    if (conn->proxy != NULL)
+    {
+        QuasarProxyStop(conn->proxy);
+        conn->proxy = NULL;
     }
+    admit_release(conn);
 
-    curl_easy_cleanup(conn->curl);
-    conn->curl = curl_easy_init();
+    /* Keep the handle (and its connection), just forget the last request */
+    QuasarPoolResetHandle(conn->pool, conn->curl);
 
     conn->ongoing_transfers = 0;
     conn->exec_transfer = 0;
+    conn->qctx->paused = false;
 }
 
 extern void
 QuasarExecuteQuery(QuasarConn *conn, char *query,
                    const char **param_values, size_t numParams)
 {
-    if (strlen(query) > GET_QUERY_SIZE_LIMIT)
+    ListCell *lc;
+
+    /* Other participants of a parallel scan may have taken every window */
+    if (conn->shared != NULL)
     {
-        QuasarExecuteQueryPost(conn, query, param_values, numParams);
-    } else {
-        QuasarExecuteQueryGet(conn, query, param_values, numParams);
+        conn->parallel_query = query;
+        if (!parallel_claim(conn))
+        {
+            batch_clear(conn->qctx);
+            conn->qctx->status = 0;
+            conn->ongoing_transfers = 0;
+            conn->transfer_result = CURLE_OK;
+            conn->exec_transfer = 1;
+            return;
+        }
     }
 
-    conn->ongoing_transfers = 1;
-    conn->exec_transfer = 1;
-    conn->qctx->tuples = NULL;
-    conn->qctx->num_tuples = 0;
-    conn->qctx->next_tuple = 0;
-    conn->qctx->alloc_tuples = 0;
-    conn->qctx->partial_tuple = false;
-    conn->qctx->batch_count = 0;
+    if (conn->resume_query != NULL)
+        resume_start(conn, query, param_values, numParams);
+
+    /* The windows of a split scan are ranges of the materialized rows */
+    if (conn->windows != NIL)
+    {
+        char *path = QuasarMaterializeQuery(conn, query);
+
+        foreach(lc, conn->windows)
+        {
+            QuasarConn *window = (QuasarConn *) lfirst(lc);
+            if (window != conn)
+                window->window_path = path;
+        }
+    }
+
+    execute_query(conn, query, param_values, numParams);
+
+    /* The other windows of a split scan go out alongside */
+    conn->reading = conn;
+    foreach(lc, conn->windows)
+    {
+        QuasarConn *window = (QuasarConn *) lfirst(lc);
+        if (window != conn)
+            QuasarExecuteQuery(window, query, param_values, numParams);
+    }
+}
+
+static void
+execute_query(QuasarConn *conn, char *query,
+              const char **param_values, size_t numParams)
+{
+    batch_clear(conn->qctx);
+    conn->qctx->batch_bytes = 0;
+    conn->qctx->paused = false;
+    conn->qctx->batch_count = 1;
     conn->qctx->status = 0;
+    conn->qctx->error_len = 0;
+    conn->qctx->last_data = 0;
 
     /* Reset the parse context (for rescans) */
     quasar_parse_reset(&conn->qctx->parse);
+
+    conn->streaming_post = false;
+
+    admit(conn, QUASAR_LANE_QUERY);
+
+    if (conn->window_path != NULL)
+        fetch_data(conn, conn->window_path);
+    else if (strlen(query) > GET_QUERY_SIZE_LIMIT)
+    {
+        if (conn->pool->post_stream != QUASAR_CAP_NO)
+            QuasarExecuteQueryPostStream(conn, query, param_values, numParams);
+        else
+            QuasarExecuteQueryPost(conn, query, param_values, numParams);
+    } else {
+        QuasarExecuteQueryGet(conn, query, param_values, numParams);
+    }
+
+    conn->exec_transfer = 1;
+
+    /*
+     * Adding the handle doesn't send anything yet, so drive it once to
+     * get the connection and request going. That way Quasar starts
+     * working while the caller does something else. Pipelined
+     * transfers are already under way on their own thread.
+     */
+    if (conn->pipeline == NULL && conn->proxy == NULL)
+        scheduler_perform(conn, CURL_SOCKET_TIMEOUT, 0);
+}
+
+/*
+ * Split a scan into streams windows of window_rows rows each (the last
+ * one gets the rest) which are fetched concurrently, each on a handle of
+ * its own. The first window is conn's; the others get connections of
+ * their own, so each buffers, pauses and times out like a scan would,
+ * and may go to another endpoint. QuasarContinueQuery hands out tuples
+ * from whichever window has some.
+ * The windows are ranges of the file QuasarMaterializeQuery has Quasar
+ * write the result to, so the query only runs once. The planner only
+ * splits unordered scans without parameters.
+ * Windows aren't pipelined or proxied: both run one transfer per scan.
+ */
+extern void
+QuasarSplitQuery(QuasarConn *conn, ForeignServer *server, ForeignTable *table,
+                 EState *estate, Relation rel, int streams, long window_rows)
+{
+    int i;
+
+    elog(DEBUG1, "quasar_fdw: splitting scan into %d windows of %ld rows",
+         streams, window_rows);
+
+    conn->use_pipeline = false;
+    conn->use_proxy = false;
+    conn->window_offset = 0;
+    conn->window_limit = window_rows;
+    conn->windows = list_make1(conn);
+
+    for (i = 1; i < streams; ++i)
+    {
+        QuasarConn *window = QuasarGetConnection(server, table);
+
+        QuasarPrepQuery(window, estate, rel);
+        window->use_pipeline = false;
+        window->use_proxy = false;
+        window->window_offset = i * window_rows;
+        window->window_limit = i < streams - 1 ? window_rows : -1;
+        conn->windows = lappend(conn->windows, window);
+    }
+}
+
+/*
+ * Make a scan parallel: its windows (like those of QuasarSplitQuery, but
+ * sized for the participating processes) are handed out through shared,
+ * and each process fetches one at a time, claiming another when it's
+ * done, until they are all taken. The leader has materialized the query
+ * into shared->path when there are several; a scan with parameters has
+ * a single window, which is just the query.
+ */
+extern void
+QuasarSetParallel(QuasarConn *conn, QuasarParallelScan *shared)
+{
+    conn->shared = shared;
+    if (conn->window_path == NULL && shared->path[0] != '\0')
+        conn->window_path = MemoryContextStrdup(conn->querymem, shared->path);
+}
+
+/* Take the next window of a parallel scan, false when none is left */
+static bool
+parallel_claim(QuasarConn *conn)
+{
+    QuasarParallelScan *shared = conn->shared;
+    uint32 window = pg_atomic_fetch_add_u32(&shared->next_window, 1);
+
+    if (window >= shared->nwindows)
+        return false;
+
+    elog(DEBUG1, "quasar_fdw: claimed window %u of %u of parallel scan",
+         window + 1, shared->nwindows);
+    conn->window_offset = window * shared->window_rows;
+    conn->window_limit = window < shared->nwindows - 1 ? shared->window_rows : -1;
+    return true;
+}
+
+/*
+ * Make a scan resumable. When its transfer fails in a way which may not
+ * happen again (a curl error, a timeout or a 5xx) the scan is sent again,
+ * up to RESUME_MAX_RETRIES times, instead of erroring out. Once the
+ * executor has had rows, the retry is resume_query: the scan's query
+ * with a condition skipping the rows up to the resume key of the last one
+ * returned, which it takes as an extra parameter. The planner orders the
+ * scan by that key, which has to be unique for nothing to be returned
+ * twice or skipped.
+ */
+extern void
+QuasarSetResumable(QuasarConn *conn, Relation rel, char *resume_query,
+                   AttrNumber attnum)
+{
+    Oid typoutput;
+    bool isvarlena;
+
+    conn->resume_query = resume_query;
+    conn->resume_attnum = attnum;
+    conn->resume_tupdesc = RelationGetDescr(rel);
+    conn->resume_type = TupleDescAttr(conn->resume_tupdesc, attnum - 1)->atttypid;
+    getTypeOutputInfo(conn->resume_type, &typoutput, &isvarlena);
+    fmgr_info(typoutput, &conn->resume_out);
+}
+
+/* Keep what a resumed scan needs from its first request */
+static void
+resume_start(QuasarConn *conn, char *query,
+             const char **param_values, size_t numParams)
+{
+    MemoryContext oldcontext;
+    int i;
+
+    if (conn->resume_params != NULL)
+    {
+        for (i = 0; i < conn->resume_nparams; ++i)
+            pfree(conn->resume_params[i]);
+        pfree(conn->resume_params);
+    }
+    if (conn->resume_value != NULL)
+        pfree(conn->resume_value);
+
+    oldcontext = MemoryContextSwitchTo(conn->querymem);
+    conn->resume_base = query;
+    conn->resume_nparams = numParams;
+    conn->resume_params = palloc((numParams + 1) * sizeof(char *));
+    for (i = 0; i < numParams; ++i)
+        conn->resume_params[i] = pstrdup(param_values[i]);
+    MemoryContextSwitchTo(oldcontext);
+
+    conn->resume_value = NULL;
+    conn->resume_retries = 0;
+}
+
+/*
+ * Remember the resume key of the last row the executor got, as a literal
+ * for resume_query. Done once per batch, before the batch is thrown away.
+ */
+static void
+resume_remember(QuasarConn *conn, Datum *values, bool *nulls)
+{
+    Datum value = values[conn->resume_attnum - 1];
+    char *svalue;
+    StringInfoData buf;
+    MemoryContext oldcontext;
+
+    if (nulls[conn->resume_attnum - 1])
+    {
+        /* Nothing to pick up after, so no more retries */
+        elog(DEBUG1, "quasar_fdw: null resume key, scan can't be resumed");
+        conn->resume_retries = RESUME_MAX_RETRIES;
+        return;
+    }
+
+    svalue = OutputFunctionCall(&conn->resume_out, value);
+
+    oldcontext = MemoryContextSwitchTo(conn->querymem);
+    if (conn->resume_value != NULL)
+        pfree(conn->resume_value);
+    initStringInfo(&buf);
+    deparseLiteral(&buf, conn->resume_type, svalue, value);
+    conn->resume_value = buf.data;
+    MemoryContextSwitchTo(oldcontext);
+
+    pfree(svalue);
+}
+
+/*
+ * Send a resumable scan again after its transfer failed, if it has
+ * retries left. Tuples parsed but not returned yet are dropped, the retry
+ * brings them again. Retries go straight to Quasar, not through a
+ * pipeline or the proxy worker, and to another endpoint if there is a
+ * healthy one.
+ */
+static bool
+resume_transfer(QuasarConn *conn)
+{
+    QuasarPool *pool;
+
+    if (conn->resume_query == NULL || conn->resume_retries >= RESUME_MAX_RETRIES)
+        return false;
+
+    ++conn->resume_retries;
+    elog(WARNING, "quasar_fdw: transfer failed, resuming scan (retry %d of %d) (%s)",
+         conn->resume_retries, RESUME_MAX_RETRIES, conn->full_url);
+
+    QuasarResetConnection(conn);
+    MemoryContextReset(conn->qctx->batchmem);
+    conn->use_pipeline = false;
+    conn->use_proxy = false;
+
+    pool = QuasarPoolChoose(conn->servers, conn->socket_path, &conn->tls,
+                            conn->max_connections, conn->pool);
+    if (pool != NULL)
+    {
+        QuasarPoolRelease(conn->pool, conn->curl);
+        conn->pool = pool;
+        conn->server = pool->server;
+        conn->curl = QuasarPoolAcquire(pool);
+    }
+
+    if (conn->resume_value == NULL)
+        execute_query(conn, conn->resume_base,
+                      (const char **) conn->resume_params, conn->resume_nparams);
+    else
+    {
+        conn->resume_params[conn->resume_nparams] = conn->resume_value;
+        execute_query(conn, conn->resume_query,
+                      (const char **) conn->resume_params, conn->resume_nparams + 1);
+    }
+    return true;
 }
 
 void
 QuasarExecuteQueryGet(QuasarConn *conn, char *query,
                       const char **param_values, size_t numParams)
 {
-    int sc, i;
+    int i;
     CURL *curl = conn->curl;
-    CURLM *curlm = conn->curlm;
     StringInfoData url, param;
 
     initStringInfo(&url);
@@ -228,28 +890,150 @@ QuasarExecuteQueryGet(QuasarConn *conn, char *query,
     conn->full_url = url.data;
 
     curl_easy_setopt(curl, CURLOPT_URL, url.data);
-    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "gzip");
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, conn->compression);
     curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_handler);
     curl_easy_setopt(curl, CURLOPT_HEADERDATA, conn->qctx);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, query_body_handler);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, conn->qctx);
 
+    /* Pipelined scans run on their own thread, they don't hedge */
+    if (!conn->use_pipeline)
+        hedge_arm(conn, url.data, header_handler, conn->qctx,
+                  query_body_handler, conn->qctx);
+
     elog(DEBUG1, "quasar_fdw: curling GET %s", url.data);
-    sc = curl_multi_add_handle(curlm, curl);
-    if (sc != CURLM_OK)
+    start_transfer(conn);
+}
+
+/*
+ * Send a long query as the body of a POST without a Destination header,
+ * so Quasar streams the results back in the same response.
+ * Quasar versions which insist on a Destination answer with a 400 saying
+ * so, or don't know the endpoint at all, in which case check_transfer
+ * falls back to QuasarExecuteQueryPost.
+ */
+void
+QuasarExecuteQueryPostStream(QuasarConn *conn, char *query,
+                             const char **param_values, size_t numParams)
+{
+    int i;
+    CURL *curl = conn->curl;
+    StringInfoData url, param;
+    MemoryContext oldcontext;
+
+    Assert(conn->curlm != NULL && conn->qctx != NULL);
+
+    /* Keep the query around in case we have to fall back */
+    if (conn->pool->post_stream == QUASAR_CAP_UNKNOWN)
     {
-        QuasarCleanupConnection(conn);
-        elog(ERROR, "quasar_fdw: curl add handle failed %s", curl_multi_strerror(sc));
+        if (conn->param_values != NULL)
+        {
+            for (i = 0; i < conn->numParams; ++i)
+                pfree(conn->param_values[i]);
+            pfree(conn->param_values);
+        }
+
+        oldcontext = MemoryContextSwitchTo(conn->querymem);
+        conn->query = query;
+        conn->numParams = numParams;
+        conn->param_values = numParams > 0 ? palloc(numParams * sizeof(char *)) : NULL;
+        for (i = 0; i < numParams; ++i)
+            conn->param_values[i] = pstrdup(param_values[i]);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    initStringInfo(&url);
+    initStringInfo(&param);
+    appendStringInfo(&url, "%s/query/fs%s", conn->server, conn->path);
+
+    for (i = 0; i < numParams; ++i) {
+        resetStringInfo(&param);
+        appendStringInfo(&param, "var.p%d", i+1);
+        appendStringInfoQuery(curl, &url, param.data, param_values[i], i == 0);
     }
+
+    conn->full_url = url.data;
+    conn->streaming_post = true;
+
+    curl_easy_setopt(curl, CURLOPT_URL, url.data);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) strlen(query));
+    curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, query);
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, conn->compression);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_handler);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, conn->qctx);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, query_body_handler);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, conn->qctx);
+
+    elog(DEBUG1, "quasar_fdw: curling streaming POST %s with query %s", url.data, query);
+    start_transfer(conn);
+}
+
+/*
+ * This Quasar rejected a streaming POST,
+ * remember that and redo the query the old way
+ */
+static void
+fallback_query_post(QuasarConn *conn)
+{
+    elog(DEBUG1, "quasar_fdw: %s does not stream POSTed queries, falling back (status %d)",
+         conn->server, conn->qctx->status);
+
+    conn->pool->post_stream = QUASAR_CAP_NO;
+
+    scheduler_remove(conn);
+    QuasarPoolResetHandle(conn->pool, conn->curl);
+
+    conn->streaming_post = false;
+    conn->qctx->status = 0;
+    conn->qctx->error_len = 0;
+
+    QuasarExecuteQueryPost(conn, conn->query,
+                           (const char **) conn->param_values, conn->numParams);
 }
 
 void
 QuasarExecuteQueryPost(QuasarConn *conn, char *query,
                        const char **param_values, size_t numParams)
+{
+    post_query(conn, query, param_values, numParams, &conn->post_path);
+    fetch_data(conn, conn->post_path);
+}
+
+/*
+ * Have Quasar run the query of a split or parallel scan once, into a
+ * file whose windows are then fetched, so that they are disjoint ranges
+ * of the same rows whatever order Quasar returns them in. The file is
+ * kept for rescans and deleted with the connection. Returns its path.
+ */
+extern char *
+QuasarMaterializeQuery(QuasarConn *conn, char *query)
+{
+    MemoryContext oldcontext;
+
+    if (conn->window_path != NULL)
+        return conn->window_path;
+
+    admit(conn, QUASAR_LANE_QUERY);
+
+    conn->owns_window_path = true;
+    oldcontext = MemoryContextSwitchTo(conn->querymem);
+    post_query(conn, query, NULL, 0, &conn->window_path);
+    MemoryContextSwitchTo(oldcontext);
+
+    return conn->window_path;
+}
+
+/*
+ * Have Quasar write the result of a query to a new file. Its path
+ * goes in *path before the request is sent, so that the file gets
+ * deleted even if the request fails. Waits for Quasar to be done.
+ */
+static void
+post_query(QuasarConn *conn, char *query,
+           const char **param_values, size_t numParams, char **path)
 {
     int sc, i;
-    CURL *curl = curl_easy_init();
-    CURLM *curlm = conn->curlm;
+    CURL *curl = QuasarPoolAcquire(conn->pool);
     StringInfoData url;
     StringInfoData param;
     StringInfoData dest;
@@ -270,25 +1054,25 @@ QuasarExecuteQueryPost(QuasarConn *conn, char *query,
     }
 
     initStringInfo(&dest);
-    appendStringInfo(&dest, "%s%sfdw_%d", conn->path, conn->path[strlen(conn->path)-1] == '/' ? "" : "/", rand());
-    conn->post_path = pstrdup(dest.data);
+    appendStringInfo(&dest, "%s%s%s", conn->path, conn->path[strlen(conn->path)-1] == '/' ? "" : "/", QuasarTempFileName());
+    *path = pstrdup(dest.data);
     resetStringInfo(&dest);
-    appendStringInfo(&dest, "Destination: %s", conn->post_path);
+    appendStringInfo(&dest, "Destination: %s", *path);
     headers = curl_slist_append(headers, dest.data);
 
     /* Set up CURL instance. */
     curl_easy_setopt(curl, CURLOPT_URL, url.data);
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
     curl_easy_setopt(curl, CURLOPT_POSTFIELDS, query);
-    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "gzip");
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, conn->compression);
     curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_handler);
     curl_easy_setopt(curl, CURLOPT_HEADERDATA, &infoctx);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, throwaway_body_handler);
 
     elog(DEBUG1, "quasar_fdw: curling POST %s with query %s", url.data, query);
-    sc = curl_easy_perform(curl);
+    sc = perform_blocking(conn, curl);
     curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+    QuasarPoolRelease(conn->pool, curl);
 
     if (sc != CURLE_OK)
     {
@@ -303,71 +1087,1348 @@ QuasarExecuteQueryPost(QuasarConn *conn, char *query,
         elog(ERROR, "quasar_fdw: Got bad response from quasar: %d (%s)",
              infoctx.status, url.data);
     }
+}
 
-    /* Ok now we go get the data */
-    curl = conn->curl;
+/*
+ * Fetch the file a POSTed query's result was written to, or the
+ * window of it this connection is for
+ */
+static void
+fetch_data(QuasarConn *conn, const char *path)
+{
+    CURL *curl = conn->curl;
+    StringInfoData url;
 
-    resetStringInfo(&url);
-    appendStringInfo(&url, "%s/data/fs%s", conn->server, conn->post_path);
+    initStringInfo(&url);
+    appendStringInfo(&url, "%s/data/fs%s", conn->server, path);
+    if (conn->window_offset > 0 || conn->window_limit >= 0)
+    {
+        appendStringInfo(&url, "?offset=%ld", conn->window_offset);
+        if (conn->window_limit >= 0)
+            appendStringInfo(&url, "&limit=%ld", conn->window_limit);
+    }
     conn->full_url = url.data;
 
     curl_easy_setopt(curl, CURLOPT_URL, url.data);
-    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "gzip");
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, conn->compression);
     curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_handler);
     curl_easy_setopt(curl, CURLOPT_HEADERDATA, conn->qctx);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, query_body_handler);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, conn->qctx);
 
     elog(DEBUG1, "quasar_fdw: curling DATA %s", url.data);
-    sc = curl_multi_add_handle(curlm, curl);
-    if (sc != CURLM_OK)
-    {
-        QuasarCleanupConnection(conn);
-        elog(ERROR, "quasar_fdw: curl add handle failed %s", curl_multi_strerror(sc));
-    }
+    start_transfer(conn);
 }
 
 
 extern void
 QuasarContinueQuery(QuasarConn *conn) {
-    int cc, nfds;
-    clock_t time;
+    continue_transfer(conn);
 
-    while (conn->ongoing_transfers == 1 &&
-           conn->qctx->next_tuple >= conn->qctx->num_tuples)
+    /* A parallel scan goes on with the next window nobody has claimed */
+    while (conn->shared != NULL &&
+           conn->ongoing_transfers == 0 &&
+           conn->qctx->next_tuple >= conn->qctx->num_tuples &&
+           parallel_claim(conn))
     {
-        elog(DEBUG3, "quasar_fdw: continuing curl transfer");
-        time = clock();
+        QuasarResetConnection(conn);
+        execute_query(conn, conn->parallel_query, NULL, 0);
+        continue_transfer(conn);
+    }
+}
 
-        /* Basically select() on curl's internal fds */
-        cc = curl_multi_wait(conn->curlm, NULL, 0, conn->timeout_ms, &nfds);
-        if (cc != CURLM_OK) {
+static void
+continue_transfer(QuasarConn *conn)
+{
+    TimestampTz waiting_since;
+
+    if (conn->pipeline != NULL)
+    {
+        pipeline_continue(conn);
+        return;
+    }
+    if (conn->proxy != NULL)
+    {
+        proxy_continue(conn);
+        return;
+    }
+    if (conn->windows != NIL)
+    {
+        windows_continue(conn);
+        return;
+    }
+
+    /* Once one leg of a hedged GET has answered, it is our transfer */
+    hedge_settle(conn);
+
+    /* The executor is done with the current batch, make room for more */
+    if (conn->qctx->next_tuple >= conn->qctx->num_tuples)
+        next_batch(conn);
+
+    /*
+     * Take in what came while the executor was busy elsewhere (the request
+     * went out when the scan began) before holding the time against Quasar
+     */
+    if (conn->ongoing_transfers == 1 &&
+        conn->qctx->next_tuple >= conn->qctx->num_tuples)
+    {
+        scheduler_wait(conn, 0);
+        hedge_settle(conn);
+    }
+    check_transfer(conn);
+
+    waiting_since = GetCurrentTimestamp();
+    while (conn->ongoing_transfers == 1 &&
+           conn->qctx->next_tuple >= conn->qctx->num_tuples)
+    {
+        long timeout = transfer_time_left(conn, waiting_since);
+        long hedge = hedge_time_left(conn);
+
+        elog(DEBUG3, "quasar_fdw: continuing curl transfer");
+
+        if (hedge == 0)
+            hedge_launch(conn);
+        else if (hedge > 0 && hedge < timeout)
+            timeout = hedge;
+
+        /* Sleep until any active scan's socket is ready */
+        scheduler_wait(conn, timeout);
+        hedge_settle(conn);
+        check_transfer(conn);
+    }
+}
+
+#if (PG_VERSION_NUM >= 140000)
+/*
+ * For a scan run by an asynchronous Append: do what the transfer can do
+ * now without waiting. False if the scan has to wait for its socket to
+ * get more tuples; QuasarAddWaitEvent then has the Append wait for that
+ * socket along with the other scans'. The first byte and idle timeouts
+ * aren't checked while the Append waits, statement_timeout still is.
+ *
+ * Only a plain transfer on the shared multi handle, with a single socket
+ * curl waits on only to read from, can be waited on like that. For
+ * pipelined, proxied, split and parallel scans, hedged GETs, transfers
+ * still resolving or connecting and ones with a request left to send
+ * this says it needn't, and the caller reads them with QuasarContinueQuery.
+ */
+extern bool
+QuasarPollQuery(QuasarConn *conn)
+{
+    curl_socket_t fd;
+    int what;
+
+    if (conn->pipeline != NULL || conn->proxy != NULL ||
+        conn->windows != NIL || conn->shared != NULL)
+        return true;
+
+    hedge_settle(conn);
+    if (conn->nlegs > 0)
+        return true;
+
+    if (conn->qctx->next_tuple >= conn->qctx->num_tuples)
+        next_batch(conn);
+
+    /* Run curl's due timers, then let it read whatever the socket has */
+    scheduler_perform(conn, CURL_SOCKET_TIMEOUT, 0);
+    fd = transfer_socket(conn, &what);
+    if (fd != CURL_SOCKET_BAD)
+        scheduler_perform(conn, fd, 0);
+    check_transfer(conn);
+
+    return conn->ongoing_transfers == 0 ||
+        conn->qctx->next_tuple < conn->qctx->num_tuples ||
+        transfer_socket(conn, &what) == CURL_SOCKET_BAD ||
+        what != CURL_POLL_IN;
+}
+
+/* Add the socket a QuasarPollQuery said to wait for to an Append's wait */
+extern void
+QuasarAddWaitEvent(QuasarConn *conn, WaitEventSet *set, void *user_data)
+{
+    int what;
+    curl_socket_t fd = transfer_socket(conn, &what);
+
+    /* The Append only tells readable sockets' scans, which is all we need */
+    if (fd != CURL_SOCKET_BAD && what == CURL_POLL_IN)
+        AddWaitEventToSet(set, WL_SOCKET_READABLE, fd, NULL, user_data);
+}
+
+/*
+ * The one socket curl has a scan's transfer on, and what curl waits for
+ * on it. CURL_SOCKET_BAD for none or several.
+ */
+static curl_socket_t
+transfer_socket(QuasarConn *conn, int *what)
+{
+    ListCell *lc;
+    curl_socket_t fd = CURL_SOCKET_BAD;
+
+    foreach(lc, sockets)
+    {
+        QuasarSocket *sock = (QuasarSocket *) lfirst(lc);
+
+        if (sock->easy != conn->curl)
+            continue;
+        if (fd != CURL_SOCKET_BAD)
+            return CURL_SOCKET_BAD;
+        fd = sock->fd;
+        *what = sock->what;
+    }
+    return fd;
+}
+#endif
+
+/*
+ * Continue a pipelined scan: take what the helper thread has put in the
+ * ring, and the records it framed in it, up to the batch budget,
+ * sleeping when it's empty.
+ */
+static void
+pipeline_continue(QuasarConn *conn)
+{
+    quasar_query_curl_context *ctx = conn->qctx;
+    TimestampTz waiting_since;
+    long timeout;
+
+    if (ctx->next_tuple >= ctx->num_tuples)
+        next_batch(conn);
+
+    waiting_since = GetCurrentTimestamp();
+    for (;;)
+    {
+        const char *data;
+        size_t avail;
+        CURLcode result;
+        bool done;
+
+        ctx->status = QuasarPipelineStatus(conn->pipeline);
+        /* Look at done first, so everything before it is in the ring */
+        done = QuasarPipelineDone(conn->pipeline, &result);
+
+        while (!batch_full(ctx) &&
+               (avail = QuasarPipelinePeek(conn->pipeline, &data)) > 0)
+        {
+            avail = Min(avail, BUF_SIZE);
+            batch_append(ctx, data, avail);
+            QuasarPipelineConsume(conn->pipeline, avail);
+            ctx->last_data = GetCurrentTimestamp();
+            pipeline_take_records(conn);
+        }
+        /* Records may be framed after their bytes were taken */
+        pipeline_take_records(conn);
+
+        if (ctx->next_tuple < ctx->num_tuples)
+            return;
+
+        if (done && QuasarPipelinePeek(conn->pipeline, &data) == 0)
+        {
+            conn->ongoing_transfers = 0;
+            conn->transfer_result = result;
+            if (check_transfer(conn))
+                QuasarContinueQuery(conn);
+            return;
+        }
+
+        if (check_transfer(conn))
+        {
+            QuasarContinueQuery(conn);
+            return;
+        }
+        timeout = transfer_time_left(conn, waiting_since);
+
+        /* A resumed scan isn't pipelined any more */
+        if (conn->pipeline == NULL)
+        {
+            QuasarContinueQuery(conn);
+            return;
+        }
+        QuasarPipelineWait(conn->pipeline, timeout);
+        QuasarCleanupPoll();
+    }
+}
+
+/*
+ * Add the records the pipeline thread framed in bytes already taken to
+ * the batch. Those bytes end the batch, so a record ending behind bytes
+ * before the last one ends at records.len - behind.
+ */
+static void
+pipeline_take_records(QuasarConn *conn)
+{
+    quasar_query_curl_context *ctx = conn->qctx;
+    uint32 behind[64];
+    int n, i;
+
+    while ((n = QuasarPipelineTakeRecords(conn->pipeline, behind, lengthof(behind))) > 0)
+    {
+        for (i = 0; i < n; ++i)
+            batch_add_record(ctx, ctx->records.len - (int) behind[i]);
+    }
+}
+
+/*
+ * Continue a scan run by the proxy worker: parse the chunks it sent into
+ * tuples, up to the batch budget, sleeping when there are none. Leaving
+ * chunks in the queue is what makes the worker pause the transfer.
+ */
+static void
+proxy_continue(QuasarConn *conn)
+{
+    quasar_query_curl_context *ctx = conn->qctx;
+    TimestampTz waiting_since;
+    long timeout;
+
+    if (ctx->next_tuple >= ctx->num_tuples)
+        next_batch(conn);
+
+    waiting_since = GetCurrentTimestamp();
+    for (;;)
+    {
+        const char *data;
+        size_t len;
+        CURLcode result;
+
+        while (!batch_full(ctx) &&
+               (len = QuasarProxyReceive(conn->proxy, &data)) > 0)
+        {
+            ctx->status = QuasarProxyStatus(conn->proxy);
+            if (ctx->status == 200)
+            {
+                parse_chunk(ctx, data, len);
+                ctx->last_data = GetCurrentTimestamp();
+            }
+        }
+        ctx->status = QuasarProxyStatus(conn->proxy);
+
+        if (ctx->next_tuple < ctx->num_tuples)
+            return;
+
+        if (QuasarProxyDone(conn->proxy, &result))
+        {
+            conn->ongoing_transfers = 0;
+            conn->transfer_result = result;
+            if (check_transfer(conn))
+                QuasarContinueQuery(conn);
+            return;
+        }
+
+        if (check_transfer(conn))
+        {
+            QuasarContinueQuery(conn);
+            return;
+        }
+        timeout = transfer_time_left(conn, waiting_since);
+
+        /* A resumed scan isn't proxied any more */
+        if (conn->proxy == NULL)
+        {
+            QuasarContinueQuery(conn);
+            return;
+        }
+        QuasarProxyWait(conn->proxy, timeout);
+        QuasarCleanupPoll();
+    }
+}
+
+/*
+ * Continue a split scan: point conn->reading at a window with tuples,
+ * sleeping until one has some. Only the window the executor has been
+ * reading can be done with its batch, the others haven't been touched.
+ * When all windows are finished and empty, conn->reading is conn, which
+ * tells the executor it's the end of data.
+ */
+static void
+windows_continue(QuasarConn *conn)
+{
+    TimestampTz waiting_since;
+    ListCell *lc;
+
+    if (conn->reading->qctx->next_tuple >= conn->reading->qctx->num_tuples)
+        next_batch(conn->reading);
+
+    /* Take in what came while the executor was busy, see continue_transfer */
+    scheduler_wait(conn, 0);
+
+    waiting_since = GetCurrentTimestamp();
+    for (;;)
+    {
+        long timeout = -1;
+
+        foreach(lc, conn->windows)
+        {
+            QuasarConn *window = (QuasarConn *) lfirst(lc);
+
+            hedge_settle(window);
+            check_transfer(window);
+            if (window->qctx->next_tuple < window->qctx->num_tuples)
+            {
+                conn->reading = window;
+                return;
+            }
+        }
+
+        foreach(lc, conn->windows)
+        {
+            QuasarConn *window = (QuasarConn *) lfirst(lc);
+            long left, hedge;
+
+            if (window->ongoing_transfers == 0)
+                continue;
+
+            left = transfer_time_left(window, waiting_since);
+            hedge = hedge_time_left(window);
+            if (hedge == 0)
+                hedge_launch(window);
+            else if (hedge > 0 && hedge < left)
+                left = hedge;
+
+            if (timeout < 0 || left < timeout)
+                timeout = left;
+        }
+
+        if (timeout < 0)
+        {
+            conn->reading = conn;
+            return;
+        }
+
+        elog(DEBUG3, "quasar_fdw: continuing split transfer");
+        scheduler_wait(conn, timeout);
+    }
+}
+
+/*
+ * Send a prepared request: through the proxy worker if it's running,
+ * on a helper thread if the scan is pipelined, otherwise on the shared
+ * multi handle. Only GETs are proxied. A streaming POST to a server we
+ * haven't seen answer one yet stays on the multi handle, which knows how
+ * to fall back.
+ */
+static void
+start_transfer(QuasarConn *conn)
+{
+    if (conn->use_proxy && !conn->streaming_post)
+    {
+        conn->proxy = QuasarProxyStart(conn->pool, conn->full_url, conn->compression,
+                                       conn->connect_timeout_ms, conn->subid);
+        if (conn->proxy != NULL)
+        {
+            /* The worker's connections are warm, no need to hedge */
+            hedge_disarm(conn);
+            conn->ongoing_transfers = 1;
+            conn->transfer_result = CURLE_OK;
+            conn->transfer_start = GetCurrentTimestamp();
+            return;
+        }
+    }
+
+    if (conn->use_pipeline &&
+        !(conn->streaming_post && conn->pool->post_stream == QUASAR_CAP_UNKNOWN))
+    {
+        conn->ongoing_transfers = 1;
+        conn->transfer_result = CURLE_OK;
+        conn->transfer_start = GetCurrentTimestamp();
+        curl_easy_setopt(conn->curl, CURLOPT_CONNECTTIMEOUT_MS, conn->connect_timeout_ms);
+
+        QuasarPoolSetThreaded(conn->pool, conn->curl);
+        conn->pipeline = QuasarPipelineStart(conn->curl, conn->subid);
+        if (conn->pipeline != NULL)
+            return;
+        curl_easy_setopt(conn->curl, CURLOPT_SHARE, conn->pool->share);
+    }
+
+    scheduler_add(conn);
+}
+
+/*
+ * Milliseconds this scan may still wait for its transfer, erroring out
+ * once it is up: Quasar gets first_byte_timeout_ms from the request to
+ * its response, and then idle_timeout_ms between data while we are
+ * waiting for it. Paused time doesn't count, since that's on us.
+ * Connecting is timed by curl itself. A resumed transfer has no time
+ * left to wait for the one it replaces. Without a timeout the scan waits
+ * TRANSFER_WAIT_MS at a time, until a cancel or statement_timeout.
+ */
+static long
+transfer_time_left(QuasarConn *conn, TimestampTz waiting_since)
+{
+    TimestampTz now = GetCurrentTimestamp();
+    TimestampTz deadline;
+    long secs;
+    int usecs;
+
+    if (conn->qctx->status == 0)
+    {
+        if (conn->first_byte_timeout_ms <= 0)
+            return TRANSFER_WAIT_MS;
+        deadline = TimestampTzPlusMilliseconds(conn->transfer_start,
+                                               conn->first_byte_timeout_ms);
+        if (now >= deadline)
+        {
+            long timeout = conn->first_byte_timeout_ms;
+            char *url = conn->full_url;
+            QuasarPoolReportFailure(conn->pool);
+            if (resume_transfer(conn))
+                return 0;
+            QuasarCleanupConnection(conn);
+            elog(ERROR, "quasar_fdw: Timeout (%ld ms) waiting for Quasar to respond (%s)",
+                 timeout, url);
+        }
+    }
+    else
+    {
+        if (conn->idle_timeout_ms <= 0)
+            return TRANSFER_WAIT_MS;
+        deadline = TimestampTzPlusMilliseconds(Max(waiting_since, conn->qctx->last_data),
+                                               conn->idle_timeout_ms);
+        if (now >= deadline)
+        {
+            long timeout = conn->idle_timeout_ms;
+            char *url = conn->full_url;
+            QuasarPoolReportFailure(conn->pool);
+            if (resume_transfer(conn))
+                return 0;
             QuasarCleanupConnection(conn);
-            elog(ERROR, "quasar_fdw: curl error %s", curl_multi_strerror(cc));
+            elog(ERROR, "quasar_fdw: Timeout (%ld ms) waiting for data from Quasar (%s)",
+                 timeout, url);
+        }
+    }
+
+    TimestampDifference(now, deadline, &secs, &usecs);
+    return secs * 1000 + (usecs + 999) / 1000;
+}
+
+/*
+ * curl_easy_perform for the requests we don't stream (estimates, compiles
+ * and legacy POSTs), aborted on a cancel or statement_timeout, or when
+ * Quasar doesn't answer within first_byte_timeout_ms. curl calls our
+ * progress handler at least once a second while it waits.
+ */
+static CURLcode
+perform_blocking(QuasarConn *conn, CURL *curl)
+{
+    CURLcode cc;
+
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, conn->connect_timeout_ms);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, blocking_progress_handler);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, conn);
+
+    conn->transfer_start = GetCurrentTimestamp();
+    cc = curl_easy_perform(curl);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+
+    if (cc == CURLE_ABORTED_BY_CALLBACK)
+    {
+        long timeout = conn->first_byte_timeout_ms;
+        QuasarPool *pool = conn->pool;
+        QuasarCleanupConnection(conn);
+        CHECK_FOR_INTERRUPTS();
+        QuasarPoolReportFailure(pool);
+        elog(ERROR, "quasar_fdw: Timeout (%ld ms) waiting for Quasar to respond",
+             timeout);
+    }
+
+    return cc;
+}
+
+/*
+ * Look at how this scan's transfer is going and error out if it went bad.
+ * Other scans' transfers are checked when they continue themselves.
+ * Returns true if the transfer failed but was resumed (see resume_transfer),
+ * in which case it starts over.
+ */
+static bool
+check_transfer(QuasarConn *conn)
+{
+    int status = conn->qctx->status;
+    char *url = conn->full_url;
+
+    /* First streaming POST to this server tells us if it can do it.
+     * Only a status saying the endpoint or the way we used it isn't
+     * supported counts as "no", or a 400 asking for the Destination
+     * header: other errors, like a bad query, are the query's and
+     * leave the question open. */
+    if (conn->streaming_post &&
+        conn->pool->post_stream == QUASAR_CAP_UNKNOWN &&
+        status > 0)
+    {
+        if (status == 200)
+            conn->pool->post_stream = QUASAR_CAP_YES;
+        else if (status == 404 || status == 405 || status == 415)
+        {
+            fallback_query_post(conn);
+            return false;
+        }
+        else if (status == 400)
+        {
+            /* Wait for the body, it says what was wrong */
+            if (conn->ongoing_transfers > 0)
+                return false;
+            if (wants_destination(conn->qctx))
+            {
+                fallback_query_post(conn);
+                return false;
+            }
+        }
+    }
+
+    /* Error out on bad status */
+    if (status > 0 && status != 200) {
+        if (status >= 500)
+        {
+            QuasarPoolReportFailure(conn->pool);
+            if (resume_transfer(conn))
+                return true;
+        }
+        QuasarCleanupConnection(conn);
+        elog(ERROR, "quasar_fdw: bad status from Quasar %d (%s)",
+             status, url);
+    }
+
+    /* Error out if the transfer itself failed */
+    if (conn->ongoing_transfers == 0 && conn->transfer_result != CURLE_OK) {
+        CURLcode result = conn->transfer_result;
+        QuasarPoolReportFailure(conn->pool);
+        if (resume_transfer(conn))
+            return true;
+        QuasarCleanupConnection(conn);
+        elog(ERROR, "quasar_fdw: curl transfer failed: %s (%s)",
+             curl_easy_strerror(result), url);
+    }
+
+    if (conn->ongoing_transfers == 0 && status == 200)
+        QuasarPoolReportSuccess(conn->pool);
+
+    /* Quasar is done with us, let the next request in */
+    if (conn->ongoing_transfers == 0)
+        admit_release(conn);
+    return false;
+}
+
+/*
+ * Whether a 400 is Quasar saying a POSTed query needs a Destination
+ * header, which versions without streaming POSTs do
+ */
+static bool
+wants_destination(quasar_query_curl_context *ctx)
+{
+    return ctx->error_len > 0 &&
+        strstr(ctx->error_body, "Destination") != NULL;
+}
+
+/*
+ * Wait for our turn to send a request, if the server limits
+ * requests in flight from all backends (see quasar_admit.c).
+ * After first_byte_timeout_ms in line the request goes ahead anyway,
+ * uncounted: the transfer's own timeouts still apply to it.
+ */
+static void
+admit(QuasarConn *conn, int lane)
+{
+    if (conn->max_inflight <= 0 || conn->admit_slot != QUASAR_ADMIT_UNLIMITED)
+        return;
+
+    conn->admit_slot = QuasarAdmit(conn->server_option, conn->max_inflight,
+                                   lane, conn->first_byte_timeout_ms, conn->subid);
+    if (conn->admit_slot == QUASAR_ADMIT_TIMEOUT)
+    {
+        elog(DEBUG1, "quasar_fdw: no turn to query %s after %ld ms, sending anyway",
+             conn->server, conn->first_byte_timeout_ms);
+        conn->admit_slot = QUASAR_ADMIT_UNLIMITED;
+    }
+}
+
+static void
+admit_release(QuasarConn *conn)
+{
+    if (conn->admit_slot == QUASAR_ADMIT_UNLIMITED)
+        return;
+
+    QuasarAdmitRelease(conn->admit_slot);
+    conn->admit_slot = QUASAR_ADMIT_UNLIMITED;
+}
+
+/*
+ * Throw away the batch of tuples the executor has finished with.
+ * Only the scan itself may do this, since its slot can still point at
+ * the last tuple while other scans pump the shared multi handle.
+ */
+static void
+next_batch(QuasarConn *conn)
+{
+    quasar_query_curl_context *ctx = conn->qctx;
+    MemoryContext oldcontext;
+    char *partial = NULL;
+    int partial_len = 0;
+    Datum *values;
+    bool *nulls;
+
+    if (ctx->records.data != NULL) {
+        elog(DEBUG3, "paging batched tuples %d (%d / %d)", ctx->batch_count,
+             ctx->next_tuple, ctx->num_tuples);
+        if (conn->resume_query != NULL && ctx->next_tuple > 0)
+        {
+            int natts = conn->resume_tupdesc->natts;
+
+            oldcontext = MemoryContextSwitchTo(ctx->batchmem);
+            values = palloc(natts * sizeof(Datum));
+            nulls = palloc(natts * sizeof(bool));
+            batch_row(ctx, ctx->next_tuple - 1, values, nulls);
+            resume_remember(conn, values, nulls);
+            MemoryContextSwitchTo(oldcontext);
+        }
+
+        /* The start of a row still coming moves on to the next batch */
+        partial_len = ctx->records.len -
+            (ctx->num_tuples > 0 ? ctx->record_ends[ctx->num_tuples - 1] : 0);
+        if (partial_len > 0) {
+            elog(DEBUG3, "Found partial tuple from end of last batch, copying...");
+            partial = palloc(partial_len);
+            memcpy(partial, ctx->records.data + ctx->records.len - partial_len, partial_len);
+        }
+
+        MemoryContextReset(ctx->batchmem);
+        ctx->records.data = NULL;
+        ctx->record_ends = NULL;
+        ctx->next_tuple = ctx->num_tuples = ctx->alloc_tuples = 0;
+        ctx->scanned = 0;
+        ctx->batch_bytes = 0;
+        ++ctx->batch_count;
+
+        /* Already scanned, so the scan state goes on from its end */
+        if (partial != NULL) {
+            oldcontext = MemoryContextSwitchTo(ctx->batchmem);
+            initStringInfo(&ctx->records);
+            appendBinaryStringInfo(&ctx->records, partial, partial_len);
+            MemoryContextSwitchTo(oldcontext);
+            ctx->scanned = partial_len;
+            pfree(partial);
+        }
+    }
+
+    /* Let data flow again now there is room for it */
+    if (ctx->paused) {
+        elog(DEBUG3, "quasar_fdw: resuming paused transfer");
+        ctx->paused = false;
+        curl_easy_pause(conn->curl, CURLPAUSE_CONT);
+    }
+}
+
+/* The multi handle shared by all scans of this backend */
+static CURLM *
+scheduler_get(void)
+{
+    if (scheduler == NULL)
+    {
+        scheduler = curl_multi_init();
+        curl_multi_setopt(scheduler, CURLMOPT_SOCKETFUNCTION, scheduler_socket_cb);
+        curl_multi_setopt(scheduler, CURLMOPT_TIMERFUNCTION, scheduler_timer_cb);
+    }
+    return scheduler;
+}
+
+/* Hand a scan's prepared request over to the shared multi handle */
+static void
+scheduler_add(QuasarConn *conn)
+{
+    int sc;
+
+    conn->ongoing_transfers = 1;
+    conn->transfer_result = CURLE_OK;
+    conn->transfer_start = GetCurrentTimestamp();
+    curl_easy_setopt(conn->curl, CURLOPT_PRIVATE, (char *) conn);
+    curl_easy_setopt(conn->curl, CURLOPT_CONNECTTIMEOUT_MS, conn->connect_timeout_ms);
+
+    sc = curl_multi_add_handle(conn->curlm, conn->curl);
+    if (sc != CURLM_OK)
+    {
+        QuasarCleanupConnection(conn);
+        elog(ERROR, "quasar_fdw: curl add handle failed %s", curl_multi_strerror(sc));
+    }
+
+    scheduled_add(conn->curl, conn->subid);
+}
+
+/* Take a scan's transfer out of the shared multi handle, if it's in there */
+static void
+scheduler_remove(QuasarConn *conn)
+{
+    if (conn->curlm == NULL)
+        return;
+
+    scheduled_remove(conn->curl);
+}
+
+/* Detach every transfer, for scans that never got to clean up */
+static void
+scheduler_remove_all(void)
+{
+    ListCell *lc;
+
+    foreach(lc, scheduled)
+    {
+        elog(DEBUG1, "quasar_fdw: removing abandoned transfer");
+        curl_multi_remove_handle(scheduler, ((QuasarScheduled *) lfirst(lc))->curl);
+    }
+    list_free_deep(scheduled);
+    scheduled = NIL;
+}
+
+/* Detach the transfers of scans started in an aborted subtransaction */
+static void
+scheduler_remove_sub(SubTransactionId subid)
+{
+    ListCell *lc;
+
+    quasar_foreach(lc, scheduled)
+    {
+        QuasarScheduled *entry = (QuasarScheduled *) lfirst(lc);
+
+        if (entry->subid >= subid)
+        {
+            elog(DEBUG1, "quasar_fdw: removing transfer of aborted subtransaction");
+            curl_multi_remove_handle(scheduler, entry->curl);
+            scheduled = quasar_foreach_delete_current(scheduled, lc);
+            pfree(entry);
+        }
+    }
+}
+
+/* Remember a handle was added to the scheduler */
+static void
+scheduled_add(CURL *curl, SubTransactionId subid)
+{
+    QuasarScheduled *entry;
+    MemoryContext oldcontext;
+
+    oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+    entry = palloc(sizeof(QuasarScheduled));
+    entry->curl = curl;
+    entry->subid = subid;
+    scheduled = lappend(scheduled, entry);
+    MemoryContextSwitchTo(oldcontext);
+}
+
+/* Take a handle out of the scheduler, if it's in there */
+static void
+scheduled_remove(CURL *curl)
+{
+    ListCell *lc;
+
+    foreach(lc, scheduled)
+    {
+        QuasarScheduled *entry = (QuasarScheduled *) lfirst(lc);
+
+        if (entry->curl == curl)
+        {
+            curl_multi_remove_handle(scheduler, curl);
+            scheduled = list_delete_ptr(scheduled, entry);
+            pfree(entry);
+            return;
+        }
+    }
+}
+
+/*
+ * Let curl act on a ready socket (or on its timer, for CURL_SOCKET_TIMEOUT),
+ * and note which transfers finished. conn is only used to clean up on errors.
+ */
+static void
+scheduler_perform(QuasarConn *conn, curl_socket_t fd, int flags)
+{
+    int cc, running, left;
+    CURLMsg *msg;
+
+    cc = curl_multi_socket_action(scheduler, fd, flags, &running);
+    /* The socket may have been closed by an earlier action in this round */
+    if (cc != CURLM_OK && cc != CURLM_BAD_SOCKET) {
+        QuasarCleanupConnection(conn);
+        elog(ERROR, "quasar_fdw: curl error %s", curl_multi_strerror(cc));
+    }
+
+    while ((msg = curl_multi_info_read(scheduler, &left)) != NULL)
+    {
+        char *priv = NULL;
+        QuasarConn *done;
+
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+        done = (QuasarConn *) priv;
+        if (done == NULL)
+            continue;
+        if (done->nlegs > 0 &&
+            !hedge_leg_done(done, msg->easy_handle, msg->data.result))
+            continue;
+
+        elog(DEBUG2, "quasar_fdw: transfer done %s (%s)",
+             curl_easy_strerror(msg->data.result), done->full_url);
+        done->ongoing_transfers = 0;
+        done->transfer_result = msg->data.result;
+    }
+}
+
+/*
+ * Sleep until a socket of the scheduler is ready, curl's timer is due,
+ * timeout_ms have passed or our latch is set, then let curl do its work.
+ * Query cancel and statement_timeout set the latch, so they interrupt
+ * the wait right away.
+ */
+static void
+scheduler_wait(QuasarConn *conn, long timeout_ms)
+{
+    ListCell *lc;
+    bool acted = false;
+    int i, n;
+#if (PG_VERSION_NUM >= 90600)
+    WaitEventSet *set;
+    WaitEvent *events;
+    int nevents = list_length(sockets) + 2;
+#else
+    struct pollfd *fds;
+    int nfds = 0;
+#endif
+
+    if (scheduler_timeout >= 0 && scheduler_timeout < timeout_ms)
+        timeout_ms = scheduler_timeout;
+
+#if (PG_VERSION_NUM >= 90600)
+#if (PG_VERSION_NUM >= 170000)
+    set = CreateWaitEventSet(CurrentResourceOwner, nevents);
+#else
+    set = CreateWaitEventSet(CurrentMemoryContext, nevents);
+#endif
+    AddWaitEventToSet(set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+    AddWaitEventToSet(set, WL_POSTMASTER_DEATH, PGINVALID_SOCKET, NULL, NULL);
+    foreach(lc, sockets)
+    {
+        QuasarSocket *sock = (QuasarSocket *) lfirst(lc);
+        uint32 events = 0;
+
+        if (sock->what & CURL_POLL_IN)
+            events |= WL_SOCKET_READABLE;
+        if (sock->what & CURL_POLL_OUT)
+            events |= WL_SOCKET_WRITEABLE;
+        if (events != 0)
+            AddWaitEventToSet(set, events, sock->fd, NULL, NULL);
+    }
+
+    events = palloc(nevents * sizeof(WaitEvent));
+#if (PG_VERSION_NUM >= 100000)
+    n = WaitEventSetWait(set, timeout_ms, events, nevents, PG_WAIT_EXTENSION);
+#else
+    n = WaitEventSetWait(set, timeout_ms, events, nevents);
+#endif
+    FreeWaitEventSet(set);
+
+    for (i = 0; i < n; ++i)
+    {
+        if (events[i].events & WL_LATCH_SET)
+            ResetLatch(MyLatch);
+        else if (events[i].events & WL_POSTMASTER_DEATH)
+            ereport(FATAL,
+                    (errcode(ERRCODE_ADMIN_SHUTDOWN),
+                     errmsg("terminating connection due to unexpected postmaster exit")));
+    }
+
+    CHECK_FOR_INTERRUPTS();
+
+    for (i = 0; i < n; ++i)
+    {
+        int flags = 0;
+
+        if (events[i].events & WL_SOCKET_READABLE)
+            flags |= CURL_CSELECT_IN;
+        if (events[i].events & WL_SOCKET_WRITEABLE)
+            flags |= CURL_CSELECT_OUT;
+        if (flags != 0)
+        {
+            scheduler_perform(conn, events[i].fd, flags);
+            acted = true;
         }
+    }
+    pfree(events);
+#else
+    /* Without a latch to wait on, poll() in slices short enough that a
+     * cancel arriving just before we go to sleep is still noticed soon */
+    if (timeout_ms > 1000)
+        timeout_ms = 1000;
 
-        /* If nothing happened in timeout error out */
-        if ((clock() - time) / CLOCKS_PER_SEC * 1000 >= conn->timeout_ms
-            && nfds == 0) {
-            QuasarCleanupConnection(conn);
-            elog(ERROR, "quasar_fdw: Timeout (%ld ms) contacting quasar.", conn->timeout_ms);
+    fds = palloc0(Max(list_length(sockets), 1) * sizeof(struct pollfd));
+    foreach(lc, sockets)
+    {
+        QuasarSocket *sock = (QuasarSocket *) lfirst(lc);
+
+        fds[nfds].fd = sock->fd;
+        if (sock->what & CURL_POLL_IN)
+            fds[nfds].events |= POLLIN;
+        if (sock->what & CURL_POLL_OUT)
+            fds[nfds].events |= POLLOUT;
+        ++nfds;
+    }
+
+    n = poll(fds, nfds, (int) timeout_ms);
+    if (n < 0 && errno != EINTR)
+    {
+        QuasarCleanupConnection(conn);
+        elog(ERROR, "quasar_fdw: poll() failed: %m");
+    }
+
+    CHECK_FOR_INTERRUPTS();
+
+    for (i = 0; n > 0 && i < nfds; ++i)
+    {
+        int flags = 0;
+
+        if (fds[i].revents & POLLIN)
+            flags |= CURL_CSELECT_IN;
+        if (fds[i].revents & POLLOUT)
+            flags |= CURL_CSELECT_OUT;
+        if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+            flags |= CURL_CSELECT_ERR;
+        if (flags != 0)
+        {
+            scheduler_perform(conn, fds[i].fd, flags);
+            acted = true;
         }
+    }
+    pfree(fds);
+#endif
 
-        /* Execute any necessary work for the request */
-        cc = curl_multi_perform(conn->curlm, &conn->ongoing_transfers);
-        if (cc != CURLM_OK) {
-            QuasarCleanupConnection(conn);
-            elog(ERROR, "quasar_fdw: curl error %s", curl_multi_strerror(cc));
+    /* Nothing was ready, so curl's timer (or ours) ran out */
+    if (!acted)
+        scheduler_perform(conn, CURL_SOCKET_TIMEOUT, 0);
+
+    /* Keep earlier transactions' DELETEs going while we're at it */
+    QuasarCleanupPoll();
+}
+
+/* curl tells us which sockets to watch for what */
+static int
+scheduler_socket_cb(CURL *easy, curl_socket_t fd, int what,
+                    void *userp, void *socketp)
+{
+    QuasarSocket *sock = (QuasarSocket *) socketp;
+    MemoryContext oldcontext;
+
+    if (what == CURL_POLL_REMOVE)
+    {
+        if (sock != NULL)
+        {
+            sockets = list_delete_ptr(sockets, sock);
+            pfree(sock);
         }
+        return 0;
+    }
 
-        /* Error out on bad status */
-        if (conn->qctx->status > 0 && conn->qctx->status != 200) {
-            char *url = conn->full_url;
+    if (sock == NULL)
+    {
+        oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+        sock = palloc(sizeof(QuasarSocket));
+        sock->fd = fd;
+        sockets = lappend(sockets, sock);
+        MemoryContextSwitchTo(oldcontext);
+
+        curl_multi_assign(scheduler, fd, sock);
+    }
+    sock->what = what;
+    sock->easy = easy;
+
+    return 0;
+}
+
+/* curl tells us when it next wants to run, -1 for never */
+static int
+scheduler_timer_cb(CURLM *multi, long timeout_ms, void *userp)
+{
+    scheduler_timeout = timeout_ms;
+    return 0;
+}
+
+/*
+ * Hedged GETs
+ *
+ * A GET to a server with several endpoints is armed: its callbacks are
+ * routed through legs, which forward to the real ones. If the endpoint
+ * can't be reached, or hasn't answered within hedge_ms, the same GET is
+ * sent to the next best endpoint as a second leg. Whichever leg gets a
+ * status line first wins, the other one is dropped by hedge_settle.
+ * GETs are read-only, so sending one twice is harmless.
+ */
+static void
+hedge_arm(QuasarConn *conn, char *url,
+          QuasarCurlCallback header_fn, void *header_ctx,
+          QuasarCurlCallback body_fn, void *body_ctx)
+{
+    QuasarLeg *leg = &conn->legs[0];
+    MemoryContext oldcontext;
+
+    if (list_length(conn->servers) < 2)
+        return;
+
+    conn->nlegs = 1;
+    conn->winner = -1;
+    conn->hedged = false;
+    conn->leg_header = header_fn;
+    conn->leg_header_ctx = header_ctx;
+    conn->leg_body = body_fn;
+    conn->leg_body_ctx = body_ctx;
+
+    oldcontext = MemoryContextSwitchTo(conn->querymem != NULL ?
+                                       conn->querymem : CurrentMemoryContext);
+    conn->hedge_path = pstrdup(url + strlen(conn->server));
+    MemoryContextSwitchTo(oldcontext);
+
+    leg->conn = conn;
+    leg->pool = conn->pool;
+    leg->curl = conn->curl;
+
+    curl_easy_setopt(conn->curl, CURLOPT_HEADERFUNCTION, leg_header_handler);
+    curl_easy_setopt(conn->curl, CURLOPT_HEADERDATA, leg);
+    curl_easy_setopt(conn->curl, CURLOPT_WRITEFUNCTION, leg_body_handler);
+    curl_easy_setopt(conn->curl, CURLOPT_WRITEDATA, leg);
+}
+
+/*
+ * Send an armed GET to another endpoint as well.
+ * Only done once per request; false if there's no healthy endpoint left.
+ */
+static bool
+hedge_launch(QuasarConn *conn)
+{
+    QuasarLeg *leg = &conn->legs[1];
+    QuasarPool *pool;
+    char *url;
+    int sc;
+
+    conn->hedged = true;
+
+    pool = QuasarPoolChoose(conn->servers, conn->socket_path, &conn->tls,
+                            conn->max_connections, conn->legs[0].pool);
+    if (pool == NULL)
+        return false;
+
+    leg->conn = conn;
+    leg->pool = pool;
+    leg->curl = QuasarPoolAcquire(pool);
+
+    url = psprintf("%s%s", pool->server, conn->hedge_path);
+    elog(DEBUG1, "quasar_fdw: hedging GET to %s", url);
+
+    curl_easy_setopt(leg->curl, CURLOPT_URL, url);
+    curl_easy_setopt(leg->curl, CURLOPT_ACCEPT_ENCODING, conn->compression);
+    curl_easy_setopt(leg->curl, CURLOPT_HEADERFUNCTION, leg_header_handler);
+    curl_easy_setopt(leg->curl, CURLOPT_HEADERDATA, leg);
+    curl_easy_setopt(leg->curl, CURLOPT_WRITEFUNCTION, leg_body_handler);
+    curl_easy_setopt(leg->curl, CURLOPT_WRITEDATA, leg);
+    curl_easy_setopt(leg->curl, CURLOPT_PRIVATE, (char *) conn);
+    curl_easy_setopt(leg->curl, CURLOPT_CONNECTTIMEOUT_MS, conn->connect_timeout_ms);
+    pfree(url);
+
+    sc = curl_multi_add_handle(scheduler, leg->curl);
+    if (sc != CURLM_OK)
+    {
+        elog(DEBUG1, "quasar_fdw: curl add handle failed %s", curl_multi_strerror(sc));
+        QuasarPoolRelease(pool, leg->curl);
+        leg->curl = NULL;
+        return false;
+    }
+
+    scheduled_add(leg->curl, conn->subid);
+
+    conn->nlegs = 2;
+    return true;
+}
+
+/* Milliseconds until an armed GET is due to be hedged, -1 for never */
+static long
+hedge_time_left(QuasarConn *conn)
+{
+    TimestampTz at;
+    long secs;
+    int usecs;
+
+    if (conn->nlegs != 1 || conn->hedged || conn->winner >= 0 ||
+        conn->hedge_ms <= 0 || conn->ongoing_transfers == 0)
+        return -1;
+
+    at = TimestampTzPlusMilliseconds(conn->transfer_start, conn->hedge_ms);
+    TimestampDifference(GetCurrentTimestamp(), at, &secs, &usecs);
+    return secs * 1000 + (usecs + 999) / 1000;
+}
+
+/*
+ * A leg of an armed request finished, whether that ends the request.
+ * It doesn't if the leg lost, or failed while another leg may still
+ * answer. A leg failing without an answer fails over to another endpoint.
+ */
+static bool
+hedge_leg_done(QuasarConn *conn, CURL *curl, CURLcode result)
+{
+    int i = conn->legs[0].curl == curl ? 0 : 1;
+    int other = 1 - i;
+
+    if (conn->winner >= 0)
+        return conn->winner == i;
+
+    if (result == CURLE_OK)
+        return true;
+
+    elog(DEBUG1, "quasar_fdw: %s failed: %s", conn->legs[i].pool->server,
+         curl_easy_strerror(result));
+    QuasarPoolReportFailure(conn->legs[i].pool);
+
+    if (!conn->hedged && hedge_launch(conn))
+    {
+        /* The new endpoint gets the whole first byte timeout */
+        conn->transfer_start = GetCurrentTimestamp();
+        conn->winner = other;
+        return false;
+    }
+
+    if (conn->nlegs > 1 && conn->legs[other].curl != NULL)
+    {
+        conn->winner = other;
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Once a leg has won, drop the other one and make the winner the
+ * request's handle
+ */
+static void
+hedge_settle(QuasarConn *conn)
+{
+    QuasarLeg *winner, *loser;
+    MemoryContext oldcontext;
+
+    if (conn->nlegs < 2 || conn->winner < 0)
+        return;
+
+    winner = &conn->legs[conn->winner];
+    loser = &conn->legs[1 - conn->winner];
+    if (loser->curl == NULL)
+        return;
+
+    scheduled_remove(loser->curl);
+    QuasarPoolRelease(loser->pool, loser->curl);
+    loser->curl = NULL;
+
+    if (conn->curl != winner->curl)
+    {
+        conn->curl = winner->curl;
+        conn->pool = winner->pool;
+        conn->server = winner->pool->server;
+
+        oldcontext = MemoryContextSwitchTo(conn->querymem != NULL ?
+                                           conn->querymem : CurrentMemoryContext);
+        conn->full_url = psprintf("%s%s", conn->server, conn->hedge_path);
+        MemoryContextSwitchTo(oldcontext);
+    }
+}
+
+/* Drop whichever leg is not the request's handle, and disarm */
+static void
+hedge_disarm(QuasarConn *conn)
+{
+    int i;
+
+    for (i = 0; i < conn->nlegs; ++i)
+    {
+        QuasarLeg *leg = &conn->legs[i];
+
+        if (leg->curl != NULL && leg->curl != conn->curl)
+        {
+            scheduled_remove(leg->curl);
+            QuasarPoolRelease(leg->pool, leg->curl);
+        }
+        leg->curl = NULL;
+    }
+
+    conn->nlegs = 0;
+    conn->winner = -1;
+    conn->hedged = false;
+}
+
+/*
+ * perform_blocking for requests to a server with several endpoints:
+ * runs the request armed on the scheduler, so it can be hedged and
+ * fail over. Errors out like perform_blocking when no endpoint answers
+ * within first_byte_timeout_ms, or like a scan when the response then
+ * stalls for idle_timeout_ms.
+ */
+static CURLcode
+perform_armed(QuasarConn *conn, char *url, quasar_info_curl_context *ctx)
+{
+    TimestampTz last_data;
+    int last_status = 0;
+    int last_len = 0;
+
+    conn->curlm = scheduler_get();
+    conn->full_url = url;
+    hedge_arm(conn, url, header_handler, ctx, info_body_handler, ctx);
+    scheduler_add(conn);
+    scheduler_perform(conn, CURL_SOCKET_TIMEOUT, 0);
+    last_data = GetCurrentTimestamp();
+
+    while (conn->ongoing_transfers == 1)
+    {
+        TimestampTz now = GetCurrentTimestamp();
+        TimestampTz deadline;
+        long timeout;
+        long hedge = hedge_time_left(conn);
+        long secs;
+        int usecs;
+
+        if (ctx->status != last_status || ctx->buf.len != last_len)
+        {
+            last_status = ctx->status;
+            last_len = ctx->buf.len;
+            last_data = now;
+        }
+
+        if (ctx->status == 0)
+            deadline = TimestampTzPlusMilliseconds(conn->transfer_start,
+                                                   conn->first_byte_timeout_ms);
+        else
+            deadline = TimestampTzPlusMilliseconds(last_data, conn->idle_timeout_ms);
+
+        if (now >= deadline)
+        {
+            bool responded = ctx->status != 0;
+            long limit = responded ? conn->idle_timeout_ms : conn->first_byte_timeout_ms;
+
+            QuasarPoolReportFailure(conn->pool);
             QuasarCleanupConnection(conn);
-            elog(ERROR, "quasar_fdw: bad status from Quasar %d (%s)",
-                 conn->qctx->status,  url);
+            if (responded)
+                elog(ERROR, "quasar_fdw: Timeout (%ld ms) waiting for data from Quasar (%s)",
+                     limit, url);
+            elog(ERROR, "quasar_fdw: Timeout (%ld ms) waiting for Quasar to respond",
+                 limit);
         }
+        TimestampDifference(now, deadline, &secs, &usecs);
+        timeout = secs * 1000 + (usecs + 999) / 1000;
+
+        if (hedge == 0)
+            hedge_launch(conn);
+        else if (hedge > 0 && hedge < timeout)
+            timeout = hedge;
+
+        scheduler_wait(conn, timeout);
+        hedge_settle(conn);
     }
+
+    hedge_settle(conn);
+    hedge_disarm(conn);
+    scheduler_remove(conn);
+
+    return conn->transfer_result;
 }
 
 extern void
@@ -377,8 +2438,13 @@ QuasarRewindQuery(QuasarConn *conn)
     if (conn->exec_transfer == 0)
         return;
 
-    /* If we've only transferred a little bit, just rewind the cursor */
-    if (conn->qctx->batch_count < 2) {
+    /*
+     * If we've only transferred a little bit, just rewind the cursor.
+     * Not after a resume though: that started a new first batch, and
+     * the rows from before it are gone.
+     */
+    if (conn->windows == NIL && conn->shared == NULL &&
+        conn->resume_retries == 0 && conn->qctx->batch_count < 2) {
         conn->qctx->next_tuple = 0;
         return;
     }
@@ -387,44 +2453,69 @@ QuasarRewindQuery(QuasarConn *conn)
     QuasarResetConnection(conn);
 }
 
-void
-QuasarDeletePostData(QuasarConn *conn)
+/*
+ * Bytes of results Quasar sent this scan, as they came over the wire
+ * and after decompression, for EXPLAIN ANALYZE
+ */
+extern void
+QuasarTransferStats(QuasarConn *conn, uint64 *received, uint64 *decoded)
 {
-    int cc;
-    quasar_info_curl_context ctx;
-    CURL *curl = curl_easy_init();
-    StringInfoData url;
+    ListCell *lc;
 
-    ctx.status = 0;
+    *received = conn->received_bytes + transfer_received(conn);
+    *decoded = conn->qctx != NULL ? conn->qctx->decoded_bytes : 0;
 
-    initStringInfo(&url);
-    appendStringInfo(&url, "%s/data/fs%s", conn->server, conn->post_path);
-    conn->post_path = NULL;
+    foreach(lc, conn->windows)
+    {
+        QuasarConn *window = (QuasarConn *) lfirst(lc);
 
-    curl_easy_setopt(curl, CURLOPT_URL, url.data);
-    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
-    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_handler);
-    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &ctx);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, throwaway_body_handler);
+        if (window != conn)
+        {
+            *received += window->received_bytes + transfer_received(window);
+            *decoded += window->qctx->decoded_bytes;
+        }
+    }
+}
 
-    elog(DEBUG1, "curling DELETE %s", url.data);
-    cc = curl_easy_perform(curl);
-    curl_easy_cleanup(curl);
+/* Body bytes received by the current transfer */
+static uint64
+transfer_received(QuasarConn *conn)
+{
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_off_t size = 0;
+#else
+    double size = 0;
+#endif
+    CURLcode result;
 
-    if (cc != CURLE_OK)
-    {
-        QuasarCleanupConnection(conn);
-        elog(ERROR, "quasar_fdw: curl DELETE %s failed %s",
-             url.data, curl_easy_strerror(cc));
-    }
+    if (conn->exec_transfer == 0)
+        return 0;
 
-    if (ctx.status != 200 && ctx.status != 204)
-    {
-        QuasarCleanupConnection(conn);
-        elog(ERROR, "quasar_fdw: got bad response from quasar: %d (DELETE %s)",
-             ctx.status, url.data);
-    }
-    elog(DEBUG1, "quasar_fdw: curl DELETE status code: %d", ctx.status);
+    if (conn->proxy != NULL)
+        return QuasarProxyReceived(conn->proxy);
+
+    /* Can't look at the handle while a pipeline thread is using it */
+    if (conn->pipeline != NULL && !QuasarPipelineDone(conn->pipeline, &result))
+        return 0;
+
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_easy_getinfo(conn->curl, CURLINFO_SIZE_DOWNLOAD_T, &size);
+#else
+    /* The curl_off_t variant appeared in curl 7.55.0 */
+    curl_easy_getinfo(conn->curl, CURLINFO_SIZE_DOWNLOAD, &size);
+#endif
+    return (uint64) size;
+}
+
+/*
+ * Hand the POST result file over to quasar_cleanup.c,
+ * which deletes it at transaction end without waiting on Quasar
+ */
+void
+QuasarDeletePostData(QuasarConn *conn)
+{
+    QuasarCleanupQueue(conn->pool, conn->post_path);
+    conn->post_path = NULL;
 }
 
 extern char *
@@ -484,27 +2575,37 @@ execute_info_curl(QuasarConn *conn, char *url)
 
     /* Set up CURL instance. */
     curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "gzip");
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, conn->compression);
     curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_handler);
     curl_easy_setopt(curl, CURLOPT_HEADERDATA, &ctx);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, info_body_handler);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, &ctx);
 
+    admit(conn, QUASAR_LANE_PLANNING);
+
     elog(DEBUG1, "quasar_fdw: Curling for information %s", url);
-    cc = curl_easy_perform(curl);
+    if (list_length(conn->servers) > 1)
+        cc = perform_armed(conn, url, &ctx);
+    else
+        cc = perform_blocking(conn, curl);
 
     if (cc != CURLE_OK)
     {
+        QuasarPoolReportFailure(conn->pool);
         QuasarCleanupConnection(conn);
         elog(ERROR, "quasar_fdw: Error querying url %s %d", url, cc);
     }
 
     if (ctx.status != 200)
     {
+        if (ctx.status >= 500)
+            QuasarPoolReportFailure(conn->pool);
         QuasarCleanupConnection(conn);
         elog(ERROR, "quasar_fdw: Bad response from Quasar %d (%s)", ctx.status, url);
     }
 
+    QuasarPoolReportSuccess(conn->pool);
+    admit_release(conn);
     return ctx.buf.data;
 }
 
@@ -515,24 +2616,105 @@ execute_info_curl(QuasarConn *conn, char *url)
 static size_t
 header_handler(void *buffer, size_t size, size_t nmemb, void *userp)
 {
-    const char *HTTP_1_1 = "HTTP/1.1";
     size_t      segsize = size * nmemb;
     quasar_info_curl_context *ctx = (quasar_info_curl_context *) userp;
+    int         status;
     elog(DEBUG2, "entering function %s", __func__);
 
-    if (strncmp(buffer, HTTP_1_1, strlen(HTTP_1_1)) == 0)
+    /* Skip interim responses like 100 Continue on POSTs */
+    status = parse_status_line(buffer, segsize);
+    if (status >= 200)
+        ctx->status = status;
+
+    return segsize;
+}
+
+/*
+ * Status of a header line if it's a status line, 0 otherwise.
+ * Any HTTP version: "HTTP/1.1 200 OK", "HTTP/2 200", ...
+ */
+static int
+parse_status_line(const char *buffer, size_t size)
+{
+    const char *HTTP = "HTTP/";
+    const char *space;
+    int         status;
+
+    if (size <= strlen(HTTP) || strncmp(buffer, HTTP, strlen(HTTP)) != 0)
+        return 0;
+
+    space = memchr(buffer, ' ', size);
+    if (space == NULL)
+        return 0;
+
+    status = atoi(space + 1);
+    elog(DEBUG1, "curl response status %d", status);
+    return status;
+}
+
+/*
+ * Header callback of each leg of an armed request. The first leg to get
+ * a final status line wins and its headers go on to the request's own
+ * callback; the other leg is aborted by returning 0.
+ */
+static size_t
+leg_header_handler(void *buffer, size_t size, size_t nmemb, void *userp)
+{
+    QuasarLeg *leg = (QuasarLeg *) userp;
+    QuasarConn *conn = leg->conn;
+    int i = leg - conn->legs;
+
+    if (conn->winner < 0)
     {
-        int     status;
+        if (parse_status_line(buffer, size * nmemb) < 200)
+            return conn->leg_header(buffer, size, nmemb, conn->leg_header_ctx);
 
-        status = atoi((char *) buffer + strlen(HTTP_1_1) + 1);
-        elog(DEBUG1, "curl response status %d", status);
-        ctx->status = status;
+        conn->winner = i;
+        if (conn->nlegs > 1)
+            elog(DEBUG1, "quasar_fdw: %s answered first", leg->pool->server);
     }
+    else if (conn->winner != i)
+        return 0;
 
-    return segsize;
+    return conn->leg_header(buffer, size, nmemb, conn->leg_header_ctx);
+}
+
+/* Body callback of each leg, only the winner's body is wanted */
+static size_t
+leg_body_handler(void *buffer, size_t size, size_t nmemb, void *userp)
+{
+    QuasarLeg *leg = (QuasarLeg *) userp;
+    QuasarConn *conn = leg->conn;
+
+    if (conn->winner != leg - conn->legs)
+        return 0;
+
+    return conn->leg_body(buffer, size, nmemb, conn->leg_body_ctx);
 }
 
 
+/*
+ * Progress callback of perform_blocking. Returning non-zero aborts
+ * the request.
+ */
+static int
+blocking_progress_handler(void *clientp,
+                          curl_off_t dltotal, curl_off_t dlnow,
+                          curl_off_t ultotal, curl_off_t ulnow)
+{
+    QuasarConn *conn = (QuasarConn *) clientp;
+
+    if (InterruptPending && (QueryCancelPending || ProcDiePending))
+        return 1;
+
+    if (dlnow == 0 && conn->first_byte_timeout_ms > 0 &&
+        TimestampDifferenceExceeds(conn->transfer_start, GetCurrentTimestamp(),
+                                   conn->first_byte_timeout_ms))
+        return 1;
+
+    return 0;
+}
+
 static size_t
 throwaway_body_handler(void *buffer, size_t size, size_t nmemb, void *userp)
 {
@@ -552,88 +2734,164 @@ info_body_handler(void *buffer, size_t size, size_t nmemb, void *userp)
 static size_t
 query_body_handler(void *buffer, size_t size, size_t nmemb, void *userp)
 {
-    size_t      segsize = size * nmemb, offset = 0, new_alloc_tuples;
+    size_t      segsize = size * nmemb;
     quasar_query_curl_context *ctx = (quasar_query_curl_context *) userp;
-    MemoryContext oldcontext;
 
     elog(DEBUG3, "entering function %s", __func__);
 
     if (ctx->status != 200)
-        return segsize;
+    {
+        /* Keep the start of it for check_transfer */
+        size_t len = Min(segsize, (size_t) (ERROR_BODY_SIZE - 1 - ctx->error_len));
 
-    /* If we have reached the end of our tuple set, flush
-     * otherwise, we'll continue to add on */
-    if (ctx->next_tuple >= ctx->num_tuples) {
-        elog(DEBUG3, "paging batched tuples %d (%d / %d)", ctx->batch_count,
-             ctx->next_tuple, ctx->num_tuples);
-        if (ctx->partial_tuple) {
-            elog(DEBUG3, "Found partial tuple from end of last batch, copying...");
-            quasar_copy_parse_context(&ctx->parse);
-        }
-        ctx->tuples = NULL;
-        MemoryContextReset(ctx->batchmem);
-        ctx->next_tuple = ctx->num_tuples = ctx->alloc_tuples = 0;
-        ctx->partial_tuple = false;
+        memcpy(ctx->error_body + ctx->error_len, buffer, len);
+        ctx->error_len += len;
+        ctx->error_body[ctx->error_len] = '\0';
+        return segsize;
     }
-    oldcontext = MemoryContextSwitchTo(ctx->batchmem);
 
-    /* Allocate any space we need for more tuples based on a line endings
-     * (over)estimate */
-    new_alloc_tuples = ctx->alloc_tuples + count_line_endings(buffer, segsize) + 2;
-    if (ctx->tuples == NULL) {
-        ctx->tuples = palloc0(new_alloc_tuples * sizeof(HeapTuple));
-        ++ctx->batch_count;
-    } else {
-        ctx->tuples = repalloc(ctx->tuples, new_alloc_tuples * sizeof(HeapTuple));
-        memset(ctx->tuples + ctx->alloc_tuples,
-               0,
-               (new_alloc_tuples - ctx->alloc_tuples) * sizeof(HeapTuple));
+    ctx->last_data = GetCurrentTimestamp();
+
+    /* Tuples are only ever added on here; the scan itself throws the
+     * batch away once it has used it (see next_batch). If it hasn't
+     * caught up yet and the batch is over budget, hold the data in curl
+     * (which stops reading the socket, so Quasar gets backpressure). */
+    if (batch_full(ctx)) {
+        elog(DEBUG3, "quasar_fdw: batch full (%d tuples, %zu bytes), pausing transfer",
+             ctx->num_tuples - ctx->next_tuple, ctx->batch_bytes);
+        ctx->paused = true;
+        return CURL_WRITEFUNC_PAUSE;
     }
-    ctx->alloc_tuples = new_alloc_tuples;
 
+    parse_chunk(ctx, buffer, segsize);
+
+    return segsize;
+}
+
+/*
+ * Whether a scan has buffered all it may before the executor catches up.
+ * Only while there are tuples left to read, or we'd never resume.
+ */
+static bool
+batch_full(quasar_query_curl_context *ctx)
+{
+    return ctx->num_tuples > ctx->next_tuple &&
+        (ctx->num_tuples - ctx->next_tuple >= ctx->fetch_size ||
+         ctx->batch_bytes >= ctx->fetch_bytes);
+}
+
+/*
+ * Add a chunk of the response to the current batch. Rows are parsed when
+ * the executor asks for them (see QuasarNextTuple), so all this does is
+ * find where each one ends: where the nesting of objects and arrays,
+ * outside of strings, gets back to the top level. Pipelined scans have
+ * their thread do that (see pipeline_continue).
+ */
+static void
+parse_chunk(quasar_query_curl_context *ctx, const char *buffer, size_t segsize)
+{
+    const char *data;
+    int i;
+
+    batch_append(ctx, buffer, segsize);
+
+    data = ctx->records.data;
+    for (i = ctx->scanned; i < ctx->records.len; ++i)
+    {
+        char c = data[i];
 
-    /* Parse each tuple one at a time */
-    while (offset < segsize) {
-        int ret = quasar_parse(&ctx->parse, buffer, &offset,
-                               segsize, &ctx->tuples[ctx->num_tuples]);
-        ctx->partial_tuple = false;
-        if (ret == P_RECORD_COMPLETE) {
-            ++ctx->num_tuples;
-        } else if (ret == P_RECORD_STARTED) {
-            elog(DEBUG3, "Partial tuple returned from quasar_parse...");
-            ctx->partial_tuple = true;
+        if (ctx->scan_in_string)
+        {
+            if (ctx->scan_escaped)
+                ctx->scan_escaped = false;
+            else if (c == '\\')
+                ctx->scan_escaped = true;
+            else if (c == '"')
+                ctx->scan_in_string = false;
         }
-        Assert(ctx->num_tuples <= ctx->alloc_tuples);
+        else if (c == '"')
+            ctx->scan_in_string = true;
+        else if (c == '{' || c == '[')
+            ++ctx->scan_depth;
+        else if ((c == '}' || c == ']') && --ctx->scan_depth == 0)
+            batch_add_record(ctx, i + 1);
     }
-
-    /* Reset memory context to caller */
-    MemoryContextSwitchTo(oldcontext);
+    ctx->scanned = ctx->records.len;
 
     elog(DEBUG3, "Tuples prepared to be iterated over: %d / %d", ctx->next_tuple, ctx->num_tuples);
-
-    return segsize;
 }
 
+/* Add bytes of the response to the current batch, without looking at them */
+static void
+batch_append(quasar_query_curl_context *ctx, const char *buffer, size_t segsize)
+{
+    MemoryContext oldcontext = MemoryContextSwitchTo(ctx->batchmem);
 
+    if (ctx->records.data == NULL)
+        initStringInfo(&ctx->records);
+    appendBinaryStringInfo(&ctx->records, buffer, segsize);
+    ctx->batch_bytes += segsize;
+    ctx->decoded_bytes += segsize;
 
-static size_t
-count_line_endings(const char *buffer, size_t size)
+    MemoryContextSwitchTo(oldcontext);
+}
+
+/* Note a row of the batch ends at end */
+static void
+batch_add_record(quasar_query_curl_context *ctx, int end)
 {
-    size_t cnt = 0, left = size;
-    const char *ptr = buffer;
-    while (ptr != NULL)
+    /* Growing geometrically so it isn't reallocated for every chunk */
+    if (ctx->num_tuples >= ctx->alloc_tuples)
     {
-        left = size - (ptr - buffer);
-        ptr = memchr(ptr, '\r', left);
-        left = size - (ptr - buffer);
-        if (ptr != NULL &&
-            left > 1 &&
-            ptr[1] == '\n')
-            ++cnt;
-
-        if (ptr != NULL) ++ptr;
+        if (ctx->record_ends == NULL)
+        {
+            ctx->alloc_tuples = Min(ctx->fetch_size, INITIAL_TUPLE_ALLOC_SIZE) + 1;
+            ctx->record_ends = MemoryContextAlloc(ctx->batchmem,
+                                                  ctx->alloc_tuples * sizeof(int));
+        }
+        else
+        {
+            ctx->alloc_tuples *= 2;
+            ctx->record_ends = repalloc(ctx->record_ends,
+                                        ctx->alloc_tuples * sizeof(int));
+        }
     }
-    return cnt;
+    ctx->record_ends[ctx->num_tuples++] = end;
+}
+
+/* Forget the current batch, for a new transfer */
+static void
+batch_clear(quasar_query_curl_context *ctx)
+{
+    MemoryContextReset(ctx->batchmem);
+    ctx->records.data = NULL;
+    ctx->record_ends = NULL;
+    ctx->num_tuples = ctx->next_tuple = ctx->alloc_tuples = 0;
+    ctx->scanned = 0;
+    ctx->scan_depth = 0;
+    ctx->scan_in_string = ctx->scan_escaped = false;
+}
+
+/* Parse the nth row of the batch, with its values in CurrentMemoryContext */
+static void
+batch_row(quasar_query_curl_context *ctx, int n, Datum *values, bool *nulls)
+{
+    int start = n > 0 ? ctx->record_ends[n - 1] : 0;
+
+    quasar_parse(&ctx->parse, ctx->records.data + start,
+                 ctx->record_ends[n] - start, values, nulls);
+}
+
+/*
+ * The executor's next row, parsed now it's asked for straight into the
+ * values and nulls of its slot. Values are made in CurrentMemoryContext,
+ * which had better be reset once the row is used.
+ */
+extern void
+QuasarNextTuple(quasar_query_curl_context *ctx, Datum *values, bool *nulls)
+{
+    Assert(ctx->next_tuple < ctx->num_tuples);
+    batch_row(ctx, ctx->next_tuple++, values, nulls);
 }
 
 /* Append a query parameter to a url buffer */
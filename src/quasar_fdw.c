@@ -42,9 +42,14 @@
 #include "commands/vacuum.h"
 #include "foreign/fdwapi.h"
 #include "foreign/foreign.h"
-#include "libpq/md5.h"
 #include "mb/pg_wchar.h"
 #include "miscadmin.h"
+#if (PG_VERSION_NUM >= 90600)
+#include "access/parallel.h"
+#endif
+#if (PG_VERSION_NUM >= 140000)
+#include "executor/execAsync.h"
+#endif
 #include "nodes/makefuncs.h"
 #include "nodes/nodeFuncs.h"
 #include "nodes/pg_list.h"
@@ -53,7 +58,11 @@
 #include "optimizer/paths.h"
 #include "optimizer/planmain.h"
 #include "optimizer/restrictinfo.h"
+#if (PG_VERSION_NUM >= 120000)
+#include "optimizer/optimizer.h"
+#else
 #include "optimizer/var.h"
+#endif
 #include "parser/parse_relation.h"
 #include "parser/parsetree.h"
 #include "port.h"
@@ -74,7 +83,9 @@
 #include "utils/rel.h"
 #include "utils/resowner.h"
 #include "utils/timestamp.h"
+#if (PG_VERSION_NUM < 120000)
 #include "utils/tqual.h"
+#endif
 #include "utils/snapmgr.h"
 #include "utils/syscache.h"
 #include "utils/timestamp.h"
@@ -95,7 +106,10 @@ PG_MODULE_MAGIC;
  * planner to executor.  Currently we store:
  *
  * 1) SELECT statement text to be sent to the remote server
- * 2) Integer list of attribute numbers retrieved by the SELECT
+ * 2) Number of windows the scan is split into (Integer)
+ * 3) Rows per window, 0 if the scan isn't split (Integer)
+ * 4) SELECT statement to resume the scan with, "" if it isn't resumable
+ * 5) Attribute number of the resume key (Integer)
  *
  * These items are indexed with the enum FdwScanPrivateIndex, so an item
  * can be fetched with list_nth().  For example, to get the SELECT statement:
@@ -105,8 +119,12 @@ enum FdwScanPrivateIndex
 {
     /* SQL statement to execute remotely (as a String node) */
     FdwScanPrivateSelectSql,
-    /* Integer list of attribute numbers retrieved by the SELECT */
-    FdwScanPrivateRetrievedAttrs
+    /* Windows fetched in parallel, see QuasarSplitQuery */
+    FdwScanPrivateStreams,
+    FdwScanPrivateWindowRows,
+    /* Resuming after a failed transfer, see QuasarSetResumable */
+    FdwScanPrivateResumeSql,
+    FdwScanPrivateResumeAttno
 };
 
 /*
@@ -125,6 +143,8 @@ typedef struct QuasarFdwScanState
     List           *param_exprs;        /* executable expressions for param values */
     const char    **param_values;  /* textual values of query parameters */
 
+    bool            async;          /* run by an asynchronous Append */
+
     QuasarConn *conn;
 } QuasarFdwScanState;
 
@@ -188,6 +208,39 @@ static void quasarEndForeignScan(ForeignScanState *node);
 
 static void quasarExplainForeignScan(ForeignScanState *node, ExplainState *es);
 
+#if (PG_VERSION_NUM >= 90600)
+static bool quasarIsForeignScanParallelSafe(PlannerInfo *root,
+                                            RelOptInfo *rel,
+                                            RangeTblEntry *rte);
+
+static Size quasarEstimateDSMForeignScan(ForeignScanState *node,
+                                         ParallelContext *pcxt);
+
+static void quasarInitializeDSMForeignScan(ForeignScanState *node,
+                                           ParallelContext *pcxt,
+                                           void *coordinate);
+
+#if (PG_VERSION_NUM >= 100000)
+static void quasarReInitializeDSMForeignScan(ForeignScanState *node,
+                                             ParallelContext *pcxt,
+                                             void *coordinate);
+#endif
+
+static void quasarInitializeWorkerForeignScan(ForeignScanState *node,
+                                              shm_toc *toc,
+                                              void *coordinate);
+#endif
+
+#if (PG_VERSION_NUM >= 140000)
+static bool quasarIsForeignPathAsyncCapable(ForeignPath *path);
+
+static void quasarForeignAsyncRequest(AsyncRequest *areq);
+
+static void quasarForeignAsyncConfigureWait(AsyncRequest *areq);
+
+static void quasarForeignAsyncNotify(AsyncRequest *areq);
+#endif
+
 
 /*
  * Private functions
@@ -205,6 +258,11 @@ static bool ec_member_matches_foreign(PlannerInfo *root, RelOptInfo *rel,
                                       void *arg);
 static void renderParams(QuasarFdwScanState *fsstate,
                          ExprContext *econtext);
+static bool ordered_by_attnum(List *pathkeys, RelOptInfo *baserel,
+                              AttrNumber attnum);
+#if (PG_VERSION_NUM >= 140000)
+static void async_produce(AsyncRequest *areq);
+#endif
 Cost estimate_join_rowcount(List *exprs, RelOptInfo *baserel, PlannerInfo *root);
 Cost estimate_join_rowcount_expr(Expr *expr, RelOptInfo *baserel, PlannerInfo *root);
 
@@ -218,6 +276,8 @@ void
 _PG_init(void)
 {
     QuasarGlobalConnectionInit();
+    QuasarAdmitInit();
+    QuasarProxyInit();
 }
 
 Datum
@@ -248,6 +308,25 @@ quasar_fdw_handler(PG_FUNCTION_ARGS)
       fdwroutine->EndForeignScan = quasarEndForeignScan;          /* S U D */
       fdwroutine->ExplainForeignScan = quasarExplainForeignScan; /* E */
 
+#if (PG_VERSION_NUM >= 90600)
+      /* parallel scans */
+      fdwroutine->IsForeignScanParallelSafe = quasarIsForeignScanParallelSafe;
+      fdwroutine->EstimateDSMForeignScan = quasarEstimateDSMForeignScan;
+      fdwroutine->InitializeDSMForeignScan = quasarInitializeDSMForeignScan;
+#if (PG_VERSION_NUM >= 100000)
+      fdwroutine->ReInitializeDSMForeignScan = quasarReInitializeDSMForeignScan;
+#endif
+      fdwroutine->InitializeWorkerForeignScan = quasarInitializeWorkerForeignScan;
+#endif
+
+#if (PG_VERSION_NUM >= 140000)
+      /* asynchronous execution under an Append */
+      fdwroutine->IsForeignPathAsyncCapable = quasarIsForeignPathAsyncCapable;
+      fdwroutine->ForeignAsyncRequest = quasarForeignAsyncRequest;
+      fdwroutine->ForeignAsyncConfigureWait = quasarForeignAsyncConfigureWait;
+      fdwroutine->ForeignAsyncNotify = quasarForeignAsyncNotify;
+#endif
+
       PG_RETURN_POINTER(fdwroutine);
 }
 
@@ -299,6 +378,12 @@ quasarGetForeignRelSize(PlannerInfo *root,
     fpinfo->fdw_startup_cost = DEFAULT_FDW_STARTUP_COST;
     fpinfo->fdw_tuple_cost = DEFAULT_FDW_TUPLE_COST;
     fpinfo->shippable_extensions = NIL;
+    fpinfo->parallel_streams = DEFAULT_PARALLEL_STREAMS;
+    fpinfo->parallel_min_rows = DEFAULT_PARALLEL_MIN_ROWS;
+    fpinfo->parallel_scan = DEFAULT_PARALLEL_SCAN;
+    fpinfo->remote_rows = 0;
+    fpinfo->resume_attnum = InvalidAttrNumber;
+    fpinfo->async_capable = DEFAULT_ASYNC_CAPABLE;
 
     foreach(lc, fpinfo->server->options)
     {
@@ -310,6 +395,8 @@ quasarGetForeignRelSize(PlannerInfo *root,
             fpinfo->fdw_startup_cost = strtod(defGetString(def), NULL);
         else if (strcmp(def->defname, "fdw_tuple_cost") == 0)
             fpinfo->fdw_tuple_cost = strtod(defGetString(def), NULL);
+        else if (strcmp(def->defname, "async_capable") == 0)
+            fpinfo->async_capable = defGetBoolean(def);
     }
     foreach(lc, fpinfo->table->options)
     {
@@ -317,6 +404,21 @@ quasarGetForeignRelSize(PlannerInfo *root,
 
         if (strcmp(def->defname, "use_remote_estimate") == 0)
             fpinfo->use_remote_estimate = defGetBoolean(def);
+        else if (strcmp(def->defname, "parallel_streams") == 0)
+            fpinfo->parallel_streams = strtol(defGetString(def), NULL, 10);
+        else if (strcmp(def->defname, "parallel_min_rows") == 0)
+            fpinfo->parallel_min_rows = strtod(defGetString(def), NULL);
+        else if (strcmp(def->defname, "parallel_scan") == 0)
+            fpinfo->parallel_scan = defGetBoolean(def);
+        else if (strcmp(def->defname, "resume_key") == 0)
+        {
+            fpinfo->resume_attnum = get_attnum(foreigntableid, defGetString(def));
+            if (fpinfo->resume_attnum == InvalidAttrNumber)
+                elog(ERROR, "quasar_fdw: resume_key column \"%s\" does not exist",
+                     defGetString(def));
+        }
+        else if (strcmp(def->defname, "async_capable") == 0)
+            fpinfo->async_capable = defGetBoolean(def);
     }
 
     /*
@@ -335,7 +437,7 @@ quasarGetForeignRelSize(PlannerInfo *root,
      * columns used in them.  Doesn't seem worth detecting that case though.)
      */
     fpinfo->attrs_used = NULL;
-    pull_varattnos((Node *) baserel->reltargetlist, baserel->relid,
+    pull_varattnos((Node *) QUASAR_REL_TARGETLIST(baserel), baserel->relid,
                    &fpinfo->attrs_used);
     foreach(lc, fpinfo->local_conds)
     {
@@ -344,6 +446,11 @@ quasarGetForeignRelSize(PlannerInfo *root,
         pull_varattnos((Node *) rinfo->clause, baserel->relid,
                        &fpinfo->attrs_used);
     }
+    /* A resumed scan picks up after the last row's resume key */
+    if (fpinfo->resume_attnum != InvalidAttrNumber)
+        fpinfo->attrs_used =
+            bms_add_member(fpinfo->attrs_used,
+                           fpinfo->resume_attnum - FirstLowInvalidHeapAttributeNumber);
 
     /*
      * Compute the selectivity and cost of the local_conds, so we don't have
@@ -379,7 +486,7 @@ quasarGetForeignRelSize(PlannerInfo *root,
 
         /* Report estimated baserel size to planner. */
         baserel->rows = fpinfo->rows;
-        baserel->width = fpinfo->width;
+        QUASAR_REL_WIDTH(baserel) = fpinfo->width;
     }
     else
     {
@@ -397,11 +504,11 @@ quasarGetForeignRelSize(PlannerInfo *root,
             baserel->pages = 10;
 #if (PG_VERSION_NUM >= 90500)
             baserel->tuples =
-                (10 * BLCKSZ) / (baserel->width +
+                (10 * BLCKSZ) / (QUASAR_REL_WIDTH(baserel) +
                                  MAXALIGN(SizeofHeapTupleHeader));
 #else
             baserel->tuples =
-                (10 * BLCKSZ) / (baserel->width +
+                (10 * BLCKSZ) / (QUASAR_REL_WIDTH(baserel) +
                                  sizeof(HeapTupleHeaderData));
 #endif
 
@@ -457,6 +564,9 @@ quasarGetForeignPaths(PlannerInfo *root,
          fpinfo->total_cost, fpinfo->rows, fpinfo->startup_cost);
 
     path = create_foreignscan_path(root, baserel,
+#if (PG_VERSION_NUM >= 90600)
+                                   NULL, /* default pathtarget */
+#endif
                                    fpinfo->rows,
                                    fpinfo->startup_cost,
                                    fpinfo->total_cost,
@@ -464,10 +574,56 @@ quasarGetForeignPaths(PlannerInfo *root,
                                    NULL,                /* no outer rel either */
 #if(PG_VERSION_NUM >= 90500)
                                    NULL, /* no extra plan */
+#endif
+#if (PG_VERSION_NUM >= 170000)
+                                   NIL, /* no fdw_restrictinfo list */
 #endif
                                    NIL);                /* no fdw_private list */
     add_path(baserel, (Path *) path);
 
+#if (PG_VERSION_NUM >= 90600)
+    /*
+     * A scan Quasar expects to return many rows can also be spread over
+     * parallel workers, each fetching windows of the rows handed out
+     * through dynamic shared memory (see QuasarSetParallel). There is a
+     * worker per parallel_min_rows rows, up to the usual limit. The windows
+     * are ranges of a result the leader has Quasar write to a file first,
+     * which tables opt into with parallel_scan. Resumable scans are
+     * ordered, so they stay in one process.
+     */
+    if (fpinfo->parallel_scan &&
+        baserel->consider_parallel &&
+        max_parallel_workers_per_gather > 0 &&
+        fpinfo->resume_attnum == InvalidAttrNumber &&
+        fpinfo->remote_rows > 0 &&
+        fpinfo->remote_rows >= fpinfo->parallel_min_rows)
+    {
+        int workers = max_parallel_workers_per_gather;
+        double divisor;
+
+        if (fpinfo->parallel_min_rows > 0)
+            workers = Min(workers, (int) (fpinfo->remote_rows / fpinfo->parallel_min_rows));
+        divisor = workers + 1;
+
+        path = create_foreignscan_path(root, baserel,
+                                       NULL, /* default pathtarget */
+                                       fpinfo->rows / divisor,
+                                       fpinfo->startup_cost,
+                                       fpinfo->startup_cost +
+                                       (fpinfo->total_cost - fpinfo->startup_cost) / divisor,
+                                       NIL, /* no pathkeys */
+                                       NULL, /* no outer rel either */
+                                       NULL, /* no extra plan */
+#if (PG_VERSION_NUM >= 170000)
+                                       NIL, /* no fdw_restrictinfo list */
+#endif
+                                       NIL); /* no fdw_private list */
+        path->path.parallel_aware = true;
+        path->path.parallel_workers = workers;
+        add_partial_path(baserel, (Path *) path);
+    }
+#endif
+
     /*
      * Determine whether we can potentially push query pathkeys to the remote
      * side, avoiding a local sort.
@@ -523,6 +679,9 @@ quasarGetForeignPaths(PlannerInfo *root,
 
         add_path(baserel, (Path *)
                  create_foreignscan_path(root, baserel,
+#if (PG_VERSION_NUM >= 90600)
+                                         NULL, /* default pathtarget */
+#endif
                                          rows,
                                          startup_cost,
                                          total_cost,
@@ -530,6 +689,9 @@ quasarGetForeignPaths(PlannerInfo *root,
                                          NULL,
 #if(PG_VERSION_NUM >= 90500)
                                          NULL, /* no extra plan */
+#endif
+#if (PG_VERSION_NUM >= 170000)
+                                         NIL, /* no fdw_restrictinfo list */
 #endif
                                          NIL));
     }
@@ -688,6 +850,9 @@ quasarGetForeignPaths(PlannerInfo *root,
 
         /* Make the path */
         path = create_foreignscan_path(root, baserel,
+#if (PG_VERSION_NUM >= 90600)
+                                       NULL, /* default pathtarget */
+#endif
                                        rows,
                                        startup_cost,
                                        total_cost,
@@ -695,6 +860,9 @@ quasarGetForeignPaths(PlannerInfo *root,
                                        param_info->ppi_req_outer,
 #if(PG_VERSION_NUM >= 90500)
                                        NULL, /* no extra plan */
+#endif
+#if (PG_VERSION_NUM >= 170000)
+                                       NIL, /* no fdw_restrictinfo list */
 #endif
                                        NIL);    /* no fdw_private list */
         add_path(baserel, (Path *) path);
@@ -737,6 +905,10 @@ quasarGetForeignPlan(PlannerInfo *root,
     List           *scan_tlist = NIL;
     StringInfoData  sql;
     ListCell       *lc;
+    int             streams = fpinfo->parallel_streams;
+    long            window_rows = 0;
+    bool            resumable;
+    StringInfoData  resume_sql;
 
     elog(DEBUG1, "entering function %s", __func__);
 
@@ -798,15 +970,74 @@ quasarGetForeignPlan(PlannerInfo *root,
         appendWhereClause(&sql, root, baserel, remote_conds,
                           true, &params_list);
 
+    /*
+     * A scan ordered by its resume key, or not ordered at all, can be
+     * resumed: the same query with a condition to skip the rows up to the
+     * last one returned, given as an extra parameter.
+     */
+    resumable = fpinfo->resume_attnum != InvalidAttrNumber &&
+        (best_path->path.pathkeys == NIL ||
+         ordered_by_attnum(best_path->path.pathkeys, baserel,
+                           fpinfo->resume_attnum));
+    initStringInfo(&resume_sql);
+    if (resumable)
+    {
+        appendStringInfoString(&resume_sql, sql.data);
+        appendResumeCondition(&resume_sql, root, baserel, fpinfo->resume_attnum,
+                              list_length(params_list) + 1, remote_conds == NIL);
+    }
+
     /* Add ORDER BY clause if we found any useful pathkeys */
     if (best_path->path.pathkeys)
+    {
         appendOrderByClause(&sql, root, baserel, best_path->path.pathkeys);
+        if (resumable)
+            appendOrderByClause(&resume_sql, root, baserel, best_path->path.pathkeys);
+    }
+    else if (resumable)
+    {
+        appendResumeOrderBy(&sql, root, baserel, fpinfo->resume_attnum);
+        appendResumeOrderBy(&resume_sql, root, baserel, fpinfo->resume_attnum);
+    }
+
+    /*
+     * Split a scan Quasar expects to return many rows into windows
+     * fetched in parallel. Quasar runs the query once into a file, and
+     * the windows are offset/limit ranges of that, so they neither
+     * overlap nor leave gaps. Ordered scans are left alone, since the
+     * windows would arrive interleaved, and so are parameterized ones:
+     * the file would have to be made again for every rescan. A parallel
+     * scan's windows are shared out between the processes running it.
+     */
+#if (PG_VERSION_NUM >= 90600)
+    if (best_path->path.parallel_aware)
+    {
+        streams = 1;
+        if (params_list == NIL)
+        {
+            streams = PARALLEL_WINDOWS_PER_WORKER * (best_path->path.parallel_workers + 1);
+            window_rows = (long) (fpinfo->remote_rows / streams) + 1;
+        }
+    }
+    else
+#endif
+    if (fpinfo->parallel_streams > 1 &&
+        !resumable &&
+        fpinfo->remote_rows > 0 &&
+        fpinfo->remote_rows >= fpinfo->parallel_min_rows &&
+        best_path->path.pathkeys == NIL &&
+        params_list == NIL)
+        window_rows = (long) (fpinfo->remote_rows / fpinfo->parallel_streams) + 1;
 
     /*
      * Build the fdw_private list that will be available to the executor.
      * Items in the list must match enum FdwScanPrivateIndex, above.
      */
-    fdw_private = list_make1(makeString(sql.data));
+    fdw_private = list_make4(makeString(sql.data),
+                             makeInteger(streams),
+                             makeInteger(window_rows),
+                             makeString(resume_sql.data));
+    fdw_private = lappend(fdw_private, makeInteger(fpinfo->resume_attnum));
 
     elog(DEBUG1, "Making foreignscan with %d remote_conds and %d local_conds",
          list_length(remote_conds), list_length(local_exprs));
@@ -865,6 +1096,9 @@ quasarBeginForeignScan(ForeignScanState *node,
     int i;
     ListCell *lc;
     Relation rel;
+    long window_rows;
+    char *resume_sql;
+    bool parallel = false;
 
     elog(DEBUG1, "entering function %s", __func__);
 
@@ -892,6 +1126,9 @@ quasarBeginForeignScan(ForeignScanState *node,
      * Get connection to the foreign server.
      */
     fsstate->conn = QuasarGetConnection(server, table);
+#if (PG_VERSION_NUM >= 140000)
+    fsstate->async = node->ss.ps.async_capable;
+#endif
 
     /* Get private info created by planner functions. */
     fsstate->query = strVal(list_nth(fsplan->fdw_private,
@@ -900,6 +1137,22 @@ quasarBeginForeignScan(ForeignScanState *node,
     /* Prepare our connection for a query */
     QuasarPrepQuery(fsstate->conn, estate, rel);
 
+    /* Big unordered scans are fetched in several windows at once */
+#if (PG_VERSION_NUM >= 90600)
+    parallel = fsplan->scan.plan.parallel_aware;
+#endif
+    window_rows = intVal(list_nth(fsplan->fdw_private, FdwScanPrivateWindowRows));
+    if (window_rows > 0 && !parallel)
+        QuasarSplitQuery(fsstate->conn, server, table, estate, rel,
+                         intVal(list_nth(fsplan->fdw_private, FdwScanPrivateStreams)),
+                         window_rows);
+
+    /* So are scans which can pick up where a failed transfer left off */
+    resume_sql = strVal(list_nth(fsplan->fdw_private, FdwScanPrivateResumeSql));
+    if (resume_sql[0] != '\0')
+        QuasarSetResumable(fsstate->conn, rel, resume_sql,
+                           intVal(list_nth(fsplan->fdw_private, FdwScanPrivateResumeAttno)));
+
     /* prepare for output conversion of parameters used in remote query. */
     numParams = list_length(fsplan->fdw_exprs);
     fsstate->numParams = numParams;
@@ -928,9 +1181,14 @@ quasarBeginForeignScan(ForeignScanState *node,
      * benefit, and it'd require postgres_fdw to know more than is desirable
      * about Param evaluation.)
      */
+#if (PG_VERSION_NUM >= 100000)
+    fsstate->param_exprs = ExecInitExprList(fsplan->fdw_exprs,
+                                            (PlanState *) node);
+#else
     fsstate->param_exprs = (List *)
         ExecInitExpr((Expr *) fsplan->fdw_exprs,
                      (PlanState *) node);
+#endif
 
     /*
      * Allocate buffer for text form of query parameters, if any.
@@ -940,6 +1198,17 @@ quasarBeginForeignScan(ForeignScanState *node,
     else
         fsstate->param_values = NULL;
 
+    /*
+     * Unlike the advice above, a scan without parameters already has its
+     * final query text, so send it off now. Quasar compiles and starts the
+     * query while the rest of the plan starts up, and several foreign
+     * scans in one plan get their remote startup done concurrently.
+     * Parameterized scans have to wait for their parameter values in
+     * IterateForeignScan, and parallel scans for their share of the work
+     * (see quasarInitializeDSMForeignScan).
+     */
+    if (numParams == 0 && !parallel)
+        QuasarExecuteQuery(fsstate->conn, fsstate->query, NULL, 0);
 }
 
 static TupleTableSlot *
@@ -972,6 +1241,8 @@ quasarIterateForeignScan(ForeignScanState *node)
     QuasarFdwScanState *fsstate;
     TupleTableSlot *slot;
     ExprContext *econtext;
+    quasar_query_curl_context *ctx;
+    MemoryContext oldcontext;
 
     elog(DEBUG5, "entering function %s", __func__);
 
@@ -991,24 +1262,34 @@ quasarIterateForeignScan(ForeignScanState *node)
 
     /*
      * Get some more tuples, if we've run out.
+     * A split scan reads from one window at a time.
      */
-    if (fsstate->conn->qctx->next_tuple >= fsstate->conn->qctx->num_tuples)
+    ctx = fsstate->conn->reading->qctx;
+    if (ctx->next_tuple >= ctx->num_tuples)
     {
+        /* Under an asynchronous Append, that's up to async_produce */
+        if (fsstate->async)
+            return ExecClearTuple(slot);
+
         QuasarContinueQuery(fsstate->conn);
 
         /* If we didn't get any tuples, must be end of data. */
-        if (fsstate->conn->qctx->next_tuple >= fsstate->conn->qctx->num_tuples)
+        ctx = fsstate->conn->reading->qctx;
+        if (ctx->next_tuple >= ctx->num_tuples)
             return ExecClearTuple(slot);
     }
 
 
     /*
-     * Return the next tuple.
+     * Return the next tuple, as a virtual tuple. Rows are only parsed as
+     * they are returned, straight into the slot, with their values in the
+     * per-tuple memory, which the executor resets before the next one.
      */
-    ExecStoreTuple(fsstate->conn->qctx->tuples[fsstate->conn->qctx->next_tuple++],
-                   slot,
-                   InvalidBuffer,
-                   false);
+    ExecClearTuple(slot);
+    oldcontext = MemoryContextSwitchTo(econtext->ecxt_per_tuple_memory);
+    QuasarNextTuple(ctx, slot->tts_values, slot->tts_isnull);
+    MemoryContextSwitchTo(oldcontext);
+    ExecStoreVirtualTuple(slot);
 
     return slot;
 }
@@ -1072,6 +1353,16 @@ quasarExplainForeignScan(ForeignScanState *node, ExplainState *es)
     sql = strVal(list_nth(fdw_private, FdwScanPrivateSelectSql));
 
     ExplainPropertyText("Quasar query", sql, es);
+    if (intVal(list_nth(fdw_private, FdwScanPrivateWindowRows)) > 0)
+    {
+#if(PG_VERSION_NUM >= 110000)
+        ExplainPropertyInteger("Quasar Streams", NULL,
+                               intVal(list_nth(fdw_private, FdwScanPrivateStreams)), es);
+#else
+        ExplainPropertyLong("Quasar Streams",
+                            intVal(list_nth(fdw_private, FdwScanPrivateStreams)), es);
+#endif
+    }
     if (es->verbose)
     {
         table = GetForeignTable(RelationGetRelid(node->ss.ss_currentRelation));
@@ -1082,7 +1373,163 @@ quasarExplainForeignScan(ForeignScanState *node, ExplainState *es)
         QuasarCleanupConnection(conn);
         ExplainPropertyText("Compiled Mongo Query", mongo_query, es);
     }
+
+    if (es->analyze && node->fdw_state != NULL)
+    {
+        uint64 received, decoded;
+
+        QuasarTransferStats(((QuasarFdwScanState *) node->fdw_state)->conn,
+                            &received, &decoded);
+#if(PG_VERSION_NUM >= 110000)
+        ExplainPropertyInteger("Quasar Bytes Received", "bytes", received, es);
+        ExplainPropertyInteger("Quasar Bytes Decoded", "bytes", decoded, es);
+#else
+        ExplainPropertyLong("Quasar Bytes Received", received, es);
+        ExplainPropertyLong("Quasar Bytes Decoded", decoded, es);
+#endif
+    }
+}
+
+#if (PG_VERSION_NUM >= 90600)
+/*
+ * quasarIsForeignScanParallelSafe
+ *              Workers connect to Quasar on their own, so any scan can
+ *              run in them
+ */
+static bool
+quasarIsForeignScanParallelSafe(PlannerInfo *root, RelOptInfo *rel,
+                                RangeTblEntry *rte)
+{
+    return true;
+}
+
+/*
+ * quasarEstimateDSMForeignScan
+ *              Room for the windows of a parallel scan
+ */
+static Size
+quasarEstimateDSMForeignScan(ForeignScanState *node, ParallelContext *pcxt)
+{
+    return sizeof(QuasarParallelScan);
+}
+
+/*
+ * quasarInitializeDSMForeignScan
+ *              Set up the windows of a parallel scan, as planned in
+ *              quasarGetForeignPlan, and take part in it
+ */
+static void
+quasarInitializeDSMForeignScan(ForeignScanState *node, ParallelContext *pcxt,
+                               void *coordinate)
+{
+    List *fdw_private = ((ForeignScan *) node->ss.ps.plan)->fdw_private;
+    QuasarFdwScanState *fsstate = (QuasarFdwScanState *) node->fdw_state;
+    QuasarParallelScan *shared = (QuasarParallelScan *) coordinate;
+
+    pg_atomic_init_u32(&shared->next_window, 0);
+    shared->nwindows = intVal(list_nth(fdw_private, FdwScanPrivateStreams));
+    shared->window_rows = intVal(list_nth(fdw_private, FdwScanPrivateWindowRows));
+    shared->path[0] = '\0';
+
+    /* Several windows are ranges of one result, which the leader has made */
+    if (shared->nwindows > 1)
+        strlcpy(shared->path, QuasarMaterializeQuery(fsstate->conn, fsstate->query),
+                MAXPGPATH);
+
+    QuasarSetParallel(fsstate->conn, shared);
+}
+
+#if (PG_VERSION_NUM >= 100000)
+/*
+ * quasarReInitializeDSMForeignScan
+ *              Hand the windows out again, for a rescan
+ */
+static void
+quasarReInitializeDSMForeignScan(ForeignScanState *node, ParallelContext *pcxt,
+                                 void *coordinate)
+{
+    QuasarParallelScan *shared = (QuasarParallelScan *) coordinate;
+
+    pg_atomic_write_u32(&shared->next_window, 0);
+}
+#endif
+
+/*
+ * quasarInitializeWorkerForeignScan
+ *              Take part in a parallel scan set up by the leader
+ */
+static void
+quasarInitializeWorkerForeignScan(ForeignScanState *node, shm_toc *toc,
+                                  void *coordinate)
+{
+    QuasarSetParallel(((QuasarFdwScanState *) node->fdw_state)->conn,
+                      (QuasarParallelScan *) coordinate);
+}
+#endif /* PG_VERSION_NUM >= 90600 */
+
+#if (PG_VERSION_NUM >= 140000)
+/*
+ * quasarIsForeignPathAsyncCapable
+ *              A scan can run asynchronously under an Append when
+ *              async_capable is on. Parallel scans already have
+ *              workers waiting for them.
+ */
+static bool
+quasarIsForeignPathAsyncCapable(ForeignPath *path)
+{
+    QuasarFdwRelationInfo *fpinfo = (QuasarFdwRelationInfo *) path->path.parent->fdw_private;
+
+    return fpinfo->async_capable && !path->path.parallel_aware;
+}
+
+/*
+ * quasarForeignAsyncRequest
+ *              The Append wants our next tuple
+ */
+static void
+quasarForeignAsyncRequest(AsyncRequest *areq)
+{
+    async_produce(areq);
+}
+
+/*
+ * quasarForeignAsyncConfigureWait
+ *              Have the Append wait for our socket, along with the
+ *              other scans' (see QuasarPollQuery). Another scan waiting
+ *              on the shared multi handle may have read our response in
+ *              the meantime, or all of it, and then our socket won't
+ *              turn readable again: hand over what we have right away.
+ */
+static void
+quasarForeignAsyncConfigureWait(AsyncRequest *areq)
+{
+    ForeignScanState *node = (ForeignScanState *) areq->requestee;
+    QuasarFdwScanState *fsstate = (QuasarFdwScanState *) node->fdw_state;
+    AppendState *requestor = (AppendState *) areq->requestor;
+
+    /* Unlike AsyncNotify, we unset callback_pending ourselves */
+    areq->callback_pending = false;
+    async_produce(areq);
+    if (areq->request_complete)
+    {
+        /* Unlike AsyncNotify, we call ExecAsyncResponse ourselves */
+        ExecAsyncResponse(areq);
+        return;
+    }
+
+    QuasarAddWaitEvent(fsstate->conn, requestor->as_eventset, areq);
+}
+
+/*
+ * quasarForeignAsyncNotify
+ *              Our socket is ready, see if that got us a tuple
+ */
+static void
+quasarForeignAsyncNotify(AsyncRequest *areq)
+{
+    async_produce(areq);
 }
+#endif /* PG_VERSION_NUM >= 140000 */
 
 /*
  * Detect whether we want to process an EquivalenceClass member.
@@ -1144,6 +1591,21 @@ find_em_expr_for_rel(EquivalenceClass *ec, RelOptInfo *rel)
     return NULL;
 }
 
+/*
+ * Whether pathkeys sort the rows by the given column, ascending, first.
+ * For a unique column the pathkeys after it don't change the order.
+ */
+static bool
+ordered_by_attnum(List *pathkeys, RelOptInfo *baserel, AttrNumber attnum)
+{
+    PathKey    *pathkey = (PathKey *) linitial(pathkeys);
+    Expr       *em_expr = find_em_expr_for_rel(pathkey->pk_eclass, baserel);
+
+    return pathkey->pk_strategy == BTLessStrategyNumber &&
+        em_expr != NULL && IsA(em_expr, Var) &&
+        ((Var *) em_expr)->varattno == attnum;
+}
+
 
 /*
  * estimate_path_cost_size
@@ -1213,6 +1675,7 @@ estimate_path_cost_size(PlannerInfo *root,
         conn = QuasarGetConnection(fpinfo->server, fpinfo->table);
         rows = QuasarEstimateRows(conn, sql.data);
         QuasarCleanupConnection(conn);
+        fpinfo->remote_rows = rows;
     }
     else
     {
@@ -1220,7 +1683,7 @@ estimate_path_cost_size(PlannerInfo *root,
     }
 
     /* Ideally quasar gives these to us but we have to improvise */
-    width = baserel->width;
+    width = QUASAR_REL_WIDTH(baserel);
 
     startup_cost = QUASAR_STARTUP_COST;
     cpu_per_tuple = QUASAR_PER_TUPLE_COST;
@@ -1294,7 +1757,11 @@ renderParams(QuasarFdwScanState *fsstate, ExprContext *econtext)
             bool        isNull;
 
             /* Evaluate the parameter expression */
+#if (PG_VERSION_NUM >= 100000)
+            expr_value = ExecEvalExpr(expr_state, econtext, &isNull);
+#else
             expr_value = ExecEvalExpr(expr_state, econtext, &isNull, NULL);
+#endif
 
             /*
              * Get string representation of each parameter value by invoking
@@ -1320,6 +1787,65 @@ renderParams(QuasarFdwScanState *fsstate, ExprContext *econtext)
     }
 }
 
+#if (PG_VERSION_NUM >= 140000)
+/*
+ * Hand the Append which asked for our next tuple one, or an empty result
+ * at the end of the scan. If Quasar hasn't sent it yet, leave the request
+ * pending until our socket is ready. A scan QuasarPollQuery says can't be
+ * waited on that way is read as usual, blocking this once.
+ */
+static void
+async_produce(AsyncRequest *areq)
+{
+    ForeignScanState *node = (ForeignScanState *) areq->requestee;
+    QuasarFdwScanState *fsstate = (QuasarFdwScanState *) node->fdw_state;
+    QuasarConn *conn = fsstate->conn;
+    quasar_query_curl_context *ctx;
+    TupleTableSlot *result;
+
+    if (conn->exec_transfer == 0)
+    {
+        renderParams(fsstate, node->ss.ps.ps_ExprContext);
+        QuasarExecuteQuery(conn, fsstate->query,
+                           fsstate->param_values, fsstate->numParams);
+    }
+
+    for (;;)
+    {
+        ctx = conn->reading->qctx;
+        if (ctx->next_tuple >= ctx->num_tuples)
+        {
+            if (!QuasarPollQuery(conn))
+            {
+                ExecAsyncRequestPending(areq);
+                return;
+            }
+
+            ctx = conn->reading->qctx;
+            if (ctx->next_tuple >= ctx->num_tuples)
+            {
+                QuasarContinueQuery(conn);
+
+                ctx = conn->reading->qctx;
+                if (ctx->next_tuple >= ctx->num_tuples)
+                {
+                    ExecAsyncRequestDone(areq, NULL);
+                    return;
+                }
+            }
+        }
+
+        /* Local conditions may filter out the rest of the batch */
+        result = areq->requestee->ExecProcNodeReal(areq->requestee);
+        if (!TupIsNull(result))
+        {
+            ExecAsyncRequestDone(areq, result);
+            return;
+        }
+    }
+}
+#endif
+
 /* Recursively parse RestrictInfo clauses
  * to find variables with `join_rowcount_estimate`
  * option, to estimate the rowcount of join clauses.
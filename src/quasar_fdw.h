@@ -22,19 +22,35 @@
 #include "funcapi.h"
 #include "lib/stringinfo.h"
 #include "nodes/execnodes.h"
+#if (PG_VERSION_NUM >= 120000)
+#include "nodes/pathnodes.h"
+#else
 #include "nodes/relation.h"
+#endif
+#include "port/atomics.h"
 #include "utils/rel.h"
+#include "utils/timestamp.h"
 
 #include "yajl/yajl_parse.h"
 #include <curl/curl.h>
+#include <pthread.h>
 
 #define BUF_SIZE 65536
 #define DEFAULT_CURL_TIMEOUT_MS 1000
+/* Longest a scan without a first byte or idle timeout sleeps at a time */
+#define TRANSFER_WAIT_MS 1000
 
 /* Default option values */
 #define DEFAULT_SERVER "http://localhost:8080"
 #define DEFAULT_PATH "/test"
 #define DEFAULT_TIMEOUT_MS 1000
+#define DEFAULT_MAX_CONNECTIONS 4
+/* Tuples a scan may have buffered before its transfer is paused */
+#define DEFAULT_FETCH_SIZE 10000
+/* Bytes of results a scan may have buffered before it is paused (16MB) */
+#define DEFAULT_FETCH_BYTES (16 * 1024 * 1024)
+#define DEFAULT_PIPELINE false
+#define DEFAULT_COMPRESSION "gzip"
 #define DEFAULT_FDW_USE_REMOTE_ESTIMATE true
 /* Cost to start up a query */
 #define DEFAULT_FDW_STARTUP_COST 100.0
@@ -46,10 +62,121 @@
 #define DEFAULT_FDW_JOIN_ROWCOUNT_ESTIMATE 1
 #define QUASAR_STARTUP_COST 10.0
 #define QUASAR_PER_TUPLE_COST 0.001
+/* Seconds a pooled curl handle may sit unused before it is closed */
+#define POOL_IDLE_TIMEOUT_S 60
+/* Temporary POST result files older than this are swept (1 day) */
+#define TEMP_FILE_MAX_AGE_S 86400
+/* Timeout of each cleanup request, counting only while it's being driven */
+#define CLEANUP_TIMEOUT_MS 10000
+/* Most of the time between two drives of the cleaner that counts toward it */
+#define CLEANUP_DRIVE_GAP_MS 1000
+/* How long an exiting backend waits for its cleanup requests */
+#define CLEANUP_EXIT_WAIT_MS 1000
+/* Failed requests in a row after which an endpoint is avoided */
+#define BREAKER_FAILURES 3
+/* For how long an endpoint is avoided before it's tried again */
+#define BREAKER_OPEN_MS 30000
+/* Requests in flight to a server from all backends, 0 for no limit */
+#define DEFAULT_MAX_INFLIGHT 0
+/* Admission lanes, served in this order */
+#define QUASAR_LANE_QUERY 0
+#define QUASAR_LANE_PLANNING 1
+#define QUASAR_LANES 2
+/* QuasarAdmit results other than a slot */
+#define QUASAR_ADMIT_UNLIMITED -1
+#define QUASAR_ADMIT_TIMEOUT -2
+/* Hedging unanswered GETs to a second endpoint is off by default */
+#define DEFAULT_HEDGE_MS 0
+/* Whether scans go through the proxy worker, when it's running */
+#define DEFAULT_PROXY true
+/* Requests the proxy worker runs at once */
+#define PROXY_SLOTS 64
+/* Bytes of response queued between the proxy worker and a scan */
+#define PROXY_QUEUE_SIZE (1024 * 1024)
+/* Connections the proxy worker keeps to one host, and in all */
+#define PROXY_HOST_CONNECTIONS 4
+#define PROXY_MAX_CONNECTIONS 32
+/* Longest the proxy worker sleeps without checking on things */
+#define PROXY_IDLE_WAIT_MS 1000
+/* Bytes between a pipeline thread and its scan, must be a power of 2 */
+#define PIPELINE_RING_SIZE (4 * 1024 * 1024)
+/* Records framed by a pipeline thread ahead of its scan, a power of 2 */
+#define PIPELINE_RECORDS 65536
+/* Scans are fetched as one stream unless parallel_streams says otherwise */
+#define DEFAULT_PARALLEL_STREAMS 1
+/* Remote row estimate from which a scan is split into parallel streams */
+#define DEFAULT_PARALLEL_MIN_ROWS 100000
+/*
+ * Scans run asynchronously under an Append only when asked to: the first
+ * byte and idle timeouts aren't enforced while the Append waits
+ */
+#define DEFAULT_ASYNC_CAPABLE false
+/*
+ * Scans are spread over parallel workers only when the table asks for it,
+ * since the leader first has Quasar write the result to a file
+ */
+#define DEFAULT_PARALLEL_SCAN false
+/* Windows a parallel scan is split into, per participating process */
+#define PARALLEL_WINDOWS_PER_WORKER 4
+/* Times a resumable scan is sent again after its transfer failed */
+#define RESUME_MAX_RETRIES 3
+/* Longer queries are POSTed, see https://github.com/quasar-analytics/quasar-fdw/issues/7 */
+#define GET_QUERY_SIZE_LIMIT 1500
+/* Bytes kept of a response with a bad status */
+#define ERROR_BODY_SIZE 512
 
-#define P_NO_RECORD 0
-#define P_RECORD_COMPLETE 1
-#define P_RECORD_STARTED 2
+/* Server capabilities, detected on first use and cached in the pool */
+#define QUASAR_CAP_UNKNOWN 0
+#define QUASAR_CAP_YES 1
+#define QUASAR_CAP_NO 2
+
+/*
+ * Since 9.6 the planner keeps the columns a relation has to return,
+ * and their width, in a PathTarget
+ */
+#if (PG_VERSION_NUM >= 90600)
+#define QUASAR_REL_TARGETLIST(rel) ((rel)->reltarget->exprs)
+#define QUASAR_REL_WIDTH(rel) ((rel)->reltarget->width)
+#else
+#define QUASAR_REL_TARGETLIST(rel) ((rel)->reltargetlist)
+#define QUASAR_REL_WIDTH(rel) ((rel)->width)
+#endif
+
+/* Array subscripts are SubscriptingRefs since 12 */
+#if (PG_VERSION_NUM >= 120000)
+#define ArrayRef SubscriptingRef
+#define T_ArrayRef T_SubscriptingRef
+#endif
+
+/* Attributes are an array of structs since 11, TupleDescAttr came in 10 */
+#ifndef TupleDescAttr
+#define TupleDescAttr(tupdesc, i) ((tupdesc)->attrs[(i)])
+#endif
+
+/*
+ * Lists are arrays since 13, where a cell is deleted while iterating with
+ * foreach_delete_current. Before, deleting a cell needed the one before
+ * it, and foreach read the next cell from the deleted one. These delete
+ * the current cell on any version:
+ *
+ *     quasar_foreach(lc, list)
+ *         if (...)
+ *             list = quasar_foreach_delete_current(list, lc);
+ */
+#if (PG_VERSION_NUM >= 130000)
+#define quasar_foreach(cell, lst) foreach(cell, lst)
+#define quasar_foreach_delete_current(lst, cell) foreach_delete_current(lst, cell)
+#else
+#define quasar_foreach(cell, lst) \
+    for (ListCell *cell##__prev = NULL, \
+                  *cell##__next = ((cell) = list_head(lst)) ? lnext(cell) : NULL; \
+         (cell) != NULL; \
+         cell##__prev = (cell), (cell) = cell##__next, \
+         cell##__next = (cell) != NULL ? lnext(cell) : NULL)
+#define quasar_foreach_delete_current(lst, cell) \
+    ((lst) = list_delete_cell((lst), (cell), cell##__prev), \
+     (cell) = cell##__prev, (lst))
+#endif
 
 /*
  * FDW-specific planner information kept in RelOptInfo.fdw_private for a
@@ -74,11 +201,19 @@ typedef struct QuasarFdwRelationInfo
     Cost            startup_cost;
     Cost            total_cost;
 
+    /* Rows Quasar estimated the query returns, 0 without a remote estimate */
+    double          remote_rows;
+
     /* Options extracted from catalogs. */
     bool            use_remote_estimate;
     Cost            fdw_startup_cost;
     Cost            fdw_tuple_cost;
     List       *shippable_extensions;       /* OIDs of whitelisted extensions */
+    int             parallel_streams;
+    double          parallel_min_rows;
+    bool            parallel_scan;
+    AttrNumber      resume_attnum;          /* resume_key column, if set */
+    bool            async_capable;
 
     /* Cached catalog information. */
     ForeignTable *table;
@@ -100,18 +235,39 @@ typedef struct quasar_query_curl_context {
     MemoryContext batchmem;     /* Context for each batch of tuples */
     MemoryContext tempmem;      /* Context for temporary tuples */
     int batch_count;            /* Number of batches transferred */
+    int fetch_size;             /* Max unread tuples buffered per batch */
+    size_t fetch_bytes;         /* Max bytes of results parsed per batch */
+    size_t batch_bytes;         /* Bytes of results parsed into this batch */
+    uint64 decoded_bytes;       /* Bytes of results parsed, decompressed */
+    bool paused;                /* Transfer paused until the batch is read */
+    TimestampTz last_data;      /* When the body handler last got data */
+
+    /* The start of a response with a bad status, for check_transfer */
+    char error_body[ERROR_BODY_SIZE];
+    int error_len;
 
     /* For converting to tuples */
     Relation rel;
     AttInMetadata *attinmeta;
     List *retrieved_attrs;
 
-    /* for storing result tuples */
-    HeapTuple  *tuples;                 /* array of currently-retrieved tuples */
-    int         num_tuples;             /* # of tuples in array */
+    /*
+     * The batch, as received: rows are only parsed when the executor asks
+     * for them (see QuasarNextTuple). records holds the raw response, the
+     * last row in it possibly incomplete, record_ends where each complete
+     * row ends.
+     */
+    StringInfoData records;
+    int        *record_ends;
+    int         num_tuples;             /* # of complete rows */
     int         next_tuple;             /* index of next one to return */
-    int         alloc_tuples;           /* Number allocated spots for tuples */
-    bool        partial_tuple;           /* Is a tuple partially parsed? */
+    int         alloc_tuples;           /* Number allocated spots in record_ends */
+
+    /* Where finding the end of rows got to in records */
+    int         scanned;
+    int         scan_depth;             /* of objects and arrays */
+    bool        scan_in_string;
+    bool        scan_escaped;
 } quasar_query_curl_context;
 
 typedef struct quasar_info_curl_context {
@@ -119,6 +275,64 @@ typedef struct quasar_info_curl_context {
     StringInfoData buf;
 } quasar_info_curl_context;
 
+/* TLS options of a server, NULL strings for curl's defaults */
+typedef struct QuasarTls
+{
+    char *ca_file;              /* CA bundle to verify Quasar with */
+    char *cert;                 /* client certificate */
+    char *key;                  /* and its private key */
+    bool verify;                /* verify Quasar's certificate and name */
+} QuasarTls;
+
+/*
+ * Per-backend pool of curl handles for a single Quasar server.
+ * Allocated in TopMemoryContext and kept for the life of the backend.
+ */
+typedef struct QuasarPool
+{
+    char *server;               /* server option this pool is keyed by */
+    char *socket_path;          /* and socket_path, NULL for TCP */
+    QuasarTls tls;              /* and TLS options */
+    CURLSH *share;              /* DNS, TLS session (and connection) cache shared by handles */
+    CURLSH *thread_share;       /* the same without connections, for pipeline threads */
+    pthread_mutex_t locks[CURL_LOCK_DATA_LAST]; /* for both shares */
+    int max_connections;        /* max idle handles kept open */
+    List *handles;              /* QuasarPoolHandle list, see quasar_pool.c */
+    int post_stream;            /* QUASAR_CAP_* for streaming POST queries */
+    int failures;               /* requests failed in a row */
+    TimestampTz open_until;     /* breaker open (endpoint avoided) until */
+} QuasarPool;
+
+/* A scan's transfer running on a helper thread, see quasar_pipeline.c */
+typedef struct QuasarPipeline QuasarPipeline;
+
+/* A scan's transfer run by the proxy worker, see quasar_proxy.c */
+typedef struct QuasarProxy QuasarProxy;
+
+/* Signature of curl's header and write callbacks */
+typedef size_t (*QuasarCurlCallback)(void *buffer, size_t size, size_t nmemb, void *userp);
+
+/*
+ * Windows of a parallel scan, in the dynamic shared memory of the
+ * parallel query. Each participating process claims the next one when
+ * it is done with the one it had, see QuasarSetParallel.
+ */
+typedef struct QuasarParallelScan
+{
+    pg_atomic_uint32 next_window;
+    uint32 nwindows;
+    long window_rows;           /* the last window gets the rest */
+    char path[MAXPGPATH];       /* materialized result, "" for one window */
+} QuasarParallelScan;
+
+/* One copy of a request which may be hedged, see quasar_conn.c */
+typedef struct QuasarLeg
+{
+    struct QuasarConn *conn;
+    QuasarPool *pool;           /* endpoint it is sent to */
+    CURL *curl;                 /* NULL once dropped */
+} QuasarLeg;
+
 /*
  * FDW-specific information for ForeignScanState
  * fdw_state.
@@ -127,15 +341,78 @@ typedef struct QuasarConn
 {
     char *post_path;            /* Path where a POST request has put data
                                  * Needs to be DELETEd afterwards */
-    char *server;
+    char *server;                    /* endpoint of the current request */
+    List *servers;                   /* all endpoints of the server option */
+    char *server_option;             /* the option itself, for admission */
+    int max_inflight;
+    int admit_slot;                  /* held for the current request, see quasar_admit.c */
+    SubTransactionId subid;          /* subtransaction the scan was started in */
+    char *socket_path;
+    QuasarTls tls;
+    int max_connections;
     char *path;
     char *full_url;
-    long timeout_ms; /* curl request timeout */
+    long timeout_ms; /* default for the timeouts below */
+    long connect_timeout_ms;         /* to connect to Quasar */
+    long first_byte_timeout_ms;      /* from sending a request to the response */
+    long idle_timeout_ms;            /* without data while a scan waits on it */
+    TimestampTz transfer_start;      /* when the current request was sent */
+    int fetch_size;                  /* see quasar_query_curl_context */
+    size_t fetch_bytes;
+    bool use_pipeline;               /* pipeline option */
+    char *compression;               /* Accept-Encoding of requests */
+    uint64 received_bytes;           /* body bytes of finished transfers */
+    QuasarPipeline *pipeline;        /* set while the transfer is pipelined */
+    bool use_proxy;                  /* proxy option */
+    QuasarProxy *proxy;              /* set while the proxy worker runs the transfer */
+    long hedge_ms;                   /* hedge GETs unanswered this long, 0 never */
 
-    CURLM *curlm;                    /* curl multi handle */
+    /* Legs of a GET to several endpoints, nlegs is 0 unless armed */
+    QuasarLeg legs[2];
+    int nlegs;
+    int winner;                      /* leg which answered, -1 before */
+    bool hedged;                     /* second leg was tried */
+    char *hedge_path;                /* request URL after the endpoint */
+    QuasarCurlCallback leg_header;   /* callbacks the legs forward to */
+    void *leg_header_ctx;
+    QuasarCurlCallback leg_body;
+    void *leg_body_ctx;
+
+    /* Window of the query's rows this connection fetches, see QuasarSplitQuery */
+    long window_offset;
+    long window_limit;               /* -1 for all the rest */
+    char *window_path;               /* file the windows are ranges of */
+    bool owns_window_path;           /* it's deleted with this connection */
+    List *windows;                   /* all windows of a split scan, this one first */
+    struct QuasarConn *reading;      /* window whose tuples the executor reads */
+    QuasarParallelScan *shared;      /* windows of a parallel scan, else NULL */
+    char *parallel_query;
+
+    /* Resuming a failed scan past the last row returned, see QuasarSetResumable */
+    char *resume_query;              /* NULL unless resumable */
+    char *resume_base;               /* the query as first sent */
+    char **resume_params;            /* its parameters and the resume key */
+    size_t resume_nparams;
+    AttrNumber resume_attnum;
+    TupleDesc resume_tupdesc;
+    Oid resume_type;
+    FmgrInfo resume_out;
+    char *resume_value;              /* key of the last row returned, as a literal */
+    int resume_retries;
+
+    QuasarPool *pool;                /* where conn->curl is checked out from */
+    CURLM *curlm;                    /* multi handle shared by all scans */
     CURL *curl;                      /* current transfer handle */
     int ongoing_transfers;           /* 1 if transfer still ongoing, 0 otherwise */
+    CURLcode transfer_result;        /* How the transfer ended */
     int exec_transfer;               /* 1 if transfer started, 0 otherwise */
+    bool streaming_post;             /* query was POSTed without a Destination */
+
+    /* Long query kept for falling back from a streaming POST */
+    MemoryContext querymem;
+    char *query;
+    char **param_values;
+    size_t numParams;
 
     quasar_query_curl_context *qctx;   /* For buffering tuples */
 } QuasarConn;
@@ -153,13 +430,85 @@ extern void QuasarExecuteQuery(QuasarConn *conn,
                                char *query,
                                const char **param_values,
                                size_t numParams);
+extern void QuasarSplitQuery(QuasarConn *conn,
+                             ForeignServer *server, ForeignTable *table,
+                             EState *estate, Relation rel,
+                             int streams, long window_rows);
+extern void QuasarSetParallel(QuasarConn *conn, QuasarParallelScan *shared);
+extern char *QuasarMaterializeQuery(QuasarConn *conn, char *query);
+extern void QuasarSetResumable(QuasarConn *conn, Relation rel,
+                               char *resume_query, AttrNumber attnum);
 extern void QuasarContinueQuery(QuasarConn *conn);
+extern void QuasarNextTuple(quasar_query_curl_context *ctx,
+                            Datum *values, bool *nulls);
 extern void QuasarRewindQuery(QuasarConn *conn);
+#if (PG_VERSION_NUM >= 140000)
+extern bool QuasarPollQuery(QuasarConn *conn);
+extern void QuasarAddWaitEvent(QuasarConn *conn, struct WaitEventSet *set,
+                               void *user_data);
+#endif
 
 extern double QuasarEstimateRows(QuasarConn *conn, char *query);
 
 extern char *QuasarCompileQuery(QuasarConn *conn, char *query);
 
+extern void QuasarTransferStats(QuasarConn *conn, uint64 *received, uint64 *decoded);
+
+/* quasar_pool.c headers */
+extern QuasarPool *QuasarPoolGet(const char *server, const char *socket_path,
+                                 const QuasarTls *tls, int max_connections);
+extern QuasarPool *QuasarPoolChoose(List *servers, const char *socket_path,
+                                    const QuasarTls *tls, int max_connections,
+                                    QuasarPool *exclude);
+extern void QuasarPoolSetTransport(QuasarPool *pool, CURL *curl);
+extern void QuasarPoolSetThreaded(QuasarPool *pool, CURL *curl);
+extern void QuasarPoolReportSuccess(QuasarPool *pool);
+extern void QuasarPoolReportFailure(QuasarPool *pool);
+extern CURL *QuasarPoolAcquire(QuasarPool *pool);
+extern void QuasarPoolRelease(QuasarPool *pool, CURL *curl);
+extern void QuasarPoolResetHandle(QuasarPool *pool, CURL *curl);
+extern void QuasarPoolReleaseAll(void);
+
+/* quasar_admit.c headers */
+extern void QuasarAdmitInit(void);
+extern int QuasarAdmit(const char *server, int limit, int lane, long timeout_ms,
+                       SubTransactionId subid);
+extern void QuasarAdmitRelease(int slotno);
+extern void QuasarAdmitReleaseAll(void);
+extern void QuasarAdmitReleaseSub(SubTransactionId subid);
+
+/* quasar_proxy.c headers */
+extern void QuasarProxyInit(void);
+extern QuasarProxy *QuasarProxyStart(QuasarPool *pool, const char *url,
+                                     const char *compression, long connect_timeout_ms,
+                                     SubTransactionId subid);
+extern void QuasarProxyStop(QuasarProxy *px);
+extern void QuasarProxyStopAll(void);
+extern void QuasarProxyStopSub(SubTransactionId subid);
+extern size_t QuasarProxyReceive(QuasarProxy *px, const char **data);
+extern int QuasarProxyStatus(QuasarProxy *px);
+extern bool QuasarProxyDone(QuasarProxy *px, CURLcode *result);
+extern uint64 QuasarProxyReceived(QuasarProxy *px);
+extern void QuasarProxyWait(QuasarProxy *px, long timeout_ms);
+
+/* quasar_cleanup.c headers */
+extern char *QuasarTempFileName(void);
+extern void QuasarCleanupQueue(QuasarPool *pool, const char *post_path);
+extern void QuasarCleanupFlush(void);
+extern void QuasarCleanupPoll(void);
+
+/* quasar_pipeline.c headers */
+extern QuasarPipeline *QuasarPipelineStart(CURL *curl, SubTransactionId subid);
+extern void QuasarPipelineStop(QuasarPipeline *pl);
+extern void QuasarPipelineStopAll(void);
+extern void QuasarPipelineStopSub(SubTransactionId subid);
+extern size_t QuasarPipelinePeek(QuasarPipeline *pl, const char **data);
+extern void QuasarPipelineConsume(QuasarPipeline *pl, size_t bytes);
+extern int QuasarPipelineTakeRecords(QuasarPipeline *pl, uint32 *behind, int max);
+extern int QuasarPipelineStatus(QuasarPipeline *pl);
+extern bool QuasarPipelineDone(QuasarPipeline *pl, CURLcode *result);
+extern void QuasarPipelineWait(QuasarPipeline *pl, long timeout_ms);
+
 /* quasar_options.c headers */
 extern Datum quasar_fdw_validator(PG_FUNCTION_ARGS);
 extern bool quasar_is_valid_option(const char *option, Oid context);
@@ -169,12 +518,11 @@ void quasar_parse_alloc(quasar_parse_context *ctx,
                         Relation rel);
 void quasar_parse_free(quasar_parse_context *ctx);
 void quasar_parse_reset(quasar_parse_context *ctx);
-int quasar_parse(quasar_parse_context *ctx,
-                 const char *buffer,
-                 size_t *buf_loc,
-                 size_t buf_size,
-                 HeapTuple *result);
-void quasar_copy_parse_context(quasar_parse_context *ctx);
+void quasar_parse(quasar_parse_context *ctx,
+                  const char *record,
+                  size_t size,
+                  Datum *values,
+                  bool *nulls);
 
 /* quasar_query.c headers */
 extern void classifyConditions(PlannerInfo *root,
@@ -203,5 +551,10 @@ extern void deparseStringLiteral(StringInfo buf, const char *val);
 extern Expr *find_em_expr_for_rel(EquivalenceClass *ec, RelOptInfo *rel);
 extern void appendOrderByClause(StringInfo buf, PlannerInfo *root,
                                 RelOptInfo *baserel, List *pathkeys);
+extern void appendResumeCondition(StringInfo buf, PlannerInfo *root,
+                                  RelOptInfo *baserel, AttrNumber attnum,
+                                  int paramindex, bool is_first);
+extern void appendResumeOrderBy(StringInfo buf, PlannerInfo *root,
+                                RelOptInfo *baserel, AttrNumber attnum);
 
 #endif /* QUASAR_FDW_QUASAR_FDW_H */
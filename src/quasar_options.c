@@ -66,12 +66,38 @@ static struct QuasarFdwOption valid_options[] =
     { "server",  ForeignServerRelationId },
     { "path",    ForeignServerRelationId },
     { "timeout_ms", ForeignServerRelationId },
+    { "connect_timeout_ms", ForeignServerRelationId },
+    { "first_byte_timeout_ms", ForeignServerRelationId },
+    { "idle_timeout_ms", ForeignServerRelationId },
     { "use_remote_estimate", ForeignServerRelationId },
     { "fdw_startup_cost", ForeignServerRelationId },
     { "fdw_tuple_cost", ForeignServerRelationId },
+    { "max_connections", ForeignServerRelationId },
+    { "fetch_size", ForeignServerRelationId },
+    { "fetch_bytes", ForeignServerRelationId },
+    { "pipeline", ForeignServerRelationId },
+    { "compression", ForeignServerRelationId },
+    { "socket_path", ForeignServerRelationId },
+    { "hedge_ms", ForeignServerRelationId },
+    { "max_inflight", ForeignServerRelationId },
+    { "proxy", ForeignServerRelationId },
+    { "ssl_ca_file", ForeignServerRelationId },
+    { "ssl_cert", ForeignServerRelationId },
+    { "ssl_key", ForeignServerRelationId },
+    { "ssl_verify", ForeignServerRelationId },
+    { "async_capable", ForeignServerRelationId },
         /* Available options for CREATE FOREIGN TABLE */
     { "table",   ForeignTableRelationId },
     { "use_remote_estimate", ForeignTableRelationId },
+    { "fetch_size", ForeignTableRelationId },
+    { "fetch_bytes", ForeignTableRelationId },
+    { "pipeline", ForeignTableRelationId },
+    { "proxy", ForeignTableRelationId },
+    { "parallel_streams", ForeignTableRelationId },
+    { "parallel_min_rows", ForeignTableRelationId },
+    { "parallel_scan", ForeignTableRelationId },
+    { "resume_key", ForeignTableRelationId },
+    { "async_capable", ForeignTableRelationId },
     /* Available options for columns inside CREATE FOREIGN TABLE */
     { "map",     AttributeRelationId },
     { "nopushdown", AttributeRelationId },
@@ -80,6 +106,14 @@ static struct QuasarFdwOption valid_options[] =
     { NULL,     InvalidOid }
 };
 
+/*
+ * Values for the compression option, as sent in Accept-Encoding
+ */
+static const char *valid_compressions[] =
+{
+    "identity", "gzip", "deflate", "br", "zstd", NULL
+};
+
 extern Datum quasar_fdw_validator(PG_FUNCTION_ARGS);
 
 PG_FUNCTION_INFO_V1(quasar_fdw_validator);
@@ -129,6 +163,63 @@ quasar_fdw_validator(PG_FUNCTION_ARGS)
                  errhint("Valid options in this context are: %s", buf.len ? buf.data : "<none>")
                 ));
         }
+
+        /*
+         * The backend reads these files as the server's OS user, and
+         * turning verification off exposes everyone's scans, so like
+         * postgres_fdw's, they're for superusers only
+         */
+        if ((strcmp(def->defname, "ssl_ca_file") == 0 ||
+             strcmp(def->defname, "ssl_cert") == 0 ||
+             strcmp(def->defname, "ssl_key") == 0) &&
+            !superuser())
+            ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("ssl_ca_file, ssl_cert and ssl_key are superuser-only"),
+                 errhint("Servers with the ssl_ca_file, ssl_cert or ssl_key options set may only be created or modified by the superuser.")
+                ));
+
+        /* Any socket the server's OS user can open would do, so the same */
+        if (strcmp(def->defname, "socket_path") == 0 && !superuser())
+            ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("socket_path is superuser-only"),
+                 errhint("Servers with the socket_path option set may only be created or modified by the superuser.")
+                ));
+
+        if (strcmp(def->defname, "ssl_verify") == 0 &&
+            !defGetBoolean(def) && !superuser())
+            ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("ssl_verify=false is superuser-only"),
+                 errhint("Servers with ssl_verify=false may only be created or modified by the superuser.")
+                ));
+
+        if (strcmp(def->defname, "compression") == 0)
+        {
+            const char **c;
+            StringInfoData buf;
+
+            for (c = valid_compressions; *c; c++)
+            {
+                if (strcmp(*c, defGetString(def)) == 0)
+                    break;
+            }
+
+            if (*c == NULL)
+            {
+                initStringInfo(&buf);
+                for (c = valid_compressions; *c; c++)
+                    appendStringInfo(&buf, "%s%s", (buf.len > 0) ? ", " : "", *c);
+
+                ereport(ERROR,
+                    (errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+                    errmsg("invalid value for option \"%s\": \"%s\"",
+                           def->defname, defGetString(def)),
+                     errhint("Valid values are: %s", buf.data)
+                    ));
+            }
+        }
     }
     PG_RETURN_VOID();
 }
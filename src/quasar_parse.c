@@ -20,24 +20,61 @@
 
 #include "yajl/yajl_parse.h"
 
-#include "access/htup_details.h"
+#include <float.h>
+#include <math.h>
+
 #include "catalog/pg_type.h"
 #include "common/fe_memutils.h"
-#include "utils/datum.h"
+#include "mb/pg_wchar.h"
+#include "utils/builtins.h"
+#include "utils/date.h"
+#include "utils/datetime.h"
 #include "utils/syscache.h"
 
 
 
 #define YAJL_OK 1
-#define YAJL_CANCEL 0
 
 #define NO_COLUMN -1
 
 #define TOP_LEVEL 0
 #define COLUMN_LEVEL 1
 
+/* Keys of a row we remember the order of, beyond the relation's columns */
+#define EXTRA_KEYS 8
+
+/* Longest number decode_float copies out of the response */
+#define MAX_FLOAT_LEN 64
+
+/* decode_datetime builds integer times and timestamps only */
+#if (PG_VERSION_NUM >= 100000) || defined(HAVE_INT64_TIMESTAMP)
+#define QUASAR_INT64_TIMESTAMP
+#endif
+
+/*
+ * How a column's scalar values become Datums: by our own decoder
+ * straight from the response, or through the type's input function
+ */
+typedef enum {
+    DECODE_INPUT,
+    DECODE_INT2,
+    DECODE_INT4,
+    DECODE_INT8,
+    DECODE_OID,
+    DECODE_FLOAT4,
+    DECODE_FLOAT8,
+    DECODE_BOOL,
+    DECODE_TEXT,
+    DECODE_VARCHAR,
+    DECODE_BPCHAR,
+    DECODE_DATE,
+    DECODE_TIME,
+    DECODE_TIMESTAMP,
+    DECODE_TIMESTAMPTZ
+} decoder;
+
 typedef struct parser {
-    /* Storing output data */
+    /* Storing output data, the caller's arrays while a row is parsed */
     Datum *values;
     bool *nulls;
 
@@ -45,6 +82,23 @@ typedef struct parser {
     AttInMetadata *attinmeta;
     Relation rel;
 
+    /*
+     * Finding the column of a key, see column_of_key: the names of the
+     * columns, an open addressing hash table of them (holding column
+     * number + 1, 0 when empty), and the columns of the keys of the last
+     * row, in order, since Quasar sends every row's keys in the same one.
+     */
+    const char **key_names;
+    int *key_lens;
+    int *key_hash;
+    uint32 key_hash_mask;
+    int *key_order;
+    int key_order_size;
+    int key_pos;                /* keys of the current row so far */
+
+    /* Decoder of each column, see build_decoders */
+    decoder *decoders;
+
     /* Internal flags */
     size_t cur_col;
     bool record_complete;
@@ -67,6 +121,20 @@ static void arrayAppendCommaIf(parser *p);
 static void store_datum(parser *p, char *string, const char *fmt);
 static void store_null(parser *p);
 bool warncheck(parser *p);
+static void build_key_index(parser *p);
+static uint32 hash_key(const char *key, size_t len);
+static int column_of_key(parser *p, const char *key, size_t len);
+static void build_decoders(parser *p);
+static bool store_decoded(parser *p, const char *value, size_t len);
+static bool decode_integer(const char *value, size_t len,
+                           int64 min, int64 max, int64 *result);
+static bool decode_float(const char *value, size_t len, bool single,
+                         Datum *result);
+static bool decode_string(const char *value, size_t len, decoder dec,
+                          int32 typmod, Datum *result);
+static bool read_digits(const char *value, int n, int *result);
+static bool decode_datetime(const char *value, size_t len, decoder dec,
+                            Datum *result);
 char *checkConversions(parser *p, char *value);
 static void conversion_error_callback(void *arg);
 
@@ -94,9 +162,464 @@ bool warncheck(parser *p) {
     return false;
 }
 
+/*
+ * Index the names of the relation's columns for column_of_key.
+ * The hash table is at most half full.
+ */
+static void build_key_index(parser *p) {
+    TupleDesc tupdesc = p->attinmeta->tupdesc;
+    uint32 size = 4;
+    int i;
+
+    while (size < 2 * tupdesc->natts)
+        size <<= 1;
+
+    p->key_names = palloc0(tupdesc->natts * sizeof(char *));
+    p->key_lens = palloc0(tupdesc->natts * sizeof(int));
+    p->key_hash = palloc0(size * sizeof(int));
+    p->key_hash_mask = size - 1;
+    p->key_order_size = tupdesc->natts + EXTRA_KEYS;
+    p->key_order = palloc(p->key_order_size * sizeof(int));
+    for (i = 0; i < p->key_order_size; ++i)
+        p->key_order[i] = NO_COLUMN;
+    p->key_pos = 0;
+
+    for (i = 0; i < tupdesc->natts; ++i) {
+        uint32 h;
+
+        if (TupleDescAttr(tupdesc, i)->attisdropped)
+            continue;
+
+        p->key_names[i] = NameStr(TupleDescAttr(tupdesc, i)->attname);
+        p->key_lens[i] = strlen(p->key_names[i]);
+
+        /* The first of equal names wins, like it did in a linear search */
+        h = hash_key(p->key_names[i], p->key_lens[i]) & p->key_hash_mask;
+        while (p->key_hash[h] != 0 &&
+               !(p->key_lens[p->key_hash[h] - 1] == p->key_lens[i] &&
+                 memcmp(p->key_names[p->key_hash[h] - 1], p->key_names[i],
+                        p->key_lens[i]) == 0))
+            h = (h + 1) & p->key_hash_mask;
+        if (p->key_hash[h] == 0)
+            p->key_hash[h] = i + 1;
+    }
+}
+
+/* FNV-1a */
+static uint32 hash_key(const char *key, size_t len) {
+    uint32 h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        h ^= (unsigned char) key[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * The column a key of a row is for, or NO_COLUMN.
+ * Usually that's the column of the key in the same place in the last
+ * row, otherwise it's looked up in the hash table.
+ */
+static int column_of_key(parser *p, const char *key, size_t len) {
+    int col = NO_COLUMN;
+    int pos = p->key_pos++;
+    uint32 h;
+
+    if (pos < p->key_order_size) {
+        col = p->key_order[pos];
+        if (col != NO_COLUMN &&
+            (size_t) p->key_lens[col] == len &&
+            memcmp(p->key_names[col], key, len) == 0)
+            return col;
+    }
+
+    col = NO_COLUMN;
+    h = hash_key(key, len) & p->key_hash_mask;
+    while (p->key_hash[h] != 0) {
+        int i = p->key_hash[h] - 1;
+
+        if ((size_t) p->key_lens[i] == len && memcmp(p->key_names[i], key, len) == 0) {
+            col = i;
+            break;
+        }
+        h = (h + 1) & p->key_hash_mask;
+    }
+
+    if (pos < p->key_order_size)
+        p->key_order[pos] = col;
+    return col;
+}
+
+/*
+ * Pick the decoder of each column. Only plain columns of the built in
+ * types get one of our own, and only the string types when they have a
+ * typmod; domains, arrays and everything else keep using the input
+ * function.
+ */
+static void build_decoders(parser *p) {
+    TupleDesc tupdesc = p->attinmeta->tupdesc;
+    int i;
+
+    p->decoders = palloc(tupdesc->natts * sizeof(decoder));
+    for (i = 0; i < tupdesc->natts; ++i) {
+        Form_pg_attribute att = TupleDescAttr(tupdesc, i);
+
+        p->decoders[i] = DECODE_INPUT;
+        if (att->attisdropped || att->attndims > 0)
+            continue;
+
+        switch (att->atttypid) {
+        case TEXTOID:    p->decoders[i] = DECODE_TEXT; break;
+        case VARCHAROID: p->decoders[i] = DECODE_VARCHAR; break;
+        case BPCHAROID:  p->decoders[i] = DECODE_BPCHAR; break;
+        default:         break;
+        }
+        if (p->decoders[i] != DECODE_INPUT || att->atttypmod != -1)
+            continue;
+
+        switch (att->atttypid) {
+        case INT2OID:   p->decoders[i] = DECODE_INT2; break;
+        case INT4OID:   p->decoders[i] = DECODE_INT4; break;
+        case INT8OID:   p->decoders[i] = DECODE_INT8; break;
+        case OIDOID:    p->decoders[i] = DECODE_OID; break;
+        case FLOAT4OID: p->decoders[i] = DECODE_FLOAT4; break;
+        case FLOAT8OID: p->decoders[i] = DECODE_FLOAT8; break;
+        case BOOLOID:   p->decoders[i] = DECODE_BOOL; break;
+        case DATEOID:   p->decoders[i] = DECODE_DATE; break;
+#ifdef QUASAR_INT64_TIMESTAMP
+        case TIMEOID:   p->decoders[i] = DECODE_TIME; break;
+        case TIMESTAMPOID:   p->decoders[i] = DECODE_TIMESTAMP; break;
+        case TIMESTAMPTZOID: p->decoders[i] = DECODE_TIMESTAMPTZ; break;
+#endif
+        default:        break;
+        }
+    }
+}
+
+/*
+ * [-]digits into an integer between min and max.
+ * False for anything else, including overflow, so the input function
+ * gets to say what's wrong with it.
+ */
+static bool decode_integer(const char *value, size_t len,
+                           int64 min, int64 max, int64 *result) {
+    bool neg = false;
+    uint64 limit;
+    uint64 acc = 0;
+    size_t i = 0;
+
+    if (len > 0 && value[0] == '-') {
+        neg = true;
+        i = 1;
+    }
+    if (i == len)
+        return false;
+
+    limit = neg ? (uint64) -(min + 1) + 1 : (uint64) max;
+    for (; i < len; ++i) {
+        unsigned d = (unsigned char) value[i] - '0';
+
+        if (d > 9 || acc > limit / 10 || (acc == limit / 10 && d > limit % 10))
+            return false;
+        acc = acc * 10 + d;
+    }
+
+    if (neg)
+        *result = acc == 0 ? 0 : -(int64) (acc - 1) - 1;
+    else
+        *result = (int64) acc;
+    return true;
+}
+
+/*
+ * A float4 or float8, read like float4in and float8in do. False when
+ * the value is out of range, which the input functions complain about.
+ */
+static bool decode_float(const char *value, size_t len, bool single,
+                         Datum *result) {
+    char buf[MAX_FLOAT_LEN];
+    char *end;
+    double val;
+
+    if (len == 0 || len >= MAX_FLOAT_LEN)
+        return false;
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+
+    errno = 0;
+#if (PG_VERSION_NUM >= 120000)
+    if (single) {
+        float fval = strtof(buf, &end);
+
+        if (end != buf + len || errno != 0)
+            return false;
+        *result = Float4GetDatum(fval);
+        return true;
+    }
+#endif
+    val = strtod(buf, &end);
+    if (end != buf + len || errno != 0)
+        return false;
+
+    if (single) {
+        if (isinf((float4) val) || (val != 0.0 && fabs(val) < FLT_MIN))
+            return false;
+        *result = Float4GetDatum((float4) val);
+    } else {
+        *result = Float8GetDatum(val);
+    }
+    return true;
+}
+
+/*
+ * A text, varchar or bpchar built from the value in one go, instead of
+ * copying it to a C string for the input function to copy again.
+ * False when the value doesn't fit the typmod (the input functions
+ * then trim spaces or complain) or has a NUL in it (they'd stop there).
+ */
+static bool decode_string(const char *value, size_t len, decoder dec,
+                          int32 typmod, Datum *result) {
+    int maxlen = typmod - VARHDRSZ;
+    int charlen = 0;
+    int pad = 0;
+    text *t;
+
+    if (memchr(value, '\0', len) != NULL)
+        return false;
+
+    if (dec != DECODE_TEXT && typmod >= (int32) VARHDRSZ) {
+        /* No more characters than bytes, only count them when it matters */
+        if (len > (size_t) maxlen || dec == DECODE_BPCHAR)
+            charlen = pg_mbstrlen_with_len(value, len);
+        if (charlen > maxlen)
+            return false;
+        if (dec == DECODE_BPCHAR)
+            pad = maxlen - charlen;
+    }
+
+    t = (text *) palloc(VARHDRSZ + len + pad);
+    SET_VARSIZE(t, VARHDRSZ + len + pad);
+    memcpy(VARDATA(t), value, len);
+    if (pad > 0)
+        memset(VARDATA(t) + len, ' ', pad);
+    *result = PointerGetDatum(t);
+    return true;
+}
+
+/* Exactly n digits */
+static bool read_digits(const char *value, int n, int *result) {
+    int i;
+
+    *result = 0;
+    for (i = 0; i < n; ++i) {
+        if (value[i] < '0' || value[i] > '9')
+            return false;
+        *result = *result * 10 + (value[i] - '0');
+    }
+    return true;
+}
+
+/*
+ * The ISO 8601 dates, times and timestamps Quasar sends, in the fixed
+ * layouts
+ *     date         YYYY-MM-DD
+ *     time         HH:MM:SS[.ffffff]
+ *     timestamp    YYYY-MM-DD{T| }HH:MM:SS[.ffffff][Z|{+|-}HH[[:]MM]]
+ * The zone of a timestamp is ignored, like timestamp_in does, and a
+ * timestamptz must have one. Anything else (other layouts, leap seconds,
+ * more than microseconds, timestamptz in the session's time zone) is
+ * left to the input function.
+ */
+static bool decode_datetime(const char *value, size_t len, decoder dec,
+                            Datum *result) {
+    const char *c = value;
+    const char *end = value + len;
+    int year = 0, mon = 0, mday = 0;
+    int hour, min, sec;
+    int64 fsec = 0;
+    int64 offset = 0;
+    int64 time;
+    int64 date;
+
+    if (dec != DECODE_TIME) {
+        if (len < 10 ||
+            !read_digits(c, 4, &year) || c[4] != '-' ||
+            !read_digits(c + 5, 2, &mon) || c[7] != '-' ||
+            !read_digits(c + 8, 2, &mday))
+            return false;
+        if (year < 1 || mon < 1 || mon > MONTHS_PER_YEAR ||
+            mday < 1 || mday > day_tab[isleap(year)][mon - 1])
+            return false;
+        c += 10;
+
+        if (dec == DECODE_DATE) {
+            if (c != end)
+                return false;
+            *result = DateADTGetDatum(date2j(year, mon, mday) - POSTGRES_EPOCH_JDATE);
+            return true;
+        }
+
+        if (c == end || (*c != 'T' && *c != ' '))
+            return false;
+        ++c;
+    }
+
+    if (end - c < 8 ||
+        !read_digits(c, 2, &hour) || c[2] != ':' ||
+        !read_digits(c + 3, 2, &min) || c[5] != ':' ||
+        !read_digits(c + 6, 2, &sec))
+        return false;
+    if (hour >= HOURS_PER_DAY || min >= MINS_PER_HOUR || sec >= SECS_PER_MINUTE)
+        return false;
+    c += 8;
+
+    if (c < end && *c == '.') {
+        int64 scale = USECS_PER_SEC;
+
+        for (++c; c < end && *c >= '0' && *c <= '9'; ++c) {
+            scale /= 10;
+            if (scale == 0)
+                return false;
+            fsec += (*c - '0') * scale;
+        }
+        if (scale == USECS_PER_SEC)
+            return false;
+    }
+
+    if (dec == DECODE_TIME) {
+        /* a zone makes it a timetz */
+    } else if (c < end && *c == 'Z') {
+        ++c;
+    } else if (c < end && (*c == '+' || *c == '-')) {
+        bool neg = *c == '-';
+        int zhour, zmin = 0;
+
+        ++c;
+        if (end - c < 2 || !read_digits(c, 2, &zhour))
+            return false;
+        c += 2;
+        if (end - c == 3 && *c == ':') {
+            if (!read_digits(c + 1, 2, &zmin))
+                return false;
+            c += 3;
+        } else if (end - c == 2) {
+            if (!read_digits(c, 2, &zmin))
+                return false;
+            c += 2;
+        }
+        if (zhour > MAX_TZDISP_HOUR || zmin >= MINS_PER_HOUR)
+            return false;
+        offset = (int64) (zhour * MINS_PER_HOUR + zmin) * SECS_PER_MINUTE * USECS_PER_SEC;
+        if (neg)
+            offset = -offset;
+    } else if (dec == DECODE_TIMESTAMPTZ) {
+        return false;
+    }
+
+    if (c != end)
+        return false;
+
+    time = ((int64) (hour * MINS_PER_HOUR + min) * SECS_PER_MINUTE + sec) * USECS_PER_SEC + fsec;
+
+    switch (dec) {
+    case DECODE_TIME:
+        *result = TimeADTGetDatum(time);
+        break;
+    case DECODE_TIMESTAMP:
+        date = date2j(year, mon, mday) - POSTGRES_EPOCH_JDATE;
+        *result = TimestampGetDatum(date * USECS_PER_DAY + time);
+        break;
+    case DECODE_TIMESTAMPTZ:
+        date = date2j(year, mon, mday) - POSTGRES_EPOCH_JDATE;
+        *result = TimestampTzGetDatum(date * USECS_PER_DAY + time - offset);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Store a scalar value of a column with the column's own
+ * decoder, straight from the response. False when the column has none
+ * or it couldn't make sense of the value, store_datum handles those.
+ */
+static bool store_decoded(parser *p, const char *value, size_t len) {
+    int i;
+    int64 ival;
+    Datum datum;
+
+    (void) get_column(p);       /* errors out when there's no column */
+    i = p->cur_col;
+
+    switch (p->decoders[i]) {
+    case DECODE_INT2:
+    case DECODE_INT4:
+        /* Sometimes we get floats with .0 from quasar for ints */
+        if (len > 2 && value[len - 2] == '.' && value[len - 1] == '0')
+            len -= 2;
+        if (p->decoders[i] == DECODE_INT2) {
+            if (!decode_integer(value, len, PG_INT16_MIN, PG_INT16_MAX, &ival))
+                return false;
+            datum = Int16GetDatum((int16) ival);
+        } else {
+            if (!decode_integer(value, len, PG_INT32_MIN, PG_INT32_MAX, &ival))
+                return false;
+            datum = Int32GetDatum((int32) ival);
+        }
+        break;
+    case DECODE_INT8:
+        if (!decode_integer(value, len, PG_INT64_MIN, PG_INT64_MAX, &ival))
+            return false;
+        datum = Int64GetDatum(ival);
+        break;
+    case DECODE_OID:
+        if (!decode_integer(value, len, 0, PG_UINT32_MAX, &ival))
+            return false;
+        datum = ObjectIdGetDatum((Oid) ival);
+        break;
+    case DECODE_FLOAT4:
+    case DECODE_FLOAT8:
+        if (!decode_float(value, len, p->decoders[i] == DECODE_FLOAT4, &datum))
+            return false;
+        break;
+    case DECODE_BOOL:
+        if (len == 4 && memcmp(value, "true", 4) == 0)
+            datum = BoolGetDatum(true);
+        else if (len == 5 && memcmp(value, "false", 5) == 0)
+            datum = BoolGetDatum(false);
+        else
+            return false;
+        break;
+    case DECODE_TEXT:
+    case DECODE_VARCHAR:
+    case DECODE_BPCHAR:
+        if (!decode_string(value, len, p->decoders[i],
+                           p->attinmeta->atttypmods[i], &datum))
+            return false;
+        break;
+    case DECODE_DATE:
+    case DECODE_TIME:
+    case DECODE_TIMESTAMP:
+    case DECODE_TIMESTAMPTZ:
+        if (!decode_datetime(value, len, p->decoders[i], &datum))
+            return false;
+        break;
+    default:
+        return false;
+    }
+
+    p->record_started = true;
+    p->values[i] = datum;
+    p->nulls[i] = false;
+    return true;
+}
+
 static Form_pg_attribute get_column(parser *p) {
     if (p->cur_col != NO_COLUMN && p->cur_col < p->attinmeta->tupdesc->natts) {
-        return p->attinmeta->tupdesc->attrs[p->cur_col];
+        return TupleDescAttr(p->attinmeta->tupdesc, p->cur_col);
     } else {
         elog(ERROR, "quasar_fdw internal: Got a value when no column specified!");
     }
@@ -227,7 +750,12 @@ static int cb_null(void * ctx) {
 }
 
 static int cb_boolean(void * ctx, int boolean) {
-    store_datum((parser*) ctx, boolean ? "true" : "false", "%s");
+    parser *p = (parser*) ctx;
+    const char *s = boolean ? "true" : "false";
+
+    if (p->level == COLUMN_LEVEL && store_decoded(p, s, strlen(s)))
+        return YAJL_OK;
+    store_datum(p, (char *) s, "%s");
     return YAJL_OK;
 }
 
@@ -235,8 +763,12 @@ static int cb_boolean(void * ctx, int boolean) {
 static int cb_string(void * ctx,
                     const unsigned char * value,
                     size_t len) {
+    parser *p = (parser*) ctx;
     char * s;
 
+    if (p->level == COLUMN_LEVEL && store_decoded(p, (const char *) value, len))
+        return YAJL_OK;
+
     s = pnstrdup((const char *)value, len);
     store_datum((parser*) ctx, s, "\"%s\"");
     pfree(s);
@@ -246,8 +778,12 @@ static int cb_string(void * ctx,
 static int cb_number(void * ctx,
                      const char * value,
                      size_t len) {
+    parser *p = (parser*) ctx;
     char * s;
 
+    if (p->level == COLUMN_LEVEL && store_decoded(p, value, len))
+        return YAJL_OK;
+
     s = pnstrdup(value, len);
     store_datum((parser*) ctx, s, "%s");
     pfree(s);
@@ -258,32 +794,24 @@ static int cb_map_key(void * ctx,
                       const unsigned char * stringVal,
                       size_t stringLen) {
     parser *p;
-    size_t i;
-    char * s;
 
     p = (parser*) ctx;
-    s = pnstrdup((const char*) stringVal, stringLen);
     if (p->level == COLUMN_LEVEL) {
         /* Find the column */
-        p->cur_col = NO_COLUMN;
-        for (i = 0; i < p->attinmeta->tupdesc->natts; ++i) {
-            if (strcmp(s, NameStr(p->attinmeta->tupdesc->attrs[i]->attname)) == 0)
-            {
-                p->cur_col = i;
-                break;
-            }
-        }
+        p->cur_col = column_of_key(p, (const char *) stringVal, stringLen);
 
         /* This is OK if we did a SELECT NULL */
         if (p->cur_col == NO_COLUMN)
-            elog(DEBUG3, "quasar_fdw internal: Couldnt find column for returned field: %s", s);
+            elog(DEBUG3, "quasar_fdw internal: Couldnt find column for returned field: %.*s",
+                 (int) stringLen, stringVal);
     } else if (p->level > COLUMN_LEVEL) {
         if (is_json_type(p)) {
             jsonAppendCommaIf(p);
-            appendStringInfo(&p->json, "\"%s\":", s);
+            appendStringInfoChar(&p->json, '"');
+            appendBinaryStringInfo(&p->json, (const char *) stringVal, stringLen);
+            appendStringInfoString(&p->json, "\":");
         }
     }
-    pfree(s);
     return YAJL_OK;
 }
 
@@ -292,9 +820,9 @@ static int cb_start_map(void * ctx) {
     int i;
 
     p = (parser*) ctx;
-    if (p->level == TOP_LEVEL && p->record_complete) {
-        return YAJL_CANCEL;
-    } else if (p->level == TOP_LEVEL) {
+    if (p->level == TOP_LEVEL) {
+        p->key_pos = 0;
+
         /* Reset our values */
         for (i = 0; i < p->attinmeta->tupdesc->natts; ++i)
         {
@@ -407,13 +935,14 @@ static yajl_callbacks callbacks = {
     cb_end_array
 };
 
-/* Yajl alloc functions use palloc */
+/* Yajl alloc functions use palloc, in the context the parser was made in,
+ * since rows are parsed in whatever context the executor is using */
 void *yajl_palloc(void *ctx, size_t sz) {
-    return palloc(sz);
+    return MemoryContextAlloc((MemoryContext) ctx, sz);
 }
 void *yajl_repalloc(void *ctx, void *ptr, size_t sz) {
     if (ptr == NULL)
-        return palloc(sz);
+        return MemoryContextAlloc((MemoryContext) ctx, sz);
     else
         return repalloc(ptr, sz);
 }
@@ -421,11 +950,11 @@ void yajl_pfree(void *ctx, void *ptr) {
     if (ptr != NULL)
         return pfree(ptr);
 }
-static yajl_alloc_funcs allocs = {yajl_palloc, yajl_repalloc, yajl_pfree, NULL};
 
 
 void quasar_parse_alloc(quasar_parse_context *ctx, Relation rel) {
     parser *p;
+    yajl_alloc_funcs allocs = {yajl_palloc, yajl_repalloc, yajl_pfree, NULL};
     elog(DEBUG4, "entering function %s", __func__);
 
     p = palloc(sizeof(parser));
@@ -435,8 +964,10 @@ void quasar_parse_alloc(quasar_parse_context *ctx, Relation rel) {
     p->record_started = false;
     p->rel = rel;
     p->attinmeta = TupleDescGetAttInMetadata(RelationGetDescr(rel));
-    p->values = palloc(p->attinmeta->tupdesc->natts * sizeof(Datum));
-    p->nulls = palloc(p->attinmeta->tupdesc->natts * sizeof(bool));
+    p->values = NULL;
+    p->nulls = NULL;
+    build_key_index(p);
+    build_decoders(p);
     p->warned = 0;
     p->errcallback.callback = conversion_error_callback;
     p->errcallback.arg = (void *)p;
@@ -445,6 +976,7 @@ void quasar_parse_alloc(quasar_parse_context *ctx, Relation rel) {
     initStringInfo(&p->array);
     ctx->p = p;
     ctx->handle = NULL;
+    allocs.ctx = CurrentMemoryContext;
     ctx->handle = yajl_alloc(&callbacks, &allocs, p);
     yajl_config(ctx->handle, yajl_allow_multiple_values, 1);
     yajl_parse(ctx->handle, NULL, 0); /* Allocate the lexer inside yajl */
@@ -455,11 +987,18 @@ void quasar_parse_free(quasar_parse_context *ctx) {
     yajl_free(ctx->handle);
     pfree(((parser*)ctx->p)->json.data);
     pfree(((parser*)ctx->p)->array.data);
-    pfree(((parser*)ctx->p)->values);
-    pfree(((parser*)ctx->p)->nulls);
+    pfree(((parser*)ctx->p)->key_names);
+    pfree(((parser*)ctx->p)->key_lens);
+    pfree(((parser*)ctx->p)->key_hash);
+    pfree(((parser*)ctx->p)->key_order);
+    pfree(((parser*)ctx->p)->decoders);
     pfree(ctx->p);
 }
 
+/*
+ * Get ready for a new response. yajl itself carries on: it's only ever
+ * given whole rows, so it is always between two of them.
+ */
 void quasar_parse_reset(quasar_parse_context *ctx) {
     parser *p;
     elog(DEBUG4, "entering function %s", __func__);
@@ -471,93 +1010,45 @@ void quasar_parse_reset(quasar_parse_context *ctx) {
     p->warned = false;
     resetStringInfo(&p->json);
     resetStringInfo(&p->array);
-    yajl_reset(ctx->handle);
 }
 
-int
+/*
+ * Parse one complete row of the response into values and nulls, one of
+ * each per column of the relation, with the values in CurrentMemoryContext.
+ * record is the row's JSON object, maybe with whitespace before it.
+ * yajl's lexer keeps going from one row to the next, the row is done
+ * when cb_end_map gets back to the top level.
+ */
+void
 quasar_parse(quasar_parse_context *ctx,
-             const char *buffer,
-             size_t *buf_loc,
-             size_t buf_size,
-             HeapTuple *tuple)
+             const char *record,
+             size_t size,
+             Datum *values,
+             bool *nulls)
 {
-    int ret;
     parser *p;
     yajl_status status;
     yajl_handle hand;
-    size_t bytes;
 
     elog(DEBUG4, "entering function %s", __func__);
 
-    ret = P_NO_RECORD;
     p = (parser*) ctx->p;
     hand = ctx->handle;
+    p->values = values;
+    p->nulls = nulls;
 
-    if (*buf_loc < buf_size) {
-        /* Response is formed as many json objects
-         * So we can just parse until a full one is completed
-         * and pick it up where we left off next time.
-         * We do this by only parsing until
-         * the beginning of the second object and stepping back one */
-
-        status = yajl_parse(hand,
-                            (const unsigned char *)buffer + *buf_loc,
-                            buf_size - *buf_loc);
-        bytes = yajl_get_bytes_consumed(hand);
-
-        if (status == yajl_status_error) {
-            unsigned char *errstr =
-                yajl_get_error(hand, 1,
-                               (const unsigned char *)buffer + *buf_loc,
-                               buf_size - *buf_loc);
-            elog(ERROR, "quasar_fdw internal: Error parsing json: %s", errstr);
-        } else if (status == yajl_status_client_canceled) {
-            bytes--;
-            yajl_reset(ctx->handle);
-        }
-
-        elog(DEBUG3, "Consumed %lu bytes of json. %s record",
-             bytes,
-             p->record_complete ? "found" : "didnt find");
-
-        if (p->record_complete)
-            ret = P_RECORD_COMPLETE;
-        else if (p->record_started)
-            ret = P_RECORD_STARTED;
-
-        *buf_loc += bytes;
-        p->record_complete = p->record_started = false;
-    }
+    status = yajl_parse(hand, (const unsigned char *) record, size);
 
-    if (ret == P_RECORD_COMPLETE) {
-        *tuple = heap_form_tuple(p->attinmeta->tupdesc, p->values, p->nulls);
+    if (status == yajl_status_error) {
+        unsigned char *errstr =
+            yajl_get_error(hand, 1, (const unsigned char *) record, size);
+        elog(ERROR, "quasar_fdw internal: Error parsing json: %s", errstr);
     }
+    if (!p->record_complete)
+        elog(ERROR, "quasar_fdw internal: Incomplete record in json: %.*s",
+             (int) size, record);
 
-    return ret;
-}
-
-/*
- * Copy the values currently stored in the parse context into newly
- * reallocated space. This is called shortly before the old space is
- * reset.
- */
-void
-quasar_copy_parse_context(quasar_parse_context *ctx)
-{
-    parser *p;
-    int i;
-    Form_pg_attribute col;
-
-    p = (parser*) ctx->p;
-
-    for (i = 0; i < p->attinmeta->tupdesc->natts; i++)
-    {
-        if (p->nulls[i] == true)
-            continue;
-
-        col = p->attinmeta->tupdesc->attrs[i];
-        p->values[i] = datumCopy(p->values[i], col->attbyval, col->attlen);
-    }
+    p->record_complete = p->record_started = false;
 }
 
 
@@ -575,6 +1066,6 @@ conversion_error_callback(void *arg)
     tupdesc = p->attinmeta->tupdesc;
     if (p->cur_col < tupdesc->natts)
         errcontext("column \"%s\" of foreign table \"%s\"",
-                   NameStr(tupdesc->attrs[p->cur_col]->attname),
+                   NameStr(TupleDescAttr(tupdesc, p->cur_col)->attname),
                    RelationGetRelationName(p->rel));
 }
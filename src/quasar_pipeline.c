@@ -0,0 +1,600 @@
+/*-------------------------------------------------------------------------
+ *
+ * Quasar Foreign Data Wrapper for PostgreSQL
+ *
+ * Copyright (c) 2015 SlamData Inc
+ *
+ * This software is released under the Apache 2 license
+ *
+ * Author: Jon Eisen <jon@joneisen.works>
+ *
+ * IDENTIFICATION
+ *            quasar_fdw/src/quasar_pipeline.c
+ *
+ * Pipelined scans
+ *
+ * With the pipeline option a scan's transfer runs on a helper thread:
+ * it receives and inflates the response into a single-producer/
+ * single-consumer ring of bytes, and frames it into records, finding
+ * where each one ends, which it puts in a second ring. The backend
+ * copies the bytes out and takes the records as they are, without
+ * looking at the bytes again, so network, decompression and framing
+ * work overlap with the executor.
+ *
+ * The thread must never touch PostgreSQL: no palloc, no elog, no
+ * latches. It has all signals blocked, talks to the backend through
+ * atomics on the rings and wakes it through a pipe, which the backend
+ * waits on together with its latch. Parsing a record into a tuple stays
+ * on the backend: values are decoded straight into the executor's slot
+ * when it asks for the row, and allocated with palloc.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "quasar_fdw.h"
+
+#include "miscadmin.h"
+#include "utils/memutils.h"
+
+#if (PG_VERSION_NUM >= 90500)
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "storage/latch.h"
+
+struct QuasarPipeline
+{
+    CURL *curl;
+    pthread_t thread;
+    SubTransactionId subid;     /* of the scan, see QuasarPipelineStopSub */
+
+    char *ring;                 /* PIPELINE_RING_SIZE bytes, malloc'd */
+    pg_atomic_uint32 head;      /* bytes ever written, by the thread */
+    pg_atomic_uint32 tail;      /* bytes ever read, by the backend */
+
+    uint32 *ends;               /* PIPELINE_RECORDS ring of where records
+                                 * end, in bytes ever written, malloc'd */
+    pg_atomic_uint32 ends_head; /* records ever framed, by the thread */
+    pg_atomic_uint32 ends_tail; /* records ever taken, by the backend */
+
+    pg_atomic_uint32 status;    /* HTTP status, 0 until known */
+    pg_atomic_uint32 done;      /* set once the transfer is over */
+    pg_atomic_uint32 stop;      /* set by the backend to abort it */
+    CURLcode result;            /* how it ended, valid once done */
+
+    /* Where framing got to, only the thread's */
+    int depth;                  /* of objects and arrays */
+    bool in_string;
+    bool escaped;
+
+    pthread_mutex_t mutex;      /* and space, for waiting on a full ring */
+    pthread_cond_t space;
+    int notify[2];              /* the thread wakes the backend with this */
+};
+
+/* Pipelines started by this backend, so an abort can stop them */
+static List *pipelines = NIL;
+
+static void *pipeline_main(void *arg);
+static void pipeline_notify(QuasarPipeline *pl);
+static bool pipeline_full(QuasarPipeline *pl);
+static bool pipeline_wait_for_space(QuasarPipeline *pl);
+static bool pipeline_frame(QuasarPipeline *pl, const char *data, size_t n, uint32 pos);
+static size_t pipeline_header_handler(void *buffer, size_t size, size_t nmemb, void *userp);
+static size_t pipeline_body_handler(void *buffer, size_t size, size_t nmemb, void *userp);
+static int pipeline_progress_handler(void *clientp,
+                                     curl_off_t dltotal, curl_off_t dlnow,
+                                     curl_off_t ultotal, curl_off_t ulnow);
+
+/*
+ * Start performing curl on a helper thread.
+ * The handle belongs to the thread until QuasarPipelineStop.
+ */
+extern QuasarPipeline *
+QuasarPipelineStart(CURL *curl, SubTransactionId subid)
+{
+    QuasarPipeline *pl;
+    sigset_t all, old;
+    int rc;
+    MemoryContext oldcontext;
+
+    pl = calloc(1, sizeof(QuasarPipeline));
+    if (pl == NULL)
+        elog(ERROR, "quasar_fdw: out of memory");
+    pl->ring = malloc(PIPELINE_RING_SIZE);
+    pl->ends = malloc(PIPELINE_RECORDS * sizeof(uint32));
+    if (pl->ring == NULL || pl->ends == NULL)
+    {
+        free(pl->ends);
+        free(pl->ring);
+        free(pl);
+        elog(ERROR, "quasar_fdw: out of memory");
+    }
+    if (pipe(pl->notify) != 0)
+    {
+        free(pl->ends);
+        free(pl->ring);
+        free(pl);
+        elog(ERROR, "quasar_fdw: could not create pipe: %m");
+    }
+    fcntl(pl->notify[0], F_SETFL, O_NONBLOCK);
+    fcntl(pl->notify[1], F_SETFL, O_NONBLOCK);
+
+    pl->curl = curl;
+    pl->subid = subid;
+    pg_atomic_init_u32(&pl->head, 0);
+    pg_atomic_init_u32(&pl->tail, 0);
+    pg_atomic_init_u32(&pl->ends_head, 0);
+    pg_atomic_init_u32(&pl->ends_tail, 0);
+    pg_atomic_init_u32(&pl->status, 0);
+    pg_atomic_init_u32(&pl->done, 0);
+    pg_atomic_init_u32(&pl->stop, 0);
+    pl->result = CURLE_OK;
+    pthread_mutex_init(&pl->mutex, NULL);
+    pthread_cond_init(&pl->space, NULL);
+
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, pipeline_header_handler);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, pl);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, pipeline_body_handler);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, pl);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, pipeline_progress_handler);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, pl);
+
+    oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+    pipelines = lappend(pipelines, pl);
+    MemoryContextSwitchTo(oldcontext);
+
+    /* Signals are for the backend, the thread inherits this mask */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    rc = pthread_create(&pl->thread, NULL, pipeline_main, pl);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (rc != 0)
+    {
+        pipelines = list_delete_ptr(pipelines, pl);
+        close(pl->notify[0]);
+        close(pl->notify[1]);
+        pthread_cond_destroy(&pl->space);
+        pthread_mutex_destroy(&pl->mutex);
+        free(pl->ends);
+        free(pl->ring);
+        free(pl);
+        elog(ERROR, "quasar_fdw: could not start pipeline thread: %s", strerror(rc));
+    }
+
+    elog(DEBUG1, "quasar_fdw: started pipeline thread");
+
+    return pl;
+}
+
+/*
+ * Abort the transfer if it's still going, wait for the thread
+ * and free everything. The curl handle is the backend's again.
+ */
+extern void
+QuasarPipelineStop(QuasarPipeline *pl)
+{
+    pg_atomic_write_u32(&pl->stop, 1);
+    pthread_mutex_lock(&pl->mutex);
+    pthread_cond_signal(&pl->space);
+    pthread_mutex_unlock(&pl->mutex);
+
+    pthread_join(pl->thread, NULL);
+
+    elog(DEBUG1, "quasar_fdw: stopped pipeline thread (%u records)",
+         pg_atomic_read_u32(&pl->ends_head));
+
+    pipelines = list_delete_ptr(pipelines, pl);
+    close(pl->notify[0]);
+    close(pl->notify[1]);
+    pthread_cond_destroy(&pl->space);
+    pthread_mutex_destroy(&pl->mutex);
+    free(pl->ends);
+    free(pl->ring);
+    free(pl);
+}
+
+/* Stop every pipeline left behind by an error, before their handles go */
+extern void
+QuasarPipelineStopAll(void)
+{
+    while (pipelines != NIL)
+        QuasarPipelineStop((QuasarPipeline *) linitial(pipelines));
+}
+
+/* Stop the pipelines of scans started in an aborted subtransaction */
+extern void
+QuasarPipelineStopSub(SubTransactionId subid)
+{
+    ListCell *lc;
+    List *running;
+
+    /* QuasarPipelineStop takes pipelines off the list */
+    running = list_copy(pipelines);
+    foreach(lc, running)
+    {
+        QuasarPipeline *pl = (QuasarPipeline *) lfirst(lc);
+
+        if (pl->subid >= subid)
+            QuasarPipelineStop(pl);
+    }
+    list_free(running);
+}
+
+/*
+ * Contiguous bytes ready to be read from the ring.
+ * Once done is seen set, everything written before it can be peeked.
+ */
+extern size_t
+QuasarPipelinePeek(QuasarPipeline *pl, const char **data)
+{
+    uint32 head, tail, off;
+
+    head = pg_atomic_read_u32(&pl->head);
+    pg_read_barrier();
+    tail = pg_atomic_read_u32(&pl->tail);
+    off = tail & (PIPELINE_RING_SIZE - 1);
+
+    *data = pl->ring + off;
+    return Min(head - tail, PIPELINE_RING_SIZE - off);
+}
+
+/* Give bytes back to the thread */
+extern void
+QuasarPipelineConsume(QuasarPipeline *pl, size_t bytes)
+{
+    /* Done reading them before the thread may overwrite them */
+    pg_memory_barrier();
+    pg_atomic_write_u32(&pl->tail, pg_atomic_read_u32(&pl->tail) + bytes);
+
+    pthread_mutex_lock(&pl->mutex);
+    pthread_cond_signal(&pl->space);
+    pthread_mutex_unlock(&pl->mutex);
+}
+
+/*
+ * Take up to max of the records the thread has framed which end in bytes
+ * already consumed. For each, oldest first, behind says how many of the
+ * bytes consumed so far come after its end.
+ */
+extern int
+QuasarPipelineTakeRecords(QuasarPipeline *pl, uint32 *behind, int max)
+{
+    uint32 head, tail, consumed;
+    int n = 0;
+
+    head = pg_atomic_read_u32(&pl->ends_head);
+    pg_read_barrier();
+    tail = pg_atomic_read_u32(&pl->ends_tail);
+    consumed = pg_atomic_read_u32(&pl->tail);
+
+    while (n < max && tail != head)
+    {
+        uint32 end = pl->ends[tail & (PIPELINE_RECORDS - 1)];
+
+        /* Framed once written, which may be before they're consumed */
+        if ((int32) (consumed - end) < 0)
+            break;
+        behind[n++] = consumed - end;
+        ++tail;
+    }
+
+    if (n > 0)
+    {
+        pg_memory_barrier();
+        pg_atomic_write_u32(&pl->ends_tail, tail);
+
+        pthread_mutex_lock(&pl->mutex);
+        pthread_cond_signal(&pl->space);
+        pthread_mutex_unlock(&pl->mutex);
+    }
+    return n;
+}
+
+/* HTTP status of the response, 0 until it came in */
+extern int
+QuasarPipelineStatus(QuasarPipeline *pl)
+{
+    return (int) pg_atomic_read_u32(&pl->status);
+}
+
+/* Whether the transfer is over, and how */
+extern bool
+QuasarPipelineDone(QuasarPipeline *pl, CURLcode *result)
+{
+    if (pg_atomic_read_u32(&pl->done) == 0)
+        return false;
+
+    pg_read_barrier();
+    *result = pl->result;
+    return true;
+}
+
+/*
+ * Sleep until the thread has something for us, timeout_ms have passed
+ * or our latch is set. Interrupts are serviced before returning.
+ */
+extern void
+QuasarPipelineWait(QuasarPipeline *pl, long timeout_ms)
+{
+    char buf[64];
+    int rc;
+
+#if (PG_VERSION_NUM >= 100000)
+    rc = WaitLatchOrSocket(MyLatch,
+                           WL_LATCH_SET | WL_SOCKET_READABLE | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                           pl->notify[0], timeout_ms, PG_WAIT_EXTENSION);
+#else
+    rc = WaitLatchOrSocket(MyLatch,
+                           WL_LATCH_SET | WL_SOCKET_READABLE | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                           pl->notify[0], timeout_ms);
+#endif
+
+    if (rc & WL_POSTMASTER_DEATH)
+        ereport(FATAL,
+                (errcode(ERRCODE_ADMIN_SHUTDOWN),
+                 errmsg("terminating connection due to unexpected postmaster exit")));
+    if (rc & WL_LATCH_SET)
+        ResetLatch(MyLatch);
+
+    CHECK_FOR_INTERRUPTS();
+
+    /* The caller looks at the ring next, so no wakeup gets lost */
+    while (read(pl->notify[0], buf, sizeof(buf)) > 0)
+        ;
+}
+
+/*
+ * Helper thread functions.
+ * Nothing below may call into PostgreSQL.
+ */
+
+static void *
+pipeline_main(void *arg)
+{
+    QuasarPipeline *pl = (QuasarPipeline *) arg;
+
+    pl->result = curl_easy_perform(pl->curl);
+
+    pg_write_barrier();
+    pg_atomic_write_u32(&pl->done, 1);
+    pipeline_notify(pl);
+
+    return NULL;
+}
+
+static void
+pipeline_notify(QuasarPipeline *pl)
+{
+    char c = 0;
+
+    /* A full pipe already means the backend will wake up */
+    if (write(pl->notify[1], &c, 1) < 0)
+        return;
+}
+
+/* Whether either ring is full */
+static bool
+pipeline_full(QuasarPipeline *pl)
+{
+    return pg_atomic_read_u32(&pl->head) - pg_atomic_read_u32(&pl->tail) == PIPELINE_RING_SIZE ||
+        pg_atomic_read_u32(&pl->ends_head) - pg_atomic_read_u32(&pl->ends_tail) == PIPELINE_RECORDS;
+}
+
+/* Block until the backend frees some of the rings. False if stopping. */
+static bool
+pipeline_wait_for_space(QuasarPipeline *pl)
+{
+    struct timespec deadline;
+
+    /* Make sure the backend knows there's a full ring to read */
+    pipeline_notify(pl);
+
+    pthread_mutex_lock(&pl->mutex);
+    while (pipeline_full(pl) && pg_atomic_read_u32(&pl->stop) == 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_cond_timedwait(&pl->space, &pl->mutex, &deadline);
+    }
+    pthread_mutex_unlock(&pl->mutex);
+
+    return pg_atomic_read_u32(&pl->stop) == 0;
+}
+
+static size_t
+pipeline_header_handler(void *buffer, size_t size, size_t nmemb, void *userp)
+{
+    QuasarPipeline *pl = (QuasarPipeline *) userp;
+    size_t segsize = size * nmemb;
+    int status;
+
+    /* Skip interim responses like 100 Continue */
+    if (segsize > 5 && strncmp(buffer, "HTTP/", 5) == 0 &&
+        sscanf((char *) buffer, "HTTP/%*s %d", &status) == 1 &&
+        status >= 200)
+    {
+        pg_atomic_write_u32(&pl->status, (uint32) status);
+        pipeline_notify(pl);
+    }
+
+    return segsize;
+}
+
+/*
+ * Copy the response into the ring, blocking while it's full, and frame
+ * the records in it. The backend is woken up once a chunk completes a
+ * record or the ring is half full.
+ */
+static size_t
+pipeline_body_handler(void *buffer, size_t size, size_t nmemb, void *userp)
+{
+    QuasarPipeline *pl = (QuasarPipeline *) userp;
+    size_t segsize = size * nmemb, written = 0;
+    uint32 records = pg_atomic_read_u32(&pl->ends_head);
+
+    /* Bad responses are reported by status, their body isn't wanted */
+    if (pg_atomic_read_u32(&pl->status) != 200)
+        return segsize;
+
+    while (written < segsize)
+    {
+        uint32 head = pg_atomic_read_u32(&pl->head);
+        uint32 tail = pg_atomic_read_u32(&pl->tail);
+        uint32 off = head & (PIPELINE_RING_SIZE - 1);
+        size_t n;
+
+        if (head - tail == PIPELINE_RING_SIZE)
+        {
+            if (!pipeline_wait_for_space(pl))
+                return 0;       /* aborts the transfer */
+            continue;
+        }
+
+        /* The backend must be done with this space before we write it */
+        pg_memory_barrier();
+
+        n = Min(segsize - written, PIPELINE_RING_SIZE - (head - tail));
+        n = Min(n, PIPELINE_RING_SIZE - off);
+        memcpy(pl->ring + off, (char *) buffer + written, n);
+
+        /* Written before they're framed, so the backend can always
+         * consume the bytes of the records it's waiting for */
+        pg_write_barrier();
+        pg_atomic_write_u32(&pl->head, head + n);
+        written += n;
+
+        if (!pipeline_frame(pl, pl->ring + off, n, head))
+            return 0;           /* aborts the transfer */
+    }
+
+    if (pg_atomic_read_u32(&pl->ends_head) != records ||
+        pg_atomic_read_u32(&pl->head) - pg_atomic_read_u32(&pl->tail) >= PIPELINE_RING_SIZE / 2)
+        pipeline_notify(pl);
+
+    return segsize;
+}
+
+/*
+ * Find where records end in n bytes written at pos: where the nesting of
+ * objects and arrays, outside of strings, gets back to the top level.
+ * Blocks while the ring of ends is full. False if stopping.
+ */
+static bool
+pipeline_frame(QuasarPipeline *pl, const char *data, size_t n, uint32 pos)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i)
+    {
+        char c = data[i];
+
+        if (pl->in_string)
+        {
+            if (pl->escaped)
+                pl->escaped = false;
+            else if (c == '\\')
+                pl->escaped = true;
+            else if (c == '"')
+                pl->in_string = false;
+        }
+        else if (c == '"')
+            pl->in_string = true;
+        else if (c == '{' || c == '[')
+            ++pl->depth;
+        else if ((c == '}' || c == ']') && --pl->depth == 0)
+        {
+            uint32 head = pg_atomic_read_u32(&pl->ends_head);
+
+            while (head - pg_atomic_read_u32(&pl->ends_tail) == PIPELINE_RECORDS)
+            {
+                if (!pipeline_wait_for_space(pl))
+                    return false;
+            }
+            pl->ends[head & (PIPELINE_RECORDS - 1)] = pos + (uint32) i + 1;
+            pg_write_barrier();
+            pg_atomic_write_u32(&pl->ends_head, head + 1);
+        }
+    }
+    return true;
+}
+
+static int
+pipeline_progress_handler(void *clientp,
+                          curl_off_t dltotal, curl_off_t dlnow,
+                          curl_off_t ultotal, curl_off_t ulnow)
+{
+    QuasarPipeline *pl = (QuasarPipeline *) clientp;
+
+    return pg_atomic_read_u32(&pl->stop) != 0;
+}
+
+#else /* PG_VERSION_NUM < 90500 */
+
+/*
+ * No atomics or latches to build the pipeline on: scans fall back
+ * to the shared multi handle.
+ */
+extern QuasarPipeline *
+QuasarPipelineStart(CURL *curl, SubTransactionId subid)
+{
+    return NULL;
+}
+
+extern void
+QuasarPipelineStop(QuasarPipeline *pl)
+{
+}
+
+extern void
+QuasarPipelineStopAll(void)
+{
+}
+
+extern void
+QuasarPipelineStopSub(SubTransactionId subid)
+{
+}
+
+extern size_t
+QuasarPipelinePeek(QuasarPipeline *pl, const char **data)
+{
+    return 0;
+}
+
+extern void
+QuasarPipelineConsume(QuasarPipeline *pl, size_t bytes)
+{
+}
+
+extern int
+QuasarPipelineTakeRecords(QuasarPipeline *pl, uint32 *behind, int max)
+{
+    return 0;
+}
+
+extern int
+QuasarPipelineStatus(QuasarPipeline *pl)
+{
+    return 0;
+}
+
+extern bool
+QuasarPipelineDone(QuasarPipeline *pl, CURLcode *result)
+{
+    return true;
+}
+
+extern void
+QuasarPipelineWait(QuasarPipeline *pl, long timeout_ms)
+{
+}
+
+#endif /* PG_VERSION_NUM */
@@ -0,0 +1,452 @@
+/*-------------------------------------------------------------------------
+ *
+ * Quasar Foreign Data Wrapper for PostgreSQL
+ *
+ * Copyright (c) 2015 SlamData Inc
+ *
+ * This software is released under the Apache 2 license
+ *
+ * Author: Jon Eisen <jon@joneisen.works>
+ *
+ * IDENTIFICATION
+ *            quasar_fdw/src/quasar_pool.c
+ *
+ * Per-backend pool of curl handles
+ *
+ * Each Quasar server gets one pool, keyed by its `server`, `socket_path`
+ * and TLS options. A pool keeps curl easy handles alive across scans,
+ * rescans, estimates and compiles, so their keep-alive connections can be
+ * reused instead of paying TCP, TLS and DNS setup on every request. All
+ * handles of a pool share one CURLSH holding the DNS cache and TLS
+ * sessions (and, where libcurl supports it, the connection cache), so
+ * even a new connection only needs an abbreviated TLS handshake. libcurl
+ * doesn't support sharing connections between threads, so while a
+ * pipelined scan's handle runs on its own thread it uses a second share
+ * without them.
+ *
+ * A foreign server may list several endpoints in its `server` option,
+ * each of which gets its own pool. Pools also track the health of their
+ * endpoint: after BREAKER_FAILURES failed requests in a row the endpoint
+ * is avoided for BREAKER_OPEN_MS, after which one request may try it
+ * again. QuasarPoolChoose picks the healthy endpoint with the fewest
+ * handles checked out, i.e. the fewest outstanding requests from this
+ * backend.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "quasar_fdw.h"
+
+#include <time.h>
+
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+/* A handle in a pool, either idle or checked out by a QuasarConn */
+typedef struct QuasarPoolHandle
+{
+    CURL *curl;
+    bool in_use;
+    time_t last_used;           /* When the handle was last released */
+} QuasarPoolHandle;
+
+/* All pools of this backend, allocated in TopMemoryContext */
+static List *pools = NIL;
+
+static void pool_set_defaults(QuasarPool *pool, CURL *curl);
+static CURLSH *pool_share_init(QuasarPool *pool);
+static void pool_share_lock(CURL *handle, curl_lock_data data,
+                            curl_lock_access access, void *userptr);
+static void pool_share_unlock(CURL *handle, curl_lock_data data, void *userptr);
+static void pool_evict_idle(QuasarPool *pool);
+static int pool_count_idle(QuasarPool *pool);
+static int pool_count_in_use(QuasarPool *pool);
+static bool pool_str_eq(const char *a, const char *b);
+static char *pool_strdup(const char *s);
+
+/*
+ * Find (or create) the pool for a server
+ * socket_path is NULL to connect over TCP.
+ */
+extern QuasarPool *
+QuasarPoolGet(const char *server, const char *socket_path,
+              const QuasarTls *tls, int max_connections)
+{
+    ListCell *lc;
+    QuasarPool *pool;
+    MemoryContext oldcontext;
+    int i;
+
+    foreach(lc, pools)
+    {
+        pool = (QuasarPool *) lfirst(lc);
+        if (strcmp(pool->server, server) == 0 &&
+            pool_str_eq(pool->socket_path, socket_path) &&
+            pool_str_eq(pool->tls.ca_file, tls->ca_file) &&
+            pool_str_eq(pool->tls.cert, tls->cert) &&
+            pool_str_eq(pool->tls.key, tls->key) &&
+            pool->tls.verify == tls->verify)
+        {
+            /* Pick up any ALTER SERVER since the pool was created */
+            pool->max_connections = max_connections;
+            return pool;
+        }
+    }
+
+    oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+    pool = palloc0(sizeof(QuasarPool));
+    pool->server = pstrdup(server);
+    pool->socket_path = pool_strdup(socket_path);
+    pool->tls.ca_file = pool_strdup(tls->ca_file);
+    pool->tls.cert = pool_strdup(tls->cert);
+    pool->tls.key = pool_strdup(tls->key);
+    pool->tls.verify = tls->verify;
+    pool->max_connections = max_connections;
+    pool->handles = NIL;
+    pool->post_stream = QUASAR_CAP_UNKNOWN;
+    pool->failures = 0;
+    pool->open_until = 0;
+
+    for (i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+        pthread_mutex_init(&pool->locks[i], NULL);
+
+    pool->share = pool_share_init(pool);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    /* Connection cache sharing appeared in curl 7.57.0 */
+    curl_share_setopt(pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+    pool->thread_share = pool_share_init(pool);
+
+    pools = lappend(pools, pool);
+
+    MemoryContextSwitchTo(oldcontext);
+
+    elog(DEBUG1, "quasar_fdw: created connection pool for %s%s%s", server,
+         socket_path != NULL ? " via " : "", socket_path != NULL ? socket_path : "");
+
+    return pool;
+}
+
+/*
+ * Pick the endpoint for a request out of a list of server URLs:
+ * the one with the fewest outstanding requests whose breaker is closed
+ * (or due for another try). exclude is skipped, for hedging to a second
+ * endpoint; NULL is returned if no other healthy one is left. Without
+ * exclude, an endpoint is always returned: if they're all failing, the
+ * one which has been avoided the longest.
+ */
+extern QuasarPool *
+QuasarPoolChoose(List *servers, const char *socket_path, const QuasarTls *tls,
+                 int max_connections, QuasarPool *exclude)
+{
+    ListCell *lc;
+    QuasarPool *best = NULL, *oldest = NULL;
+    int best_in_use = 0;
+    TimestampTz now = GetCurrentTimestamp();
+
+    foreach(lc, servers)
+    {
+        QuasarPool *pool = QuasarPoolGet((char *) lfirst(lc), socket_path, tls,
+                                         max_connections);
+        int in_use;
+
+        if (pool == exclude)
+            continue;
+
+        if (pool->open_until > now)
+        {
+            if (oldest == NULL || pool->open_until < oldest->open_until)
+                oldest = pool;
+            continue;
+        }
+
+        in_use = pool_count_in_use(pool);
+        if (best == NULL || in_use < best_in_use)
+        {
+            best = pool;
+            best_in_use = in_use;
+        }
+    }
+
+    if (best == NULL && exclude == NULL)
+        best = oldest;
+
+    return best;
+}
+
+/* A request to this endpoint went fine, close its breaker */
+extern void
+QuasarPoolReportSuccess(QuasarPool *pool)
+{
+    if (pool->failures > 0)
+        elog(DEBUG1, "quasar_fdw: %s is answering again", pool->server);
+    pool->failures = 0;
+    pool->open_until = 0;
+}
+
+/* A request to this endpoint failed or timed out */
+extern void
+QuasarPoolReportFailure(QuasarPool *pool)
+{
+    ++pool->failures;
+    if (pool->failures >= BREAKER_FAILURES)
+    {
+        elog(DEBUG1, "quasar_fdw: %s failed %d times in a row, avoiding it for %d ms",
+             pool->server, pool->failures, BREAKER_OPEN_MS);
+        pool->open_until = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                                       BREAKER_OPEN_MS);
+    }
+}
+
+/*
+ * Check out a handle from the pool, creating one if none are idle
+ */
+extern CURL *
+QuasarPoolAcquire(QuasarPool *pool)
+{
+    ListCell *lc;
+    QuasarPoolHandle *handle;
+    MemoryContext oldcontext;
+
+    pool_evict_idle(pool);
+
+    foreach(lc, pool->handles)
+    {
+        handle = (QuasarPoolHandle *) lfirst(lc);
+        if (!handle->in_use)
+        {
+            elog(DEBUG2, "quasar_fdw: reusing pooled handle for %s", pool->server);
+            handle->in_use = true;
+            return handle->curl;
+        }
+    }
+
+    oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+    handle = palloc0(sizeof(QuasarPoolHandle));
+    handle->curl = curl_easy_init();
+    handle->in_use = true;
+    pool->handles = lappend(pool->handles, handle);
+    MemoryContextSwitchTo(oldcontext);
+
+    if (handle->curl == NULL)
+        elog(ERROR, "quasar_fdw: could not create curl handle for %s", pool->server);
+
+    pool_set_defaults(pool, handle->curl);
+
+    elog(DEBUG2, "quasar_fdw: new pooled handle for %s (%d total)",
+         pool->server, list_length(pool->handles));
+
+    return handle->curl;
+}
+
+/*
+ * Return a handle to the pool.
+ * The handle keeps its connection open unless the pool already
+ * holds max_connections idle handles.
+ */
+extern void
+QuasarPoolRelease(QuasarPool *pool, CURL *curl)
+{
+    ListCell *lc;
+
+    foreach(lc, pool->handles)
+    {
+        QuasarPoolHandle *handle = (QuasarPoolHandle *) lfirst(lc);
+
+        if (handle->curl != curl)
+            continue;
+
+        if (pool_count_idle(pool) >= pool->max_connections)
+        {
+            elog(DEBUG2, "quasar_fdw: pool for %s is full, closing handle",
+                 pool->server);
+            curl_easy_cleanup(curl);
+            pool->handles = list_delete_ptr(pool->handles, handle);
+            pfree(handle);
+        }
+        else
+        {
+            QuasarPoolResetHandle(pool, curl);
+            handle->in_use = false;
+            handle->last_used = time(NULL);
+        }
+        return;
+    }
+
+    /* Not one of ours (should not happen), just get rid of it */
+    curl_easy_cleanup(curl);
+}
+
+/*
+ * Clear all options set on a handle by a previous request,
+ * keeping its cached connections.
+ */
+extern void
+QuasarPoolResetHandle(QuasarPool *pool, CURL *curl)
+{
+    curl_easy_reset(curl);
+    pool_set_defaults(pool, curl);
+}
+
+/*
+ * Close every handle still checked out.
+ * Called at transaction end: any scan that owned these either
+ * errored out or was never ended, so their state is unknown.
+ */
+extern void
+QuasarPoolReleaseAll(void)
+{
+    ListCell *lc;
+
+    foreach(lc, pools)
+    {
+        QuasarPool *pool = (QuasarPool *) lfirst(lc);
+        ListCell *hc;
+
+        quasar_foreach(hc, pool->handles)
+        {
+            QuasarPoolHandle *handle = (QuasarPoolHandle *) lfirst(hc);
+
+            if (handle->in_use)
+            {
+                elog(DEBUG1, "quasar_fdw: closing leaked handle for %s",
+                     pool->server);
+                curl_easy_cleanup(handle->curl);
+                pool->handles = quasar_foreach_delete_current(pool->handles, hc);
+                pfree(handle);
+            }
+        }
+    }
+}
+
+static void
+pool_set_defaults(QuasarPool *pool, CURL *curl)
+{
+    curl_easy_setopt(curl, CURLOPT_SHARE, pool->share);
+    /* Never let curl raise SIGALRM in a backend */
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, (long) pool->max_connections);
+    QuasarPoolSetTransport(pool, curl);
+}
+
+/*
+ * Have a handle of the pool use the share without connections, before it
+ * is handed to a pipeline thread. QuasarPoolRelease puts it back.
+ */
+extern void
+QuasarPoolSetThreaded(QuasarPool *pool, CURL *curl)
+{
+    curl_easy_setopt(curl, CURLOPT_SHARE, pool->thread_share);
+}
+
+/*
+ * Point a handle at the pool's server the way its options say: over its
+ * socket, with its TLS settings. Also for handles outside the pool which
+ * share its cache.
+ */
+extern void
+QuasarPoolSetTransport(QuasarPool *pool, CURL *curl)
+{
+    if (pool->socket_path != NULL)
+        curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, pool->socket_path);
+
+    if (pool->tls.ca_file != NULL)
+        curl_easy_setopt(curl, CURLOPT_CAINFO, pool->tls.ca_file);
+    if (pool->tls.cert != NULL)
+        curl_easy_setopt(curl, CURLOPT_SSLCERT, pool->tls.cert);
+    if (pool->tls.key != NULL)
+        curl_easy_setopt(curl, CURLOPT_SSLKEY, pool->tls.key);
+    if (!pool->tls.verify)
+    {
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+    }
+}
+
+/* A share of DNS and TLS sessions, which pipeline threads can use too */
+static CURLSH *
+pool_share_init(QuasarPool *pool)
+{
+    CURLSH *share = curl_share_init();
+
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, pool_share_lock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, pool_share_unlock);
+    curl_share_setopt(share, CURLSHOPT_USERDATA, pool);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    return share;
+}
+
+/* Pipelined scans use the thread share from their own thread */
+static void
+pool_share_lock(CURL *handle, curl_lock_data data,
+                curl_lock_access access, void *userptr)
+{
+    pthread_mutex_lock(&((QuasarPool *) userptr)->locks[data]);
+}
+
+static void
+pool_share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+    pthread_mutex_unlock(&((QuasarPool *) userptr)->locks[data]);
+}
+
+/* Close handles which have been idle for longer than POOL_IDLE_TIMEOUT_S */
+static void
+pool_evict_idle(QuasarPool *pool)
+{
+    ListCell *hc;
+    time_t now = time(NULL);
+
+    quasar_foreach(hc, pool->handles)
+    {
+        QuasarPoolHandle *handle = (QuasarPoolHandle *) lfirst(hc);
+
+        if (!handle->in_use &&
+            now - handle->last_used >= POOL_IDLE_TIMEOUT_S)
+        {
+            elog(DEBUG2, "quasar_fdw: evicting idle handle for %s", pool->server);
+            curl_easy_cleanup(handle->curl);
+            pool->handles = quasar_foreach_delete_current(pool->handles, hc);
+            pfree(handle);
+        }
+    }
+}
+
+static int
+pool_count_in_use(QuasarPool *pool)
+{
+    return list_length(pool->handles) - pool_count_idle(pool);
+}
+
+/* strcmp for options which may be unset */
+static bool
+pool_str_eq(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL)
+        return a == b;
+    return strcmp(a, b) == 0;
+}
+
+/* pstrdup for options which may be unset */
+static char *
+pool_strdup(const char *s)
+{
+    return s != NULL ? pstrdup(s) : NULL;
+}
+
+static int
+pool_count_idle(QuasarPool *pool)
+{
+    ListCell *lc;
+    int idle = 0;
+
+    foreach(lc, pool->handles)
+    {
+        if (!((QuasarPoolHandle *) lfirst(lc))->in_use)
+            ++idle;
+    }
+    return idle;
+}
@@ -0,0 +1,940 @@
+/*-------------------------------------------------------------------------
+ *
+ * Quasar Foreign Data Wrapper for PostgreSQL
+ *
+ * Copyright (c) 2015 SlamData Inc
+ *
+ * This software is released under the Apache 2 license
+ *
+ * Author: Jon Eisen <jon@joneisen.works>
+ *
+ * IDENTIFICATION
+ *            quasar_fdw/src/quasar_proxy.c
+ *
+ * Proxy background worker
+ *
+ * With quasar_fdw.proxy on (and quasar_fdw preloaded), a background
+ * worker keeps long-lived connections to every Quasar server, multiplexed
+ * over HTTP/2 where the server speaks it, and runs scans' GETs on them.
+ * That way short sessions (or sessions behind a pooler) get warm
+ * connections instead of opening their own.
+ *
+ * A backend puts its request into a DSM segment of its own, together
+ * with a shm_mq for the response, and hands the segment over through a
+ * slot in shared memory. The worker sends the response back as
+ * messages: a status, decompressed body chunks and an end marker.
+ * When the queue is full the worker pauses the transfer, so a scan
+ * whose batch is full pushes back on Quasar just like when it runs the
+ * transfer itself. A backend which loses interest flags the request
+ * cancelled and detaches.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+#include "quasar_fdw.h"
+
+#include "miscadmin.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+
+#if (PG_VERSION_NUM >= 90600)
+
+#include <sys/select.h>
+
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/shmem.h"
+
+/* Response messages, by their first byte */
+#define PROXY_MSG_STATUS 'S'        /* int32 HTTP status */
+#define PROXY_MSG_DATA 'D'          /* body bytes */
+#define PROXY_MSG_END 'E'           /* int32 CURLcode, uint64 bytes received */
+
+/* Request slots */
+#define PROXY_FREE 0
+#define PROXY_SUBMITTED 1
+#define PROXY_RUNNING 2
+
+typedef struct QuasarProxySlot
+{
+    int state;
+    dsm_handle handle;
+} QuasarProxySlot;
+
+typedef struct QuasarProxyShared
+{
+    LWLock *lock;
+    Latch *latch;               /* of the worker, NULL while it's not running */
+    QuasarProxySlot slots[PROXY_SLOTS];
+} QuasarProxyShared;
+
+/* Head of a request's DSM segment, followed by the response queue */
+typedef struct QuasarProxyRequest
+{
+    volatile bool cancelled;    /* set by the backend */
+    long connect_timeout_ms;
+    char compression[16];
+    char socket_path[MAXPGPATH];    /* empty for TCP */
+    char ssl_ca_file[MAXPGPATH];    /* empty ones are curl's default */
+    char ssl_cert[MAXPGPATH];
+    char ssl_key[MAXPGPATH];
+    bool ssl_verify;
+    char url[FLEXIBLE_ARRAY_MEMBER];
+} QuasarProxyRequest;
+
+/* Backend side of a proxied request */
+struct QuasarProxy
+{
+    dsm_segment *seg;
+    QuasarProxyRequest *req;
+    shm_mq_handle *mqh;
+    SubTransactionId subid;     /* of the scan */
+    int status;
+    bool done;
+    CURLcode result;
+    uint64 received;
+};
+
+/* Worker side of a proxied request */
+typedef struct ProxyTransfer
+{
+    int slot;
+    dsm_segment *seg;
+    QuasarProxyRequest *req;
+    shm_mq_handle *mqh;
+    CURL *curl;
+    StringInfoData pending;     /* message shm_mq_send is part way through */
+    bool paused;                /* curl holds data until pending is sent */
+    bool done;                  /* curl is done with it */
+    bool ending;                /* the end message is pending */
+    CURLcode result;
+} ProxyTransfer;
+
+static bool proxy_enabled = false;
+static QuasarProxyShared *proxy = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if (PG_VERSION_NUM >= 150000)
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+/* Requests of this backend, so an abort can cancel them */
+static List *requests = NIL;
+
+/* Worker state */
+static volatile sig_atomic_t got_sigterm = false;
+static CURLM *multi = NULL;
+static CURLSH *share = NULL;        /* TLS sessions, for every server */
+static List *transfers = NIL;
+
+PGDLLEXPORT void QuasarProxyMain(Datum arg);
+
+static void proxy_shmem_request(void);
+static void proxy_shmem_startup(void);
+static Size proxy_queue_offset(size_t url_len);
+static void proxy_sigterm(SIGNAL_ARGS);
+static void proxy_accept(void);
+static void proxy_start(int slot, dsm_handle handle);
+static bool proxy_send(ProxyTransfer *t, char kind, const void *data, size_t len);
+static bool proxy_flush(ProxyTransfer *t);
+static void proxy_collect(void);
+static void proxy_finish(ProxyTransfer *t);
+static void proxy_wait(void);
+static void proxy_detach_queue(shm_mq_handle *mqh);
+static size_t proxy_header_handler(void *buffer, size_t size, size_t nmemb, void *userp);
+static size_t proxy_body_handler(void *buffer, size_t size, size_t nmemb, void *userp);
+
+/*
+ * Define quasar_fdw.proxy, and when it's on ask for the shared memory and
+ * register the worker. Called from _PG_init; only does anything while
+ * being preloaded.
+ */
+extern void
+QuasarProxyInit(void)
+{
+    BackgroundWorker worker;
+
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+
+    DefineCustomBoolVariable("quasar_fdw.proxy",
+                             "Run scans through a shared proxy worker.",
+                             "The worker keeps warm, multiplexed connections to Quasar servers.",
+                             &proxy_enabled,
+                             false,
+                             PGC_POSTMASTER,
+                             0,
+                             NULL, NULL, NULL);
+
+    if (!proxy_enabled)
+        return;
+
+#if (PG_VERSION_NUM >= 150000)
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = proxy_shmem_request;
+#else
+    proxy_shmem_request();
+#endif
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = proxy_shmem_startup;
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+    worker.bgw_start_time = BgWorkerStart_ConsistentState;
+    worker.bgw_restart_time = 10;
+    snprintf(worker.bgw_name, BGW_MAXLEN, "quasar_fdw proxy");
+#if (PG_VERSION_NUM >= 110000)
+    snprintf(worker.bgw_type, BGW_MAXLEN, "quasar_fdw proxy");
+#endif
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "quasar_fdw");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "QuasarProxyMain");
+    RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * Hand a GET over to the proxy worker.
+ * NULL if there's no worker, or it's busy with PROXY_SLOTS requests.
+ */
+extern QuasarProxy *
+QuasarProxyStart(QuasarPool *pool, const char *url,
+                 const char *compression, long connect_timeout_ms,
+                 SubTransactionId subid)
+{
+    QuasarProxy *px;
+    dsm_segment *seg;
+    QuasarProxyRequest *req;
+    shm_mq *mq;
+    Size offset;
+    Latch *latch;
+    MemoryContext oldcontext;
+    int i;
+
+    if (proxy == NULL)
+        return NULL;
+
+    offset = proxy_queue_offset(strlen(url));
+    seg = dsm_create(offset + PROXY_QUEUE_SIZE, 0);
+    /*
+     * The request is on a backend-lifetime list, so keep the mapping until
+     * QuasarProxyStop rather than until the resource owner goes away
+     */
+    dsm_pin_mapping(seg);
+    req = (QuasarProxyRequest *) dsm_segment_address(seg);
+    req->cancelled = false;
+    req->connect_timeout_ms = connect_timeout_ms;
+    strlcpy(req->compression, compression, sizeof(req->compression));
+    strlcpy(req->socket_path, pool->socket_path != NULL ? pool->socket_path : "",
+            sizeof(req->socket_path));
+    strlcpy(req->ssl_ca_file, pool->tls.ca_file != NULL ? pool->tls.ca_file : "",
+            sizeof(req->ssl_ca_file));
+    strlcpy(req->ssl_cert, pool->tls.cert != NULL ? pool->tls.cert : "",
+            sizeof(req->ssl_cert));
+    strlcpy(req->ssl_key, pool->tls.key != NULL ? pool->tls.key : "",
+            sizeof(req->ssl_key));
+    req->ssl_verify = pool->tls.verify;
+    strcpy(req->url, url);
+
+    mq = shm_mq_create((char *) req + offset, PROXY_QUEUE_SIZE);
+    shm_mq_set_receiver(mq, MyProc);
+
+    LWLockAcquire(proxy->lock, LW_EXCLUSIVE);
+    latch = proxy->latch;
+    for (i = 0; latch != NULL && i < PROXY_SLOTS; ++i)
+    {
+        if (proxy->slots[i].state == PROXY_FREE)
+        {
+            proxy->slots[i].state = PROXY_SUBMITTED;
+            proxy->slots[i].handle = dsm_segment_handle(seg);
+            break;
+        }
+    }
+    LWLockRelease(proxy->lock);
+
+    if (latch == NULL || i == PROXY_SLOTS)
+    {
+        elog(DEBUG1, "quasar_fdw: proxy not available, doing the request ourselves");
+        dsm_detach(seg);
+        return NULL;
+    }
+    SetLatch(latch);
+
+    oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+    px = palloc0(sizeof(QuasarProxy));
+    px->seg = seg;
+    px->req = req;
+    px->mqh = shm_mq_attach(mq, seg, NULL);
+    px->subid = subid;
+    px->result = CURLE_OK;
+    requests = lappend(requests, px);
+    MemoryContextSwitchTo(oldcontext);
+
+    elog(DEBUG1, "quasar_fdw: proxying GET %s", url);
+
+    return px;
+}
+
+/* Cancel the request if it's still going and forget it */
+extern void
+QuasarProxyStop(QuasarProxy *px)
+{
+    px->req->cancelled = true;
+    if (!px->done && proxy != NULL)
+    {
+        /* Let the worker notice right away */
+        Latch *latch = proxy->latch;
+        if (latch != NULL)
+            SetLatch(latch);
+    }
+
+    requests = list_delete_ptr(requests, px);
+    proxy_detach_queue(px->mqh);
+    dsm_detach(px->seg);
+    pfree(px);
+}
+
+/* Stop every request left behind by an error */
+extern void
+QuasarProxyStopAll(void)
+{
+    while (requests != NIL)
+        QuasarProxyStop((QuasarProxy *) linitial(requests));
+}
+
+/* Stop the requests of scans started in an aborted subtransaction */
+extern void
+QuasarProxyStopSub(SubTransactionId subid)
+{
+    ListCell *lc;
+    List *pending;
+
+    /* QuasarProxyStop takes requests off the list */
+    pending = list_copy(requests);
+    foreach(lc, pending)
+    {
+        QuasarProxy *px = (QuasarProxy *) lfirst(lc);
+
+        if (px->subid >= subid)
+            QuasarProxyStop(px);
+    }
+    list_free(pending);
+}
+
+/*
+ * Next chunk of the response body, without waiting.
+ * 0 if there's none yet, or the response is over.
+ */
+extern size_t
+QuasarProxyReceive(QuasarProxy *px, const char **data)
+{
+    while (!px->done)
+    {
+        Size nbytes;
+        void *msg;
+        char *bytes;
+        shm_mq_result res;
+        int32 i32;
+
+        res = shm_mq_receive(px->mqh, &nbytes, &msg, true);
+        if (res == SHM_MQ_WOULD_BLOCK)
+            return 0;
+        if (res == SHM_MQ_DETACHED)
+        {
+            /* The worker went away mid-response */
+            px->done = true;
+            px->result = CURLE_RECV_ERROR;
+            return 0;
+        }
+
+        bytes = (char *) msg;
+        switch (bytes[0])
+        {
+        case PROXY_MSG_STATUS:
+            memcpy(&i32, bytes + 1, sizeof(int32));
+            px->status = i32;
+            break;
+        case PROXY_MSG_DATA:
+            *data = bytes + 1;
+            return nbytes - 1;
+        case PROXY_MSG_END:
+            memcpy(&i32, bytes + 1, sizeof(int32));
+            px->result = (CURLcode) i32;
+            memcpy(&px->received, bytes + 1 + sizeof(int32), sizeof(uint64));
+            px->done = true;
+            break;
+        }
+    }
+    return 0;
+}
+
+extern int
+QuasarProxyStatus(QuasarProxy *px)
+{
+    return px->status;
+}
+
+/* Whether the whole response has been received, and how it ended */
+extern bool
+QuasarProxyDone(QuasarProxy *px, CURLcode *result)
+{
+    *result = px->result;
+    return px->done;
+}
+
+/* Body bytes Quasar sent, known once done */
+extern uint64
+QuasarProxyReceived(QuasarProxy *px)
+{
+    return px->received;
+}
+
+/* Sleep until the worker sent something, timeout_ms passed or our latch is set */
+extern void
+QuasarProxyWait(QuasarProxy *px, long timeout_ms)
+{
+    int rc;
+
+#if (PG_VERSION_NUM >= 100000)
+    rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                   timeout_ms, PG_WAIT_EXTENSION);
+#else
+    rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                   timeout_ms);
+#endif
+
+    if (rc & WL_POSTMASTER_DEATH)
+        ereport(FATAL,
+                (errcode(ERRCODE_ADMIN_SHUTDOWN),
+                 errmsg("terminating connection due to unexpected postmaster exit")));
+    if (rc & WL_LATCH_SET)
+        ResetLatch(MyLatch);
+
+    CHECK_FOR_INTERRUPTS();
+}
+
+static void
+proxy_shmem_request(void)
+{
+#if (PG_VERSION_NUM >= 150000)
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+#endif
+    RequestAddinShmemSpace(sizeof(QuasarProxyShared));
+    RequestNamedLWLockTranche("quasar_fdw proxy", 1);
+}
+
+static void
+proxy_shmem_startup(void)
+{
+    bool found;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    proxy = ShmemInitStruct("quasar_fdw proxy", sizeof(QuasarProxyShared), &found);
+    if (!found)
+    {
+        memset(proxy, 0, sizeof(QuasarProxyShared));
+        proxy->lock = &(GetNamedLWLockTranche("quasar_fdw proxy"))->lock;
+    }
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/* Where the response queue starts in a request's segment */
+static Size
+proxy_queue_offset(size_t url_len)
+{
+    return MAXALIGN(offsetof(QuasarProxyRequest, url) + url_len + 1);
+}
+
+/*
+ * Worker functions
+ */
+
+void
+QuasarProxyMain(Datum arg)
+{
+    int i;
+
+    pqsignal(SIGTERM, proxy_sigterm);
+    BackgroundWorkerUnblockSignals();
+
+#ifdef _WIN32
+    curl_global_init(CURL_GLOBAL_WIN32);
+#else
+    curl_global_init(CURL_GLOBAL_NOTHING);
+#endif
+
+    multi = curl_multi_init();
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    /* Multiplexing appeared in curl 7.43.0 */
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long) PROXY_HOST_CONNECTIONS);
+    curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long) PROXY_MAX_CONNECTIONS);
+
+    /* Single threaded, so no locking */
+    share = curl_share_init();
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+    /* Whatever a previous incarnation was doing is lost */
+    LWLockAcquire(proxy->lock, LW_EXCLUSIVE);
+    for (i = 0; i < PROXY_SLOTS; ++i)
+        proxy->slots[i].state = PROXY_FREE;
+    proxy->latch = MyLatch;
+    LWLockRelease(proxy->lock);
+
+    elog(LOG, "quasar_fdw proxy started");
+
+    while (!got_sigterm)
+    {
+        ListCell *lc;
+        int running;
+
+        proxy_accept();
+
+        /* Get data going to backends which made room for it */
+        foreach(lc, transfers)
+            proxy_flush((ProxyTransfer *) lfirst(lc));
+
+        curl_multi_perform(multi, &running);
+        proxy_collect();
+
+        proxy_wait();
+    }
+
+    LWLockAcquire(proxy->lock, LW_EXCLUSIVE);
+    proxy->latch = NULL;
+    LWLockRelease(proxy->lock);
+
+    proc_exit(0);
+}
+
+static void
+proxy_sigterm(SIGNAL_ARGS)
+{
+    int save_errno = errno;
+
+    got_sigterm = true;
+    SetLatch(MyLatch);
+
+    errno = save_errno;
+}
+
+/* Pick up newly submitted requests */
+static void
+proxy_accept(void)
+{
+    int slots[PROXY_SLOTS];
+    dsm_handle handles[PROXY_SLOTS];
+    int i, n = 0;
+
+    LWLockAcquire(proxy->lock, LW_EXCLUSIVE);
+    for (i = 0; i < PROXY_SLOTS; ++i)
+    {
+        if (proxy->slots[i].state == PROXY_SUBMITTED)
+        {
+            proxy->slots[i].state = PROXY_RUNNING;
+            slots[n] = i;
+            handles[n++] = proxy->slots[i].handle;
+        }
+    }
+    LWLockRelease(proxy->lock);
+
+    for (i = 0; i < n; ++i)
+        proxy_start(slots[i], handles[i]);
+}
+
+static void
+proxy_start(int slot, dsm_handle handle)
+{
+    ProxyTransfer *t;
+    dsm_segment *seg;
+    QuasarProxyRequest *req;
+    shm_mq *mq;
+    MemoryContext oldcontext;
+
+    /* NULL if the backend has already given up on it */
+    seg = dsm_attach(handle);
+    if (seg == NULL)
+    {
+        LWLockAcquire(proxy->lock, LW_EXCLUSIVE);
+        proxy->slots[slot].state = PROXY_FREE;
+        LWLockRelease(proxy->lock);
+        return;
+    }
+
+    req = (QuasarProxyRequest *) dsm_segment_address(seg);
+    mq = (shm_mq *) ((char *) req + proxy_queue_offset(strlen(req->url)));
+    shm_mq_set_sender(mq, MyProc);
+
+    oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+    t = palloc0(sizeof(ProxyTransfer));
+    t->slot = slot;
+    t->seg = seg;
+    t->req = req;
+    t->mqh = shm_mq_attach(mq, seg, NULL);
+    initStringInfo(&t->pending);
+    t->curl = curl_easy_init();
+    transfers = lappend(transfers, t);
+    MemoryContextSwitchTo(oldcontext);
+
+    curl_easy_setopt(t->curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(t->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(t->curl, CURLOPT_URL, req->url);
+    curl_easy_setopt(t->curl, CURLOPT_ACCEPT_ENCODING, req->compression);
+    curl_easy_setopt(t->curl, CURLOPT_CONNECTTIMEOUT_MS, req->connect_timeout_ms);
+    curl_easy_setopt(t->curl, CURLOPT_SHARE, share);
+    if (req->socket_path[0] != '\0')
+        curl_easy_setopt(t->curl, CURLOPT_UNIX_SOCKET_PATH, req->socket_path);
+    if (req->ssl_ca_file[0] != '\0')
+        curl_easy_setopt(t->curl, CURLOPT_CAINFO, req->ssl_ca_file);
+    if (req->ssl_cert[0] != '\0')
+        curl_easy_setopt(t->curl, CURLOPT_SSLCERT, req->ssl_cert);
+    if (req->ssl_key[0] != '\0')
+        curl_easy_setopt(t->curl, CURLOPT_SSLKEY, req->ssl_key);
+    if (!req->ssl_verify)
+    {
+        curl_easy_setopt(t->curl, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt(t->curl, CURLOPT_SSL_VERIFYHOST, 0L);
+    }
+#ifdef CURL_HTTP_VERSION_2TLS
+    curl_easy_setopt(t->curl, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    /* Rather wait for a connection to multiplex on than open another */
+    curl_easy_setopt(t->curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+    curl_easy_setopt(t->curl, CURLOPT_PRIVATE, (char *) t);
+    curl_easy_setopt(t->curl, CURLOPT_HEADERFUNCTION, proxy_header_handler);
+    curl_easy_setopt(t->curl, CURLOPT_HEADERDATA, t);
+    curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, proxy_body_handler);
+    curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, t);
+
+    elog(DEBUG1, "quasar_fdw proxy: curling GET %s", req->url);
+    curl_multi_add_handle(multi, t->curl);
+}
+
+/*
+ * Send a message to the backend without blocking.
+ * If the queue is full, the message is kept pending and
+ * false is returned; proxy_flush sends it later.
+ */
+static bool
+proxy_send(ProxyTransfer *t, char kind, const void *data, size_t len)
+{
+    Assert(t->pending.len == 0);
+
+    appendStringInfoChar(&t->pending, kind);
+    appendBinaryStringInfo(&t->pending, data, len);
+    return proxy_flush(t);
+}
+
+/* Get the pending message out, if any. False while it's still stuck. */
+static bool
+proxy_flush(ProxyTransfer *t)
+{
+    shm_mq_result res;
+
+    if (t->pending.len == 0)
+        return true;
+
+    /* After a would-block shm_mq wants the same message again */
+#if (PG_VERSION_NUM >= 150000)
+    res = shm_mq_send(t->mqh, t->pending.len, t->pending.data, true, true);
+#else
+    res = shm_mq_send(t->mqh, t->pending.len, t->pending.data, true);
+#endif
+    if (res == SHM_MQ_WOULD_BLOCK)
+        return false;
+
+    resetStringInfo(&t->pending);
+
+    if (res == SHM_MQ_DETACHED)
+        t->req->cancelled = true;
+    else if (t->paused)
+    {
+        t->paused = false;
+        curl_easy_pause(t->curl, CURLPAUSE_CONT);
+    }
+    return true;
+}
+
+/* Finish transfers curl is done with or backends gave up on */
+static void
+proxy_collect(void)
+{
+    CURLMsg *msg;
+    ListCell *lc;
+    List *current;
+    int left;
+
+    while ((msg = curl_multi_info_read(multi, &left)) != NULL)
+    {
+        char *priv = NULL;
+        ProxyTransfer *t;
+
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+        t = (ProxyTransfer *) priv;
+        t->done = true;
+        t->result = msg->data.result;
+        curl_multi_remove_handle(multi, t->curl);
+    }
+
+    /* proxy_finish takes transfers off the list */
+    current = list_copy(transfers);
+    foreach(lc, current)
+    {
+        ProxyTransfer *t = (ProxyTransfer *) lfirst(lc);
+        char end[sizeof(int32) + sizeof(uint64)];
+        int32 result;
+#if LIBCURL_VERSION_NUM >= 0x073700
+        curl_off_t size = 0;
+#else
+        double size = 0;
+#endif
+        uint64 received;
+
+        if (t->req->cancelled)
+        {
+            proxy_finish(t);
+            continue;
+        }
+
+        /* The end goes out after everything else */
+        if (!t->done || !proxy_flush(t))
+            continue;
+        if (t->ending)
+        {
+            proxy_finish(t);
+            continue;
+        }
+
+        result = (int32) t->result;
+#if LIBCURL_VERSION_NUM >= 0x073700
+        curl_easy_getinfo(t->curl, CURLINFO_SIZE_DOWNLOAD_T, &size);
+#else
+        /* The curl_off_t variant appeared in curl 7.55.0 */
+        curl_easy_getinfo(t->curl, CURLINFO_SIZE_DOWNLOAD, &size);
+#endif
+        received = (uint64) size;
+        memcpy(end, &result, sizeof(int32));
+        memcpy(end + sizeof(int32), &received, sizeof(uint64));
+
+        t->ending = true;
+        if (proxy_send(t, PROXY_MSG_END, end, sizeof(end)))
+            proxy_finish(t);
+    }
+    list_free(current);
+}
+
+/* Forget a transfer and free its slot */
+static void
+proxy_finish(ProxyTransfer *t)
+{
+    if (!t->done)
+        curl_multi_remove_handle(multi, t->curl);
+    curl_easy_cleanup(t->curl);
+
+    transfers = list_delete_ptr(transfers, t);
+    proxy_detach_queue(t->mqh);
+    dsm_detach(t->seg);
+
+    LWLockAcquire(proxy->lock, LW_EXCLUSIVE);
+    proxy->slots[t->slot].state = PROXY_FREE;
+    LWLockRelease(proxy->lock);
+
+    pfree(t->pending.data);
+    pfree(t);
+}
+
+/*
+ * Sleep until a socket of ours is ready, curl's timer is due, or our
+ * latch is set: by a backend submitting, cancelling or reading from its
+ * queue, or by SIGTERM.
+ */
+static void
+proxy_wait(void)
+{
+    fd_set rfds, wfds, efds;
+    int maxfd = -1, fd, n, i;
+    long timeout;
+    WaitEventSet *set;
+    WaitEvent events[4];
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_ZERO(&efds);
+    curl_multi_fdset(multi, &rfds, &wfds, &efds, &maxfd);
+    curl_multi_timeout(multi, &timeout);
+
+    /* No socket yet (say, resolving): check back soon */
+    if (maxfd < 0 && transfers != NIL && (timeout < 0 || timeout > 100))
+        timeout = 100;
+    if (timeout < 0 || timeout > PROXY_IDLE_WAIT_MS)
+        timeout = PROXY_IDLE_WAIT_MS;
+
+#if (PG_VERSION_NUM >= 170000)
+    set = CreateWaitEventSet(NULL, maxfd + 3);
+#else
+    set = CreateWaitEventSet(CurrentMemoryContext, maxfd + 3);
+#endif
+    AddWaitEventToSet(set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+    AddWaitEventToSet(set, WL_POSTMASTER_DEATH, PGINVALID_SOCKET, NULL, NULL);
+    for (fd = 0; fd <= maxfd; ++fd)
+    {
+        uint32 ev = 0;
+
+        if (FD_ISSET(fd, &rfds))
+            ev |= WL_SOCKET_READABLE;
+        if (FD_ISSET(fd, &wfds))
+            ev |= WL_SOCKET_WRITEABLE;
+        if (ev != 0)
+            AddWaitEventToSet(set, ev, fd, NULL, NULL);
+    }
+
+#if (PG_VERSION_NUM >= 100000)
+    n = WaitEventSetWait(set, timeout, events, lengthof(events), PG_WAIT_EXTENSION);
+#else
+    n = WaitEventSetWait(set, timeout, events, lengthof(events));
+#endif
+    FreeWaitEventSet(set);
+
+    for (i = 0; i < n; ++i)
+    {
+        if (events[i].events & WL_LATCH_SET)
+            ResetLatch(MyLatch);
+        else if (events[i].events & WL_POSTMASTER_DEATH)
+            proc_exit(1);
+    }
+}
+
+static void
+proxy_detach_queue(shm_mq_handle *mqh)
+{
+#if (PG_VERSION_NUM >= 100000)
+    shm_mq_detach(mqh);
+#else
+    shm_mq_detach(shm_mq_get_queue(mqh));
+    pfree(mqh);
+#endif
+}
+
+/*
+ * Sends the status once the headers are complete. curl knows the
+ * status code whatever the HTTP version, so it is asked rather than
+ * parsing the status line.
+ */
+static size_t
+proxy_header_handler(void *buffer, size_t size, size_t nmemb, void *userp)
+{
+    ProxyTransfer *t = (ProxyTransfer *) userp;
+    size_t segsize = size * nmemb;
+    long code = 0;
+    int32 status;
+
+    if (!(segsize == 2 && memcmp(buffer, "\r\n", 2) == 0))
+        return segsize;
+
+    curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &code);
+    /* Skip interim responses */
+    if (code < 200)
+        return segsize;
+
+    status = (int32) code;
+    proxy_send(t, PROXY_MSG_STATUS, &status, sizeof(int32));
+    return segsize;
+}
+
+static size_t
+proxy_body_handler(void *buffer, size_t size, size_t nmemb, void *userp)
+{
+    ProxyTransfer *t = (ProxyTransfer *) userp;
+    size_t segsize = size * nmemb;
+
+    if (t->req->cancelled)
+        return 0;
+
+    /* Hold everything in curl until the backend has caught up */
+    if (t->pending.len > 0)
+    {
+        t->paused = true;
+        return CURL_WRITEFUNC_PAUSE;
+    }
+
+    proxy_send(t, PROXY_MSG_DATA, buffer, segsize);
+    return segsize;
+}
+
+#else  /* PG_VERSION_NUM */
+
+/* DSM, shm_mq and wait event sets need 9.6 */
+
+extern void
+QuasarProxyInit(void)
+{
+}
+
+extern QuasarProxy *
+QuasarProxyStart(QuasarPool *pool, const char *url,
+                 const char *compression, long connect_timeout_ms,
+                 SubTransactionId subid)
+{
+    return NULL;
+}
+
+extern void
+QuasarProxyStop(QuasarProxy *px)
+{
+}
+
+extern void
+QuasarProxyStopAll(void)
+{
+}
+
+extern void
+QuasarProxyStopSub(SubTransactionId subid)
+{
+}
+
+extern size_t
+QuasarProxyReceive(QuasarProxy *px, const char **data)
+{
+    return 0;
+}
+
+extern int
+QuasarProxyStatus(QuasarProxy *px)
+{
+    return 0;
+}
+
+extern bool
+QuasarProxyDone(QuasarProxy *px, CURLcode *result)
+{
+    return true;
+}
+
+extern uint64
+QuasarProxyReceived(QuasarProxy *px)
+{
+    return 0;
+}
+
+extern void
+QuasarProxyWait(QuasarProxy *px, long timeout_ms)
+{
+}
+
+#endif /* PG_VERSION_NUM */
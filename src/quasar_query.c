@@ -37,7 +37,12 @@
 #include "datatype/timestamp.h"
 #include "nodes/nodeFuncs.h"
 #include "optimizer/clauses.h"
+#if (PG_VERSION_NUM >= 120000)
+#include "access/table.h"
+#include "optimizer/optimizer.h"
+#else
 #include "optimizer/var.h"
+#endif
 #include "parser/parsetree.h"
 #include "pgtime.h"
 #include "utils/builtins.h"
@@ -761,7 +766,11 @@ deparseSelectSql(StringInfo buf,
      * Core code already has some lock on each rel being planned, so we can
      * use NoLock here.
      */
+#if (PG_VERSION_NUM >= 120000)
+    rel = table_open(rte->relid, NoLock);
+#else
     rel = heap_open(rte->relid, NoLock);
+#endif
 
     /*
      * Construct SELECT list
@@ -773,7 +782,7 @@ deparseSelectSql(StringInfo buf,
     else
 #if(PG_VERSION_NUM >= 90500)
         deparsePushdownTargetList(buf, root, baserel->relid, rel,
-                                  baserel->reltargetlist, attrs_used,
+                                  QUASAR_REL_TARGETLIST(baserel), attrs_used,
                                   scan_tlist);
 #else /* PG_VERSION_NUM >= 90500 */
         deparseTargetList(buf, root, baserel->relid, rel, attrs_used);
@@ -785,7 +794,11 @@ deparseSelectSql(StringInfo buf,
     appendStringInfoString(buf, " FROM ");
     deparseRelation(buf, rel);
 
+#if (PG_VERSION_NUM >= 120000)
+    table_close(rel, NoLock);
+#else
     heap_close(rel, NoLock);
+#endif
 }
 
 #if(PG_VERSION_NUM >= 90500)
@@ -824,7 +837,7 @@ deparsePushdownTargetList(StringInfo buf,
     first = true;
     for (i = 1; i <= tupdesc->natts; i++)
     {
-        Form_pg_attribute attr = tupdesc->attrs[i - 1];
+        Form_pg_attribute attr = TupleDescAttr(tupdesc, i - 1);
 
         /* Ignore dropped attributes. */
         if (attr->attisdropped)
@@ -876,7 +889,7 @@ deparseTargetList(StringInfo buf,
     first = true;
     for (i = 1; i <= tupdesc->natts; i++)
     {
-        Form_pg_attribute attr = tupdesc->attrs[i - 1];
+        Form_pg_attribute attr = TupleDescAttr(tupdesc, i - 1);
 
         /* Ignore dropped attributes. */
         if (attr->attisdropped)
@@ -989,7 +1002,11 @@ deparseColumnRef(StringInfo buf, int varno, int varattno, PlannerInfo *root, boo
     }
 
     /* Set the pgname */
+#if (PG_VERSION_NUM >= 110000)
+    pgname = get_attname(rte->relid, varattno, false);
+#else
     pgname = get_relid_attribute_name(rte->relid, varattno);
+#endif
 
     /* If we are in the selector part of the query
      * AND we are mapping the name, emit AS syntax */
@@ -1595,6 +1612,33 @@ appendOrderByClause(StringInfo buf, PlannerInfo *root, RelOptInfo *baserel,
     }
 }
 
+/*
+ * Deparse the keyset condition of a resumed scan, which skips the rows up
+ * to the last one the scan returned: its resume key is parameter
+ * paramindex. If no WHERE clause already exists in the buffer, is_first
+ * should be true.
+ */
+void
+appendResumeCondition(StringInfo buf, PlannerInfo *root, RelOptInfo *baserel,
+                      AttrNumber attnum, int paramindex, bool is_first)
+{
+    appendStringInfoString(buf, is_first ? " WHERE (" : " AND (");
+    deparseColumnRef(buf, baserel->relid, attnum, root, false);
+    appendStringInfo(buf, " > :p%d)", paramindex);
+}
+
+/*
+ * Deparse the ORDER BY of a resumable scan which hasn't got one of its own
+ */
+void
+appendResumeOrderBy(StringInfo buf, PlannerInfo *root, RelOptInfo *baserel,
+                    AttrNumber attnum)
+{
+    appendStringInfoString(buf, " ORDER BY ");
+    deparseColumnRef(buf, baserel->relid, attnum, root, false);
+    appendStringInfoString(buf, " ASC");
+}
+
 
 /* Quasar Identifier auto-quoter.
  * transforms `top[*].mid.bot[0]` to `"top"[*]."mid"."bot"[0]`
@@ -0,0 +1,20 @@
+/* Async Append (PostgreSQL 14 or later) */
+CREATE FOREIGN TABLE smallzips_async1(city varchar, pop integer, state char(2))
+       SERVER quasar OPTIONS (table 'smallZips', async_capable 'true');
+CREATE FOREIGN TABLE smallzips_async2(city varchar, pop integer, state char(2))
+       SERVER quasar OPTIONS (table 'smallZips', async_capable 'true');
+SET enable_async_append = on;
+EXPLAIN (COSTS off) SELECT * FROM smallzips_async1 UNION ALL SELECT * FROM smallzips_async2;
+CREATE TEMP TABLE async_rows AS
+       SELECT * FROM smallzips_async1 UNION ALL SELECT * FROM smallzips_async2;
+SELECT * FROM async_rows ORDER BY city, pop LIMIT 4;
+/* The synchronous plan returns the same rows */
+SET enable_async_append = off;
+EXPLAIN (COSTS off) SELECT * FROM smallzips_async1 UNION ALL SELECT * FROM smallzips_async2;
+CREATE TEMP TABLE sync_rows AS
+       SELECT * FROM smallzips_async1 UNION ALL SELECT * FROM smallzips_async2;
+SELECT * FROM async_rows EXCEPT ALL SELECT * FROM sync_rows;
+SELECT * FROM sync_rows EXCEPT ALL SELECT * FROM async_rows;
+RESET enable_async_append;
+DROP TABLE async_rows, sync_rows;
+DROP FOREIGN TABLE smallzips_async1, smallzips_async2;
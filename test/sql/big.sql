@@ -1,2 +1,11 @@
 /* Test a big query */
 SELECT * FROM zips ORDER BY state, city, pop;
+/* Test a query too long for a GET, which is POSTed */
+SELECT * FROM smallzips WHERE city !~~ repeat('X', 1600) ORDER BY city LIMIT 3;
+/* A scan split into windows returns the same rows as a plain one */
+CREATE FOREIGN TABLE zips_streams(city varchar, pop integer, state char(2))
+       SERVER quasar OPTIONS (table 'zips', use_remote_estimate 'true',
+                              parallel_streams '4', parallel_min_rows '1');
+SELECT * FROM zips_streams EXCEPT ALL SELECT * FROM zips;
+SELECT * FROM zips EXCEPT ALL SELECT * FROM zips_streams;
+DROP FOREIGN TABLE zips_streams;
@@ -0,0 +1,33 @@
+/* Values decoded straight from the response, and the input function fallbacks */
+CREATE FOREIGN TABLE decode_smallzips
+       (city varchar
+       ,pop integer
+       ,popsmall smallint OPTIONS (map 'pop')
+       ,loc0 float OPTIONS (map 'loc[0]')
+       ,state char(3)
+       ,city5 varchar(5) OPTIONS (map 'city'))
+       SERVER quasar OPTIONS (table 'smallZips');
+CREATE FOREIGN TABLE decode_zips(city varchar, popsmall smallint OPTIONS (map 'pop'))
+       SERVER quasar OPTIONS (table 'zips');
+/* Imported from test/data/datetimes.json by make import-test-data */
+CREATE FOREIGN TABLE decode_datetimes
+       (n integer
+       ,ts timestamp
+       ,tstz timestamptz OPTIONS (map 'ts')
+       ,d date)
+       SERVER quasar OPTIONS (table 'fdw_datetimes');
+/* Quasar sends pop as a float, the .0 is stripped for smallint and integer */
+SELECT pop, popsmall, loc0 FROM decode_smallzips WHERE loc0 < -70 ORDER BY pop LIMIT 3;
+/* Out of range integers are left to the input function */
+SELECT popsmall FROM decode_zips WHERE city = 'M M';
+/* char(n) is padded to its length */
+SELECT city, state, octet_length(state) AS bytes FROM decode_smallzips ORDER BY city LIMIT 3;
+/* varchar(n) takes values up to its length, longer ones are left to the input function */
+SELECT city5 FROM decode_smallzips WHERE city = 'ADAMS';
+SELECT city5 FROM decode_smallzips WHERE city = 'AGAWAM';
+/* Time zones as Z, +HH, +HHMM and +HH:MM; timestamptz without one is in the session's */
+SELECT n, ts, tstz FROM decode_datetimes WHERE n <= 5 ORDER BY n;
+/* Leap days only in leap years */
+SELECT d, ts FROM decode_datetimes WHERE n = 6;
+SELECT d FROM decode_datetimes WHERE n = 7;
+SELECT ts FROM decode_datetimes WHERE n = 7;
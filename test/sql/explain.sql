@@ -68,3 +68,10 @@ EXPLAIN (COSTS off) SELECT loc FROM zipsloc WHERE loc[1+1] > 0;
 /* Scalar array ops */
 EXPLAIN (COSTS off) SELECT * FROM smallzips WHERE state IN ('MA', 'CA');
 EXPLAIN (COSTS off) SELECT * FROM smallzips WHERE state IN ('MA');
+/* resume_key orders scans by it */
+CREATE FOREIGN TABLE zips_resume(city varchar, pop integer, state char(2))
+       SERVER quasar OPTIONS (table 'smallZips', resume_key 'city');
+EXPLAIN (COSTS off) SELECT * FROM zips_resume WHERE state = 'MA';
+/* The resume key is fetched even when it's not selected */
+EXPLAIN (COSTS off) SELECT pop FROM zips_resume WHERE state = 'MA';
+DROP FOREIGN TABLE zips_resume;
@@ -6,6 +6,18 @@ CREATE SERVER o_quasar1 FOREIGN DATA WRAPPER quasar_fdw OPTIONS (wrong 'foo');
 CREATE SERVER o_quasar2 FOREIGN DATA WRAPPER quasar_fdw OPTIONS (server 'http://localhost:8080', path '/local/quasar', server 'http://localhost:8080');
 /* timeout_ms 0 is illegal */
 CREATE SERVER o_quasar3 FOREIGN DATA WRAPPER quasar_fdw OPTIONS (server 'http://localhost:8080', path '/local/quasar', timeout_ms '0');
+/* unknown compression is illegal */
+CREATE SERVER o_quasar4 FOREIGN DATA WRAPPER quasar_fdw OPTIONS (compression 'lzma');
+/* socket_path is superuser-only */
+CREATE ROLE regress_quasar_user;
+GRANT USAGE ON FOREIGN DATA WRAPPER quasar_fdw TO regress_quasar_user;
+SET ROLE regress_quasar_user;
+CREATE SERVER o_quasar5 FOREIGN DATA WRAPPER quasar_fdw OPTIONS (socket_path '/tmp/.s.PGSQL.5432');
+RESET ROLE;
+CREATE SERVER o_quasar5 FOREIGN DATA WRAPPER quasar_fdw OPTIONS (socket_path '/tmp/quasar.sock');
+DROP SERVER o_quasar5;
+REVOKE USAGE ON FOREIGN DATA WRAPPER quasar_fdw FROM regress_quasar_user;
+DROP ROLE regress_quasar_user;
 /* CREATE TABLE options checks */
 CREATE FOREIGN TABLE o_ft0(id integer) SERVER o_quasar;
 /* wrong options are illegal */
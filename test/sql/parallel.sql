@@ -0,0 +1,15 @@
+/* Parallel scans (PostgreSQL 9.6 or later) */
+CREATE FOREIGN TABLE zips_parallel(city varchar, pop integer, state char(2))
+       SERVER quasar OPTIONS (table 'zips', use_remote_estimate 'true',
+                              parallel_scan 'true', parallel_min_rows '1');
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET max_parallel_workers_per_gather = 2;
+EXPLAIN (COSTS off) SELECT * FROM zips_parallel;
+/* Workers and the leader together return the rows of a plain scan */
+SELECT * FROM zips_parallel EXCEPT ALL SELECT * FROM zips;
+SELECT * FROM zips EXCEPT ALL SELECT * FROM zips_parallel;
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+RESET max_parallel_workers_per_gather;
+DROP FOREIGN TABLE zips_parallel;